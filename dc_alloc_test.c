@@ -0,0 +1,125 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Check that a locate answered from the DC cache, into a caller's buffer
+ * with dc_locate_buf(), makes no heap allocation.  The test puts one
+ * entry in the cache with dc_cache_enter() and locates it repeatedly, so
+ * nothing is ever sent.  Allocations are counted by test_alloc.c, as in
+ * lsa_bench.
+ *
+ *	./dc_alloc_test
+ *
+ * Exits non-zero if any check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dc_locate.h"
+#include "dc_cache.h"
+#include "lsa_alloc.h"
+#include "test_alloc.h"
+#include "test_check.h"
+
+#define	TEST_PREFIX	"_ldap._tcp.dc._msdcs"
+#define	TEST_DOMAIN	"w2k8.ma.nexenta.com"
+#define	TEST_SITE	"Default-First-Site-Name"
+#define	TEST_DC		"w2k8-dc1.w2k8.ma.nexenta.com"
+#define	TEST_ADDR	"::ffff:192.168.1.10"
+#define	TEST_LOOPS	1000
+
+static int
+test_same(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a == b);
+	return (strcmp(a, b) == 0);
+}
+
+int
+main(void)
+{
+	DOMAIN_CONTROLLER_INFO src, dci;
+	struct sockaddr_in6 addr;
+	char buf[DCI_BUFSZ], small[16];
+	uint64_t before, n;
+	int i, rc = 0;
+
+	(void) memset(&src, 0, sizeof (src));
+	src.DomainControllerName = "\\\\" TEST_DC;
+	src.DomainName = TEST_DOMAIN;
+	src.DnsForestName = TEST_DOMAIN;
+	src.DcSiteName = TEST_SITE;
+	src.ClientSiteName = TEST_SITE;
+	src.Flags = DS_DS_FLAG | DS_KDC_FLAG | DS_CLOSEST_FLAG;
+	(void) memset(src.DomainGuid, 0xa5, sizeof (src.DomainGuid));
+
+	(void) memset(&addr, 0, sizeof (addr));
+	addr.sin6_family = AF_INET6;
+	(void) inet_pton(AF_INET6, TEST_ADDR, &addr.sin6_addr);
+
+	dc_cache_rele(dc_cache_enter(TEST_PREFIX, TEST_DOMAIN, TEST_SITE,
+	    &src, &addr));
+
+	/*
+	 * Once, so anything the C library sets up on first use is not
+	 * counted against the locator.
+	 */
+	(void) dc_locate_buf(TEST_PREFIX, TEST_DOMAIN, TEST_SITE, DCL_F_CACHE,
+	    0, &dci, buf, sizeof (buf));
+
+	before = test_nallocs;
+	for (i = 0; i < TEST_LOOPS && rc == 0; i++)
+		rc = dc_locate_buf(TEST_PREFIX, TEST_DOMAIN, TEST_SITE,
+		    DCL_F_CACHE, 0, &dci, buf, sizeof (buf));
+	n = test_nallocs - before;
+	test_check(rc == 0, "cache hit found");
+	test_check(n == 0, "cache hit allocates nothing");
+
+	test_check(test_same(dci.DomainControllerName,
+	    src.DomainControllerName), "DomainControllerName");
+	test_check(test_same(dci.DomainControllerAddress, "\\\\" TEST_ADDR),
+	    "DomainControllerAddress");
+	test_check(test_same(dci.DomainName, src.DomainName), "DomainName");
+	test_check(test_same(dci.DnsForestName, src.DnsForestName),
+	    "DnsForestName");
+	test_check(test_same(dci.DcSiteName, src.DcSiteName), "DcSiteName");
+	test_check(test_same(dci.ClientSiteName, src.ClientSiteName),
+	    "ClientSiteName");
+	test_check(dci.Flags == src.Flags, "Flags");
+	test_check(memcmp(dci.DomainGuid, src.DomainGuid,
+	    sizeof (dci.DomainGuid)) == 0, "DomainGuid");
+	test_check(dci.DomainControllerName >= buf &&
+	    dci.DomainControllerName < buf + sizeof (buf),
+	    "strings are in the caller's buffer");
+
+	before = test_nallocs;
+	errno = 0;
+	rc = dc_locate_buf(TEST_PREFIX, TEST_DOMAIN, TEST_SITE, DCL_F_CACHE,
+	    0, &dci, small, sizeof (small));
+	n = test_nallocs - before;
+	test_check(rc == -1 && errno == ERANGE,
+	    "short buffer fails with ERANGE");
+	test_check(n == 0, "short buffer allocates nothing");
+
+	dc_cache_flush();
+
+	return (test_done());
+}
@@ -0,0 +1,778 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Cache of locate results.
+ *
+ * Three tables:
+ *  - interned strings, reference counted by the entries using them;
+ *  - one node per distinct DC, holding the DC's current entry;
+ *  - one slot per locate query (prefix, domain and site), pointing at
+ *    the entry of the DC that answered it, with an expiry time.
+ *
+ * Memory grows with the number of distinct DCs and queries, not with the
+ * number of lookups.
+ *
+ * Changes are made under dcc_lock; lookups take no lock.  A reader marks
+ * itself as inside the tables by storing the current epoch in a reader
+ * record of its own, and clears it on the way out.  Nodes and slots are
+ * linked in fully built, and a slot's entry and expiry are changed
+ * together under its generation count, which a reader checks to see that
+ * it read a consistent pair.  Whatever a change unlinks or stops pointing
+ * at is freed, or has its reference dropped, only after dcc_sync() has
+ * seen every reader that might still be looking at it leave.
+ *
+ * dc_cache_get() writes only to the thread's own reader record and
+ * metrics, so gets from many threads do not slow each other down.
+ * dc_cache_lookup() also takes a reference on the entry it returns, an
+ * atomic add to a count that every thread holding that entry shares.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sched.h>
+#include <pthread.h>
+#include <atomic.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include "dc_cache.h"
+#include "lsa_alloc.h"
+#include "lsa_metrics.h"
+#include "lsa_rate.h"
+
+#define	DCC_NBUCKETS	64	/* power of 2 */
+#define	DCC_BUCKET(h)	((h) & (DCC_NBUCKETS - 1))
+
+typedef struct dcc_str {
+	struct dcc_str	*cs_next;
+	uint32_t	cs_hash;
+	uint32_t	cs_refcnt;
+	char		cs_str[1];
+} dcc_str_t;
+
+typedef struct dcc_node {
+	struct dcc_node	*cn_next;
+	dc_cache_ent_t	*cn_ent;
+} dcc_node_t;
+
+typedef struct dcc_slot {
+	struct dcc_slot	*cq_next;
+	uint32_t	cq_hash;
+	const char	*cq_key;	/* interned */
+	volatile uint32_t cq_gen;	/* odd while being changed */
+	dc_cache_ent_t	*cq_ent;
+	hrtime_t	cq_expires;
+} dcc_slot_t;
+
+/*
+ * One per thread that has looked anything up.  The padding keeps each
+ * reader's epoch on cache lines no other reader writes.
+ */
+typedef struct dcc_reader {
+	char			dr_pad0[64];
+	volatile uint64_t	dr_epoch;	/* 0 outside the tables */
+	volatile uint32_t	dr_inuse;
+	struct dcc_reader	*dr_next;
+	char			dr_pad1[64];
+} dcc_reader_t;
+
+static pthread_mutex_t dcc_lock = PTHREAD_MUTEX_INITIALIZER;
+static dcc_str_t *dcc_strs[DCC_NBUCKETS];
+static dcc_node_t *dcc_nodes[DCC_NBUCKETS];
+static dcc_slot_t *dcc_slots[DCC_NBUCKETS];
+
+static volatile uint64_t dcc_epoch = 1;
+static dcc_reader_t *dcc_readers;
+static pthread_key_t dcc_reader_key;
+static pthread_once_t dcc_reader_once = PTHREAD_ONCE_INIT;
+static __thread dcc_reader_t *dcc_self;
+
+/*
+ * A thread's reader record is given back when the thread exits.
+ */
+static void
+dcc_reader_done(void *arg)
+{
+	dcc_reader_t *dr = arg;
+
+	dr->dr_epoch = 0;
+	membar_exit();
+	dr->dr_inuse = 0;
+}
+
+static void
+dcc_reader_init(void)
+{
+	(void) pthread_key_create(&dcc_reader_key, dcc_reader_done);
+}
+
+/*
+ * Give the calling thread a reader record, reusing one an exited thread
+ * gave back if there is one.  Records are never freed.
+ */
+static dcc_reader_t *
+dcc_reader_get(void)
+{
+	dcc_reader_t *dr, *next;
+
+	(void) pthread_once(&dcc_reader_once, dcc_reader_init);
+	for (dr = dcc_readers; dr != NULL; dr = dr->dr_next)
+		if (dr->dr_inuse == 0 &&
+		    atomic_cas_32(&dr->dr_inuse, 0, 1) == 0)
+			break;
+
+	if (dr == NULL) {
+		if ((dr = lsa_calloc(LSA_ALLOC_CACHE, 1, sizeof (*dr))) == NULL)
+			return (NULL);
+		dr->dr_inuse = 1;
+		do {
+			next = dcc_readers;
+			dr->dr_next = next;
+			membar_producer();
+		} while (atomic_cas_ptr(&dcc_readers, next, dr) != next);
+	}
+
+	(void) pthread_setspecific(dcc_reader_key, dr);
+	dcc_self = dr;
+	return (dr);
+}
+
+/*
+ * Enter the tables to read them.  Returns the caller's reader record, or
+ * NULL if it could not have one, in which case dcc_lock is held instead.
+ */
+static dcc_reader_t *
+dcc_enter(void)
+{
+	dcc_reader_t *dr;
+
+	if ((dr = dcc_self) == NULL && (dr = dcc_reader_get()) == NULL) {
+		(void) pthread_mutex_lock(&dcc_lock);
+		return (NULL);
+	}
+	dr->dr_epoch = dcc_epoch;
+	membar_enter();
+	return (dr);
+}
+
+static void
+dcc_exit(dcc_reader_t *dr)
+{
+	if (dr == NULL) {
+		(void) pthread_mutex_unlock(&dcc_lock);
+		return;
+	}
+	membar_exit();
+	dr->dr_epoch = 0;
+}
+
+/*
+ * Wait until every reader that might have seen what the caller has just
+ * unlinked has left the tables.  Called with dcc_lock held, after the
+ * change and before anything it let go of is freed.
+ */
+static void
+dcc_sync(void)
+{
+	dcc_reader_t *dr;
+	uint64_t epoch;
+
+	epoch = atomic_inc_64_nv(&dcc_epoch);
+	membar_enter();
+	for (dr = dcc_readers; dr != NULL; dr = dr->dr_next)
+		while (dr->dr_epoch != 0 && dr->dr_epoch < epoch)
+			(void) sched_yield();
+}
+
+/*
+ * FNV-1a, folding case so that query keys differing only in case meet.
+ */
+static uint32_t
+dcc_hash(const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	while (*s != '\0') {
+		h ^= (uchar_t)tolower((uchar_t)*s++);
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static int
+dcc_key(char *buf, size_t len, const char *prefix, const char *dname,
+    const char *site)
+{
+	if (snprintf(buf, len, "%s.%s/%s", prefix, dname,
+	    (site != NULL) ? site : "") >= len)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Take a reference on the interned copy of s, making one if needed.
+ */
+static const char *
+dcc_intern(const char *s)
+{
+	uint32_t h;
+	dcc_str_t *cs;
+	size_t len;
+
+	if (s == NULL)
+		return (NULL);
+
+	h = dcc_hash(s);
+	for (cs = dcc_strs[DCC_BUCKET(h)]; cs != NULL; cs = cs->cs_next) {
+		if (cs->cs_hash == h && strcmp(cs->cs_str, s) == 0) {
+			cs->cs_refcnt++;
+			return (cs->cs_str);
+		}
+	}
+
+	len = strlen(s);
+	if ((cs = lsa_malloc(LSA_ALLOC_CACHE,
+	    offsetof(dcc_str_t, cs_str) + len + 1)) == NULL)
+		return (NULL);
+	cs->cs_hash = h;
+	cs->cs_refcnt = 1;
+	(void) memcpy(cs->cs_str, s, len + 1);
+	cs->cs_next = dcc_strs[DCC_BUCKET(h)];
+	dcc_strs[DCC_BUCKET(h)] = cs;
+	return (cs->cs_str);
+}
+
+static void
+dcc_unintern(const char *s)
+{
+	dcc_str_t *cs, **csp;
+
+	if (s == NULL)
+		return;
+
+	cs = (dcc_str_t *)(s - offsetof(dcc_str_t, cs_str));
+	if (--cs->cs_refcnt > 0)
+		return;
+
+	for (csp = &dcc_strs[DCC_BUCKET(cs->cs_hash)]; *csp != cs;
+	    csp = &(*csp)->cs_next)
+		;
+	*csp = cs->cs_next;
+	free(cs);
+}
+
+static void
+dcc_ent_free(dc_cache_ent_t *ent)
+{
+	dcc_unintern(ent->dce_dcname);
+	dcc_unintern(ent->dce_domain);
+	dcc_unintern(ent->dce_forest);
+	dcc_unintern(ent->dce_dcsite);
+	dcc_unintern(ent->dce_clientsite);
+	free(ent);
+}
+
+/*
+ * Drop a reference with dcc_lock held.
+ */
+static void
+dcc_rele_locked(dc_cache_ent_t *ent)
+{
+	if (atomic_dec_32_nv(&ent->dce_refcnt) == 0)
+		dcc_ent_free(ent);
+}
+
+void
+dc_cache_hold(dc_cache_ent_t *ent)
+{
+	atomic_inc_32(&ent->dce_refcnt);
+}
+
+void
+dc_cache_rele(dc_cache_ent_t *ent)
+{
+	if (ent == NULL || atomic_dec_32_nv(&ent->dce_refcnt) > 0)
+		return;
+
+	/*
+	 * The tables hold references of their own, so nothing can find
+	 * an entry whose count has reached zero; only the strings need
+	 * the lock.
+	 */
+	(void) pthread_mutex_lock(&dcc_lock);
+	dcc_ent_free(ent);
+	(void) pthread_mutex_unlock(&dcc_lock);
+}
+
+static dcc_slot_t *
+dcc_slot_find(const char *key, uint32_t h, dcc_slot_t ***prevp)
+{
+	dcc_slot_t *cq, **cqp;
+
+	for (cqp = &dcc_slots[DCC_BUCKET(h)]; (cq = *cqp) != NULL;
+	    cqp = &cq->cq_next) {
+		membar_consumer();
+		if (cq->cq_hash == h && strcasecmp(cq->cq_key, key) == 0) {
+			if (prevp != NULL)
+				*prevp = cqp;
+			return (cq);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Change a slot's entry and expiry.  Called with dcc_lock held.
+ */
+static void
+dcc_slot_set(dcc_slot_t *cq, dc_cache_ent_t *ent, hrtime_t expires)
+{
+	cq->cq_gen++;
+	membar_producer();
+	cq->cq_ent = ent;
+	cq->cq_expires = expires;
+	membar_producer();
+	cq->cq_gen++;
+}
+
+/*
+ * Find the unexpired entry for a query key, from inside the tables.  *mp
+ * is set to what the lookup counts as.
+ */
+static dc_cache_ent_t *
+dcc_lookup(const char *key, lsa_metric_t *mp)
+{
+	dc_cache_ent_t *ent;
+	dcc_slot_t *cq;
+	hrtime_t expires;
+	uint32_t gen;
+
+	*mp = LSA_M_CACHE_MISS;
+	if ((cq = dcc_slot_find(key, dcc_hash(key), NULL)) == NULL)
+		return (NULL);
+
+	do {
+		while (((gen = cq->cq_gen) & 1) != 0)
+			;
+		membar_consumer();
+		ent = cq->cq_ent;
+		expires = cq->cq_expires;
+		membar_consumer();
+	} while (cq->cq_gen != gen);
+
+	if (expires <= gethrtime()) {
+		*mp = LSA_M_CACHE_REFRESH;
+		return (NULL);
+	}
+	*mp = LSA_M_CACHE_HIT;
+	return (ent);
+}
+
+/*
+ * Look up the DC that last answered a locate for prefix.dname, in a site
+ * if one is given.  Returns a held entry, or NULL if there is none or it
+ * has expired.
+ */
+dc_cache_ent_t *
+dc_cache_lookup(const char *prefix, const char *dname, const char *site)
+{
+	char key[2 * NS_MAXDNAME];
+	dc_cache_ent_t *ent;
+	dcc_reader_t *dr;
+	lsa_metric_t m;
+
+	if (dcc_key(key, sizeof (key), prefix, dname, site) != 0)
+		return (NULL);
+
+	dr = dcc_enter();
+	if ((ent = dcc_lookup(key, &m)) != NULL)
+		dc_cache_hold(ent);
+	dcc_exit(dr);
+
+	lsa_metrics_count(LSA_METRICS_DOMAIN, dname, m, 1);
+	return (ent);
+}
+
+/*
+ * Look up a query as dc_cache_lookup() does, and expand the entry into
+ * the caller's dci and buf as dc_cache_fill() does, and its address into
+ * *addr if addr is not NULL.  No reference is taken on the entry.
+ * Returns 0, or -1 with errno set to ENOENT if nothing usable is cached
+ * or ERANGE if buf is too small.
+ */
+int
+dc_cache_get(const char *prefix, const char *dname, const char *site,
+    DOMAIN_CONTROLLER_INFO *dci, char *buf, size_t len,
+    struct sockaddr_in6 *addr)
+{
+	char key[2 * NS_MAXDNAME];
+	dc_cache_ent_t *ent;
+	dcc_reader_t *dr;
+	lsa_metric_t m;
+	int rc = -1, err = ENOENT;
+
+	if (dcc_key(key, sizeof (key), prefix, dname, site) != 0) {
+		errno = ENOENT;
+		return (-1);
+	}
+
+	dr = dcc_enter();
+	if ((ent = dcc_lookup(key, &m)) != NULL) {
+		if ((rc = dc_cache_fill(ent, dci, buf, len)) != 0)
+			err = errno;
+		if (addr != NULL)
+			*addr = ent->dce_addr;
+	}
+	dcc_exit(dr);
+
+	lsa_metrics_count(LSA_METRICS_DOMAIN, dname, m, 1);
+	if (rc != 0)
+		errno = err;
+	return (rc);
+}
+
+/*
+ * Build an entry from a NetLogon reply.  Called with dcc_lock held.
+ */
+static dc_cache_ent_t *
+dcc_ent_make(const DOMAIN_CONTROLLER_INFO *dci,
+    const struct sockaddr_in6 *addr)
+{
+	dc_cache_ent_t *ent;
+	const char *dcname = dci->DomainControllerName;
+
+	if ((ent = lsa_calloc(LSA_ALLOC_CACHE, 1, sizeof (*ent))) == NULL)
+		return (NULL);
+	ent->dce_refcnt = 1;
+
+	while (*dcname == '\\')
+		dcname++;
+	ent->dce_dcname = dcc_intern(dcname);
+	ent->dce_domain = dcc_intern(dci->DomainName);
+	ent->dce_forest = dcc_intern(dci->DnsForestName);
+	ent->dce_dcsite = dcc_intern(dci->DcSiteName);
+	ent->dce_clientsite = dcc_intern(dci->ClientSiteName);
+	if (ent->dce_dcname == NULL ||
+	    (ent->dce_domain == NULL) != (dci->DomainName == NULL) ||
+	    (ent->dce_forest == NULL) != (dci->DnsForestName == NULL) ||
+	    (ent->dce_dcsite == NULL) != (dci->DcSiteName == NULL) ||
+	    (ent->dce_clientsite == NULL) != (dci->ClientSiteName == NULL)) {
+		dcc_rele_locked(ent);
+		return (NULL);
+	}
+
+	ent->dce_flags = (uint32_t)dci->Flags;
+	(void) memcpy(ent->dce_guid, dci->DomainGuid, sizeof (ent->dce_guid));
+	ent->dce_addr = *addr;
+	return (ent);
+}
+
+/*
+ * Make ent the current entry for its DC, repointing any query slots that
+ * used the one it replaces.  Takes over the caller's reference.  The
+ * entry replaced is returned in *oldp, with the number of references to
+ * it the caller is to drop after dcc_sync() in *noldp.
+ */
+static int
+dcc_node_set(dc_cache_ent_t *ent, dc_cache_ent_t **oldp, int *noldp)
+{
+	uint32_t h = dcc_hash(ent->dce_dcname);
+	dcc_node_t *cn;
+	dcc_slot_t *cq;
+	dc_cache_ent_t *old;
+	int i;
+
+	*oldp = NULL;
+	*noldp = 0;
+	for (cn = dcc_nodes[DCC_BUCKET(h)]; cn != NULL; cn = cn->cn_next)
+		if (cn->cn_ent->dce_dcname == ent->dce_dcname)
+			break;
+
+	if (cn == NULL) {
+		if ((cn = lsa_malloc(LSA_ALLOC_CACHE, sizeof (*cn))) == NULL)
+			return (-1);
+		cn->cn_ent = ent;
+		cn->cn_next = dcc_nodes[DCC_BUCKET(h)];
+		membar_producer();
+		dcc_nodes[DCC_BUCKET(h)] = cn;
+		return (0);
+	}
+
+	old = cn->cn_ent;
+	membar_producer();
+	cn->cn_ent = ent;
+	for (i = 0; i < DCC_NBUCKETS; i++) {
+		for (cq = dcc_slots[i]; cq != NULL; cq = cq->cq_next) {
+			if (cq->cq_ent != old)
+				continue;
+			dc_cache_hold(ent);
+			dcc_slot_set(cq, ent, cq->cq_expires);
+			(*noldp)++;
+		}
+	}
+	*oldp = old;
+	(*noldp)++;
+	return (0);
+}
+
+/*
+ * Record that the DC described by dci, at addr, answered a locate for
+ * prefix.dname in site.  Returns the new entry, held, or NULL if it could
+ * not be cached.
+ */
+dc_cache_ent_t *
+dc_cache_enter(const char *prefix, const char *dname, const char *site,
+    const DOMAIN_CONTROLLER_INFO *dci, const struct sockaddr_in6 *addr)
+{
+	char key[2 * NS_MAXDNAME];
+	dc_cache_ent_t *ent, *old = NULL, *prev = NULL;
+	dcc_slot_t *cq;
+	hrtime_t expires;
+	uint32_t h;
+	int nold = 0;
+
+	if (dci->DomainControllerName == NULL ||
+	    dcc_key(key, sizeof (key), prefix, dname, site) != 0)
+		return (NULL);
+	h = dcc_hash(key);
+
+	(void) pthread_mutex_lock(&dcc_lock);
+	if ((ent = dcc_ent_make(dci, addr)) == NULL)
+		goto fail;
+
+	/*
+	 * One reference for the node, one for the slot, one for the caller.
+	 */
+	ent->dce_refcnt = 3;
+	if (dcc_node_set(ent, &old, &nold) != 0) {
+		ent->dce_refcnt = 1;
+		dcc_rele_locked(ent);
+		goto fail;
+	}
+
+	expires = gethrtime() +
+	    lsa_rate_jitter((hrtime_t)DC_CACHE_TTL * NANOSEC, DC_CACHE_JITTER);
+	if ((cq = dcc_slot_find(key, h, NULL)) == NULL) {
+		if ((cq = lsa_calloc(LSA_ALLOC_CACHE, 1,
+		    sizeof (*cq))) == NULL ||
+		    (cq->cq_key = dcc_intern(key)) == NULL) {
+			free(cq);
+			dcc_rele_locked(ent);	/* the slot's */
+			goto out;
+		}
+		cq->cq_hash = h;
+		cq->cq_ent = ent;
+		cq->cq_expires = expires;
+		cq->cq_next = dcc_slots[DCC_BUCKET(h)];
+		membar_producer();
+		dcc_slots[DCC_BUCKET(h)] = cq;
+	} else {
+		prev = cq->cq_ent;
+		dcc_slot_set(cq, ent, expires);
+	}
+
+out:
+	if (old != NULL || prev != NULL) {
+		dcc_sync();
+		while (nold-- > 0)
+			dcc_rele_locked(old);
+		if (prev != NULL)
+			dcc_rele_locked(prev);
+	}
+	(void) pthread_mutex_unlock(&dcc_lock);
+	return (ent);
+fail:
+	(void) pthread_mutex_unlock(&dcc_lock);
+	return (NULL);
+}
+
+/*
+ * Find the address a DC last reported for itself, by its DNS name.
+ */
+int
+dc_cache_addr(const char *dcname, struct in6_addr *addr)
+{
+	uint32_t h = dcc_hash(dcname);
+	dc_cache_ent_t *ent;
+	dcc_reader_t *dr;
+	dcc_node_t *cn;
+	int rc = -1;
+
+	dr = dcc_enter();
+	for (cn = dcc_nodes[DCC_BUCKET(h)]; cn != NULL; cn = cn->cn_next) {
+		membar_consumer();
+		ent = cn->cn_ent;
+		membar_consumer();
+		if (strcasecmp(ent->dce_dcname, dcname) == 0) {
+			*addr = ent->dce_addr.sin6_addr;
+			rc = 0;
+			break;
+		}
+	}
+	dcc_exit(dr);
+
+	return (rc);
+}
+
+/*
+ * Forget which DC answered a query, e.g. because it has stopped working.
+ * What is known about the DC itself is kept.
+ */
+void
+dc_cache_remove(const char *prefix, const char *dname, const char *site)
+{
+	char key[2 * NS_MAXDNAME];
+	dcc_slot_t *cq, **cqp;
+	uint32_t h;
+
+	if (dcc_key(key, sizeof (key), prefix, dname, site) != 0)
+		return;
+	h = dcc_hash(key);
+
+	(void) pthread_mutex_lock(&dcc_lock);
+	if ((cq = dcc_slot_find(key, h, &cqp)) != NULL) {
+		*cqp = cq->cq_next;
+		dcc_sync();
+		dcc_rele_locked(cq->cq_ent);
+		dcc_unintern(cq->cq_key);
+		free(cq);
+	}
+	(void) pthread_mutex_unlock(&dcc_lock);
+}
+
+static char *
+dcc_strdup(const char *s)
+{
+	return ((s != NULL) ? lsa_strdup(LSA_ALLOC_RESULT, s) : NULL);
+}
+
+/*
+ * Expand an entry into a DOMAIN_CONTROLLER_INFO the caller frees with
+ * freedci().
+ */
+DOMAIN_CONTROLLER_INFO *
+dc_cache_dci(const dc_cache_ent_t *ent)
+{
+	DOMAIN_CONTROLLER_INFO *dci;
+	size_t len = strlen(ent->dce_dcname) + 3;
+
+	if ((dci = lsa_calloc(LSA_ALLOC_RESULT, 1,
+	    sizeof (DOMAIN_CONTROLLER_INFO))) == NULL)
+		return (NULL);
+
+	if ((dci->DomainControllerName =
+	    lsa_malloc(LSA_ALLOC_RESULT, len)) == NULL ||
+	    (dci->DomainControllerAddress =
+	    lsa_malloc(LSA_ALLOC_RESULT, INET6_ADDRSTRLEN + 2)) == NULL)
+		goto fail;
+	(void) snprintf(dci->DomainControllerName, len, "\\\\%s",
+	    ent->dce_dcname);
+	(void) strcpy(dci->DomainControllerAddress, "\\\\");
+	(void) inet_ntop(AF_INET6, &ent->dce_addr.sin6_addr,
+	    dci->DomainControllerAddress + 2, INET6_ADDRSTRLEN);
+	dci->DomainControllerAddressType = DS_INET_ADDRESS;
+
+	(void) memcpy(dci->DomainGuid, ent->dce_guid, sizeof (dci->DomainGuid));
+	dci->Flags = ent->dce_flags;
+	if ((dci->DomainName = dcc_strdup(ent->dce_domain)) == NULL &&
+	    ent->dce_domain != NULL)
+		goto fail;
+	if ((dci->DnsForestName = dcc_strdup(ent->dce_forest)) == NULL &&
+	    ent->dce_forest != NULL)
+		goto fail;
+	if ((dci->DcSiteName = dcc_strdup(ent->dce_dcsite)) == NULL &&
+	    ent->dce_dcsite != NULL)
+		goto fail;
+	if ((dci->ClientSiteName = dcc_strdup(ent->dce_clientsite)) == NULL &&
+	    ent->dce_clientsite != NULL)
+		goto fail;
+
+	return (dci);
+fail:
+	freedci(dci);
+	return (NULL);
+}
+
+/*
+ * Expand an entry into a caller's DOMAIN_CONTROLLER_INFO, with its
+ * strings in buf; see copydci().  Allocates nothing.
+ */
+int
+dc_cache_fill(const dc_cache_ent_t *ent, DOMAIN_CONTROLLER_INFO *dci,
+    char *buf, size_t len)
+{
+	DOMAIN_CONTROLLER_INFO src;
+	char name[MAXHOSTNAMELEN + 3], addr[INET6_ADDRSTRLEN + 2];
+
+	(void) snprintf(name, sizeof (name), "\\\\%s", ent->dce_dcname);
+	(void) strcpy(addr, "\\\\");
+	(void) inet_ntop(AF_INET6, &ent->dce_addr.sin6_addr, addr + 2,
+	    INET6_ADDRSTRLEN);
+
+	src.DomainControllerName = name;
+	src.DomainControllerAddress = addr;
+	src.DomainControllerAddressType = DS_INET_ADDRESS;
+	(void) memcpy(src.DomainGuid, ent->dce_guid, sizeof (src.DomainGuid));
+	src.DomainName = (char *)ent->dce_domain;
+	src.DnsForestName = (char *)ent->dce_forest;
+	src.Flags = ent->dce_flags;
+	src.DcSiteName = (char *)ent->dce_dcsite;
+	src.ClientSiteName = (char *)ent->dce_clientsite;
+
+	return (copydci(dci, &src, buf, len));
+}
+
+/*
+ * Empty the cache.  Entries still held by callers stay valid until they
+ * are released.
+ */
+void
+dc_cache_flush(void)
+{
+	dcc_slot_t *cq, *slots[DCC_NBUCKETS];
+	dcc_node_t *cn, *nodes[DCC_NBUCKETS];
+	int i;
+
+	(void) pthread_mutex_lock(&dcc_lock);
+	for (i = 0; i < DCC_NBUCKETS; i++) {
+		slots[i] = dcc_slots[i];
+		nodes[i] = dcc_nodes[i];
+		dcc_slots[i] = NULL;
+		dcc_nodes[i] = NULL;
+	}
+	dcc_sync();
+
+	for (i = 0; i < DCC_NBUCKETS; i++) {
+		while ((cq = slots[i]) != NULL) {
+			slots[i] = cq->cq_next;
+			dcc_rele_locked(cq->cq_ent);
+			dcc_unintern(cq->cq_key);
+			free(cq);
+		}
+		while ((cn = nodes[i]) != NULL) {
+			nodes[i] = cn->cn_next;
+			dcc_rele_locked(cn->cn_ent);
+			free(cn);
+		}
+	}
+	(void) pthread_mutex_unlock(&dcc_lock);
+}
@@ -0,0 +1,76 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+#ifndef _DC_CACHE_H
+#define _DC_CACHE_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "lsa_cldap.h"
+
+/*
+ * A cached locate result: one fixed-size record per DC.  The strings are
+ * interned in a table shared by all entries, so the same forest, domain
+ * and site names are stored once however many DCs and lookups use them.
+ *
+ * An entry is never changed once it is in the cache; new information
+ * about a DC replaces its entry.  Lookups take no lock.  dc_cache_lookup()
+ * hands out a reference, which the caller drops with dc_cache_rele();
+ * dc_cache_get() copies the entry out instead.
+ */
+typedef struct dc_cache_ent {
+	uint32_t		dce_refcnt;
+	uint32_t		dce_flags;	/* DS_*_FLAG */
+	const char		*dce_dcname;	/* without the leading \\ */
+	const char		*dce_domain;
+	const char		*dce_forest;
+	const char		*dce_dcsite;
+	const char		*dce_clientsite;
+	uint8_t			dce_guid[16];
+	struct sockaddr_in6	dce_addr;
+} dc_cache_ent_t;
+
+/*
+ * How long a locate result is used before the DC is looked for again,
+ * spread by DC_CACHE_JITTER percent either way, so that results cached
+ * together are not all looked for again together.
+ */
+#define	DC_CACHE_TTL	(15 * 60)	/* seconds */
+#define	DC_CACHE_JITTER	10		/* percent */
+
+dc_cache_ent_t *dc_cache_lookup(const char *, const char *, const char *);
+
+int dc_cache_get(const char *, const char *, const char *,
+    DOMAIN_CONTROLLER_INFO *, char *, size_t, struct sockaddr_in6 *);
+
+dc_cache_ent_t *dc_cache_enter(const char *, const char *, const char *,
+    const DOMAIN_CONTROLLER_INFO *, const struct sockaddr_in6 *);
+
+int dc_cache_addr(const char *, struct in6_addr *);
+
+void dc_cache_remove(const char *, const char *, const char *);
+
+void dc_cache_hold(dc_cache_ent_t *);
+
+void dc_cache_rele(dc_cache_ent_t *);
+
+DOMAIN_CONTROLLER_INFO *dc_cache_dci(const dc_cache_ent_t *);
+
+int dc_cache_fill(const dc_cache_ent_t *, DOMAIN_CONTROLLER_INFO *, char *,
+    size_t);
+
+void dc_cache_flush(void);
+
+#endif /* _DC_CACHE_H */
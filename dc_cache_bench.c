@@ -0,0 +1,188 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Cache-hit throughput against the number of reader threads.
+ *
+ * One entry is put in the cache before the runs start, and every locate
+ * is a hit on it.  For 1, 2, 4, ... up to -t threads, every thread
+ * answers that locate with dc_locate_buf() for -d seconds.  Output is
+ * one line per thread count: total and per-thread locates per second,
+ * and the speedup over one thread, which stays close to the thread count
+ * for as long as there are CPUs to run them.  With -w, another thread
+ * keeps replacing the cached entry meanwhile, as refreshes would.
+ *
+ *	./dc_cache_bench [-w] [-t threads] [-d seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dc_locate.h"
+#include "dc_cache.h"
+
+#define	BENCH_PREFIX	"_ldap._tcp.dc._msdcs"
+#define	BENCH_DOMAIN	"w2k8.ma.nexenta.com"
+#define	BENCH_SITE	"Default-First-Site-Name"
+#define	BENCH_DC	"\\\\w2k8-dc1.w2k8.ma.nexenta.com"
+
+typedef struct bench_reader {
+	pthread_t	br_tid;
+	uint64_t	br_hits;
+	uint64_t	br_misses;
+	char		br_pad[64];
+} bench_reader_t;
+
+static DOMAIN_CONTROLLER_INFO bench_dci;
+static struct sockaddr_in6 bench_addr;
+static pthread_barrier_t bench_go;
+static volatile boolean_t bench_stop;
+
+static void
+bench_enter(void)
+{
+	dc_cache_rele(dc_cache_enter(BENCH_PREFIX, BENCH_DOMAIN, BENCH_SITE,
+	    &bench_dci, &bench_addr));
+}
+
+static void *
+bench_read(void *arg)
+{
+	bench_reader_t *br = arg;
+	DOMAIN_CONTROLLER_INFO dci;
+	char buf[DCI_BUFSZ];
+
+	(void) pthread_barrier_wait(&bench_go);
+	while (!bench_stop) {
+		if (dc_locate_buf(BENCH_PREFIX, BENCH_DOMAIN, BENCH_SITE,
+		    DCL_F_CACHE, 0, &dci, buf, sizeof (buf)) == 0)
+			br->br_hits++;
+		else
+			br->br_misses++;
+	}
+	return (NULL);
+}
+
+/* ARGSUSED */
+static void *
+bench_write(void *arg)
+{
+	while (!bench_stop) {
+		bench_enter();
+		(void) usleep(1000);
+	}
+	return (NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_reader_t *readers;
+	pthread_t writer;
+	boolean_t refresh = B_FALSE;
+	double secs = 1, one = 0, rate;
+	uint64_t hits, misses;
+	hrtime_t start, wall;
+	int c, i, n, max = 8;
+
+	while ((c = getopt(argc, argv, "d:t:w")) != -1) {
+		switch (c) {
+		case 'd':
+			secs = atof(optarg);
+			break;
+		case 't':
+			max = atoi(optarg);
+			break;
+		case 'w':
+			refresh = B_TRUE;
+			break;
+		default:
+			max = 0;
+			break;
+		}
+	}
+	if (optind != argc || max < 1 || secs <= 0) {
+		fprintf(stderr, "usage: %s [-w] [-t threads] [-d seconds]\n",
+		    argv[0]);
+		return (1);
+	}
+	if ((readers = calloc(max, sizeof (*readers))) == NULL) {
+		fprintf(stderr, "dc_cache_bench: out of memory\n");
+		return (1);
+	}
+
+	bench_dci.DomainControllerName = BENCH_DC;
+	bench_dci.DomainName = BENCH_DOMAIN;
+	bench_dci.DnsForestName = BENCH_DOMAIN;
+	bench_dci.DcSiteName = BENCH_SITE;
+	bench_dci.ClientSiteName = BENCH_SITE;
+	bench_dci.Flags = DS_DS_FLAG | DS_KDC_FLAG | DS_CLOSEST_FLAG;
+	bench_addr.sin6_family = AF_INET6;
+	(void) inet_pton(AF_INET6, "::ffff:192.168.1.10",
+	    &bench_addr.sin6_addr);
+	bench_enter();
+
+	printf("%8s %14s %14s %8s\n", "threads", "locates/s", "per thread",
+	    "speedup");
+	for (n = 1; ; n = MIN(n * 2, max)) {
+		(void) memset(readers, 0, max * sizeof (*readers));
+		(void) pthread_barrier_init(&bench_go, NULL, n + 1);
+		bench_stop = B_FALSE;
+		for (i = 0; i < n; i++)
+			if (pthread_create(&readers[i].br_tid, NULL, bench_read,
+			    &readers[i]) != 0) {
+				fprintf(stderr, "dc_cache_bench: can't start "
+				    "thread %d\n", i);
+				return (1);
+			}
+		if (refresh &&
+		    pthread_create(&writer, NULL, bench_write, NULL) != 0) {
+			fprintf(stderr, "dc_cache_bench: can't start writer\n");
+			return (1);
+		}
+
+		(void) pthread_barrier_wait(&bench_go);
+		start = gethrtime();
+		(void) usleep((useconds_t)(secs * MICROSEC));
+		bench_stop = B_TRUE;
+		wall = gethrtime() - start;
+		for (i = 0; i < n; i++)
+			(void) pthread_join(readers[i].br_tid, NULL);
+		if (refresh)
+			(void) pthread_join(writer, NULL);
+		(void) pthread_barrier_destroy(&bench_go);
+
+		for (i = 0, hits = misses = 0; i < n; i++) {
+			hits += readers[i].br_hits;
+			misses += readers[i].br_misses;
+		}
+		rate = hits * (double)NANOSEC / wall;
+		if (n == 1)
+			one = rate;
+		printf("%8d %14.0f %14.0f %8.2f", n, rate, rate / n,
+		    (one > 0) ? rate / one : 0.0);
+		if (misses != 0)
+			printf("  (%" PRIu64 " misses)", misses);
+		printf("\n");
+		if (n == max)
+			break;
+	}
+
+	dc_cache_flush();
+	free(readers);
+	return (0);
+}
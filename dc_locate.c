@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -7,9 +9,18 @@
 #include <ldap.h>
 #include <lber.h>
 #include <string.h>
+#include <strings.h>
+#include <pthread.h>
 #include <sys/socket.h>
-#include "lsa_cldap.h"
+#include <sys/param.h>
+#include <arpa/nameser.h>
+#include "dc_locate.h"
+#include "dc_cache.h"
 #include "lsa_srv.h"
+#include "lsa_wire.h"
+#include "lsa_alloc.h"
+#include "lsa_metrics.h"
+#include "lsa_rate.h"
 
 static int
 lsa_bind()
@@ -17,7 +28,7 @@ lsa_bind()
         int                        fd;
         struct sockaddr_in6         addr;
 
-        if ((fd = socket(PF_INET6, SOCK_DGRAM, 0)) < 0)
+        if ((fd = lsa_wire_socket(PF_INET6, SOCK_DGRAM)) < 0)
                 return (fd);
         /*
          * Bind to all available addresses and any port.
@@ -26,12 +37,12 @@ lsa_bind()
         addr.sin6_addr = in6addr_any;
         addr.sin6_port = 0;
 
-        if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+        if (lsa_wire_bind(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
                 goto fail;
 
         return (fd);
 fail:
-        (void) close(fd);
+        (void) lsa_wire_close(fd);
 
         return (-1);
 }
@@ -39,103 +50,1885 @@ fail:
 void
 lsa_srv_output(lsa_srv_ctx_t *ctx) __attribute__((weak));
 
-DOMAIN_CONTROLLER_INFO *
-dc_locate(const char *prefix, const char *dname)
+#define	DCL_MARK(st, phase)	((st)->dls_time[(phase)] = gethrtime())
+#define	DCL_MARK_ONCE(st, phase)	\
+	((st)->dls_time[(phase)] == 0 ? DCL_MARK(st, phase) : 0)
+
+#define	DCL_MSEC		(NANOSEC / MILLISEC)
+#define	DCL_PING_INTERVAL	(100 * DCL_MSEC)
+/*
+ * How long the generic query's candidates are held back to give a
+ * site-specific answer the chance to win.
+ */
+#define	DCL_SITE_GRACE		(100 * DCL_MSEC)
+
+#define	DCL_MAXQ		4	/* DCL_MAXFDS - 1 */
+
+/*
+ * The interval between pings is spread by DCL_PING_JITTER percent either
+ * way, so hosts that start locating together drift apart.
+ */
+#define	DCL_PING_JITTER		20
+
+/*
+ * A locate that no DC answered holds off further locates of the same
+ * query for DCL_BACKOFF_MIN, doubling with each failure in a row up to
+ * DCL_BACKOFF_MAX, each hold spread by DCL_BACKOFF_JITTER percent.
+ */
+#define	DCL_BACKOFF_MIN		(1LL * NANOSEC)
+#define	DCL_BACKOFF_MAX		(64LL * NANOSEC)
+#define	DCL_BACKOFF_JITTER	50
+#define	DCL_MAXBACKOFFS		64
+
+/*
+ * Flag for locates whose caller has already asked the cache.
+ */
+#define	DCL_F_LOOKEDUP		0x80000000
+
+/*
+ * Pings go out with sendmmsg() in batches of up to DCL_BATCH, and
+ * replies are drained with recvmmsg() into a ring of DCL_RING buffers.
+ */
+#define	DCL_BATCH		64
+#define	DCL_RING		32
+#define	DCL_REPLYSZ		2048
+#define	DCL_MAXGUIDS		64
+
+/*
+ * NtVersion sent in pings.  With 5EX_WITH_IP the DC reports its own
+ * address, which is what the result and the cache record; WITH_CLOSEST_SITE
+ * adds the site to try when the client's own has no DC.
+ */
+#define	DCL_NTVER	(NETLOGON_NT_VERSION_5EX | \
+	NETLOGON_NT_VERSION_5EX_WITH_IP | NETLOGON_NT_VERSION_WITH_CLOSEST_SITE)
+
+typedef enum dcl_qstate {
+	DQ_DNS = 0,	/* waiting for the SRV answer */
+	DQ_ADDR,	/* looking up targets without glue */
+	DQ_PING,	/* pinging candidates */
+	DQ_DONE		/* no candidates left, or the query failed */
+} dcl_qstate_t;
+
+/*
+ * One SRV query and the candidates it produced.  Queries are ranked by
+ * their index: the client's site, then the next closest site, then the
+ * generic query.
+ */
+typedef struct dcl_query {
+	lsa_srv_ctx_t	*dq_srv;
+	dcl_qstate_t	dq_state;
+	hrtime_t	dq_notbefore;	/* hold pings until then */
+	hrtime_t	dq_nextping;
+	srv_rr_t	*dq_cur;	/* last candidate pinged */
+} dcl_query_t;
+
+typedef struct dcl_ring {
+	struct mmsghdr		dr_msg[DCL_RING];
+	struct iovec		dr_iov[DCL_RING];
+	struct sockaddr_in6	dr_from[DCL_RING];
+	char			dr_buf[DCL_RING][DCL_REPLYSZ];
+} dcl_ring_t;
+
+typedef struct dcl_handle {
+	const char		*dh_dname;
+	const uint8_t		*dh_guid;
+	dcl_query_t		dh_q[DCL_MAXQ];
+	int			dh_nq;
+	int			dh_fd;		/* CLDAP ping socket */
+	BerElement		*dh_pdu;
+	int			dh_batch;	/* pings per query per tick */
+	uint32_t		dh_flags;
+	struct sockaddr_in6	dh_dst[DCL_BATCH];
+	srv_rr_t		*dh_dstsr[DCL_BATCH];	/* their candidates */
+	dcl_ring_t		*dh_ring;
+	hrtime_t		dh_lastping;
+	hrtime_t		dh_deadline;	/* give up then, 0 for never */
+	int			dh_replies;
+	int			dh_status;	/* DCL_STEP_* */
+	DOMAIN_CONTROLLER_INFO	*dh_dci;
+	dc_locate_reply_t	*dh_all;	/* DCL_F_ALL replies */
+	lsa_cldap_ex_t		*dh_ex;		/* DCL_F_SURVEY: their extras */
+	struct sockaddr_in6	*dh_peer;	/* DCL_F_SURVEY: senders */
+	int			dh_nall;
+	int			dh_allcap;
+	dc_locate_cb_t		dh_cb;
+	void			*dh_cbarg;
+	dc_locate_stats_t	dh_st;
+	char			dh_prefix[NS_MAXDNAME];
+	char			dh_name[MAXHOSTNAMELEN]; /* dname, or forest */
+	char			dh_site[NS_MAXLABEL + 1];
+	uint8_t			dh_guidbuf[16];
+	boolean_t		dh_cached;	/* answered from the cache */
+	boolean_t		dh_backoff;	/* failed at once, backing off */
+	boolean_t		dh_probe;	/* let through a hold */
+	boolean_t		dh_hasfailed;
+	struct in6_addr		dh_failed;	/* DC given up on, see resume */
+} dcl_handle_t;
+
+#define	DCL_SITE(dh)	(((dh)->dh_site[0] != '\0') ? (dh)->dh_site : NULL)
+
+/*
+ * Build the site-specific form of an SRV prefix by inserting
+ * "<site>._sites" after the service and protocol labels, e.g.
+ * _ldap._tcp.dc._msdcs -> _ldap._tcp.<site>._sites.dc._msdcs
+ */
+static int
+dcl_site_prefix(char *buf, size_t len, const char *prefix, const char *site)
+{
+	const char *p;
+	int n;
+
+	if ((p = strchr(prefix, '.')) == NULL ||
+	    (p = strchr(p + 1, '.')) == NULL)
+		n = snprintf(buf, len, "%s.%s._sites", prefix, site);
+	else
+		n = snprintf(buf, len, "%.*s.%s._sites%s", (int)(p - prefix),
+		    prefix, site, p);
+
+	return ((n < 0 || n >= len) ? -1 : 0);
+}
+
+/*
+ * Build the DomainGuid form of an SRV prefix from its service and
+ * protocol labels, e.g.
+ * _ldap._tcp.dc._msdcs -> _ldap._tcp.<guid>.domains._msdcs
+ */
+static int
+dcl_guid_prefix(char *buf, size_t len, const char *prefix,
+    const uint8_t *guid)
+{
+	const char *p;
+	int n, plen;
+
+	if ((p = strchr(prefix, '.')) == NULL ||
+	    (p = strchr(p + 1, '.')) == NULL)
+		plen = strlen(prefix);
+	else
+		plen = p - prefix;
+
+	n = snprintf(buf, len, "%.*s.%08x-%04x-%04x-%02x%02x-"
+	    "%02x%02x%02x%02x%02x%02x.domains._msdcs", plen, prefix,
+	    guid[0] | guid[1] << 8 | guid[2] << 16 | (uint32_t)guid[3] << 24,
+	    guid[4] | guid[5] << 8, guid[6] | guid[7] << 8,
+	    guid[8], guid[9], guid[10], guid[11], guid[12], guid[13],
+	    guid[14], guid[15]);
+
+	return ((n < 0 || n >= len) ? -1 : 0);
+}
+
+/*
+ * DomainGuid, forest name and next closest site learned from earlier
+ * replies, by domain.  The next closest site is the one the DC picked for
+ * a client in dg_site.
+ */
+typedef struct dcl_guid {
+	char		dg_dname[MAXHOSTNAMELEN];
+	char		dg_forest[MAXHOSTNAMELEN];
+	uint8_t		dg_guid[16];
+	char		dg_site[NS_MAXLABEL + 1];
+	char		dg_nextsite[NS_MAXLABEL + 1];
+} dcl_guid_t;
+
+static dcl_guid_t dcl_guids[DCL_MAXGUIDS];
+static int dcl_nguids;
+static pthread_mutex_t dcl_guids_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+dcl_guid_learn(const char *dname, const DOMAIN_CONTROLLER_INFO *dci,
+    const char *nextsite)
+{
+	dcl_guid_t *dg;
+	int i;
+
+	if (dname == NULL || dci->DnsForestName == NULL)
+		return;
+
+	(void) pthread_mutex_lock(&dcl_guids_lock);
+	for (i = 0; i < dcl_nguids; i++)
+		if (strcasecmp(dcl_guids[i].dg_dname, dname) == 0)
+			break;
+	if (i == DCL_MAXGUIDS)
+		i = random() % DCL_MAXGUIDS;
+	else if (i == dcl_nguids)
+		dcl_nguids++;
+	dg = &dcl_guids[i];
+	(void) strlcpy(dg->dg_dname, dname, sizeof (dg->dg_dname));
+	(void) strlcpy(dg->dg_forest, dci->DnsForestName,
+	    sizeof (dg->dg_forest));
+	(void) memcpy(dg->dg_guid, dci->DomainGuid, sizeof (dg->dg_guid));
+	(void) strlcpy(dg->dg_site, (dci->ClientSiteName != NULL) ?
+	    dci->ClientSiteName : "", sizeof (dg->dg_site));
+	(void) strlcpy(dg->dg_nextsite, nextsite, sizeof (dg->dg_nextsite));
+	(void) pthread_mutex_unlock(&dcl_guids_lock);
+}
+
+static boolean_t
+dcl_guid_known(const char *dname, char *forest, size_t len, uint8_t *guid)
+{
+	boolean_t found = B_FALSE;
+	int i;
+
+	(void) pthread_mutex_lock(&dcl_guids_lock);
+	for (i = 0; i < dcl_nguids; i++) {
+		if (strcasecmp(dcl_guids[i].dg_dname, dname) != 0)
+			continue;
+		(void) strlcpy(forest, dcl_guids[i].dg_forest, len);
+		(void) memcpy(guid, dcl_guids[i].dg_guid, 16);
+		found = B_TRUE;
+		break;
+	}
+	(void) pthread_mutex_unlock(&dcl_guids_lock);
+
+	return (found);
+}
+
+/*
+ * Queries whose last locates failed, and until when to hold off the next.
+ * Once a hold ends, one locate goes ahead to try the DCs again while the
+ * rest are still held; how it ends either clears the hold or starts the
+ * next, longer one.
+ */
+typedef struct dcl_backoff {
+	char		db_prefix[NS_MAXDNAME];
+	char		db_name[MAXHOSTNAMELEN];
+	char		db_site[NS_MAXLABEL + 1];
+	int		db_failures;	/* in a row */
+	hrtime_t	db_until;
+	boolean_t	db_probing;	/* that locate is running */
+} dcl_backoff_t;
+
+static dcl_backoff_t dcl_backoffs[DCL_MAXBACKOFFS];
+static int dcl_nbackoffs;
+static pthread_mutex_t dcl_backoffs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static dcl_backoff_t *
+dcl_backoff_find(const dcl_handle_t *dh)
+{
+	dcl_backoff_t *db;
+	int i;
+
+	for (i = 0; i < dcl_nbackoffs; i++) {
+		db = &dcl_backoffs[i];
+		if (strcasecmp(db->db_name, dh->dh_name) == 0 &&
+		    strcasecmp(db->db_prefix, dh->dh_prefix) == 0 &&
+		    strcasecmp(db->db_site, dh->dh_site) == 0)
+			return (db);
+	}
+	return (NULL);
+}
+
+/*
+ * Is this locate's query being held off after failures?  The first locate
+ * after a hold ends is not, and becomes the probe.
+ */
+static boolean_t
+dcl_backoff_held(dcl_handle_t *dh, hrtime_t now)
+{
+	dcl_backoff_t *db;
+	boolean_t held = B_FALSE;
+
+	(void) pthread_mutex_lock(&dcl_backoffs_lock);
+	if ((db = dcl_backoff_find(dh)) != NULL && db->db_failures != 0) {
+		if (now < db->db_until || db->db_probing) {
+			held = B_TRUE;
+		} else {
+			db->db_probing = B_TRUE;
+			dh->dh_probe = B_TRUE;
+		}
+	}
+	(void) pthread_mutex_unlock(&dcl_backoffs_lock);
+
+	return (held);
+}
+
+/*
+ * A probe ended without telling us anything about the DCs; let the next
+ * locate be one.
+ */
+static void
+dcl_backoff_unprobe(dcl_handle_t *dh)
+{
+	dcl_backoff_t *db;
+
+	if (!dh->dh_probe)
+		return;
+	dh->dh_probe = B_FALSE;
+	(void) pthread_mutex_lock(&dcl_backoffs_lock);
+	if ((db = dcl_backoff_find(dh)) != NULL)
+		db->db_probing = B_FALSE;
+	(void) pthread_mutex_unlock(&dcl_backoffs_lock);
+}
+
+/*
+ * Note that a DC answered a locate, which forgets the failures before it,
+ * or that its pings all went unanswered.  Failures of locates that were
+ * already running when an earlier one started the hold are not counted
+ * again.
+ */
+static void
+dcl_backoff_note(dcl_handle_t *dh, boolean_t failed, hrtime_t now)
+{
+	dcl_backoff_t *db;
+	hrtime_t hold;
+	boolean_t probe = dh->dh_probe;
+	int i;
+
+	dh->dh_probe = B_FALSE;
+	(void) pthread_mutex_lock(&dcl_backoffs_lock);
+	db = dcl_backoff_find(dh);
+	if (!failed) {
+		if (db != NULL) {
+			db->db_failures = 0;
+			db->db_until = 0;
+			db->db_probing = B_FALSE;
+		}
+		(void) pthread_mutex_unlock(&dcl_backoffs_lock);
+		return;
+	}
+
+	if (db == NULL) {
+		for (i = 0; i < dcl_nbackoffs; i++)
+			if (dcl_backoffs[i].db_failures == 0)
+				break;
+		if (i == DCL_MAXBACKOFFS)
+			i = random() % DCL_MAXBACKOFFS;
+		else if (i == dcl_nbackoffs)
+			dcl_nbackoffs++;
+		db = &dcl_backoffs[i];
+		(void) strlcpy(db->db_prefix, dh->dh_prefix,
+		    sizeof (db->db_prefix));
+		(void) strlcpy(db->db_name, dh->dh_name, sizeof (db->db_name));
+		(void) strlcpy(db->db_site, dh->dh_site, sizeof (db->db_site));
+		db->db_failures = 0;
+		db->db_until = 0;
+		db->db_probing = B_FALSE;
+	}
+	if (probe || (now >= db->db_until && !db->db_probing)) {
+		hold = DCL_BACKOFF_MIN << MIN(db->db_failures, 30);
+		db->db_failures++;
+		db->db_until = now + lsa_rate_jitter(MIN(hold, DCL_BACKOFF_MAX),
+		    DCL_BACKOFF_JITTER);
+		db->db_probing = B_FALSE;
+	}
+	(void) pthread_mutex_unlock(&dcl_backoffs_lock);
+}
+
+/*
+ * Forget what earlier replies told us, and that earlier locates failed,
+ * so the next locate starts as the first one did.
+ */
+void
+dc_locate_forget(void)
+{
+	(void) pthread_mutex_lock(&dcl_guids_lock);
+	dcl_nguids = 0;
+	(void) pthread_mutex_unlock(&dcl_guids_lock);
+	(void) pthread_mutex_lock(&dcl_backoffs_lock);
+	dcl_nbackoffs = 0;
+	(void) pthread_mutex_unlock(&dcl_backoffs_lock);
+}
+
+/*
+ * Find the next closest site a DC named for clients in this site.
+ */
+static boolean_t
+dcl_next_site(const char *dname, const char *site, char *next, size_t len)
+{
+	dcl_guid_t *dg;
+	boolean_t found = B_FALSE;
+	int i;
+
+	(void) pthread_mutex_lock(&dcl_guids_lock);
+	for (i = 0; i < dcl_nguids; i++) {
+		dg = &dcl_guids[i];
+		if (strcasecmp(dg->dg_dname, dname) != 0)
+			continue;
+		if (dg->dg_nextsite[0] != '\0' &&
+		    strcasecmp(dg->dg_site, site) == 0 &&
+		    strcasecmp(dg->dg_nextsite, site) != 0) {
+			(void) strlcpy(next, dg->dg_nextsite, len);
+			found = B_TRUE;
+		}
+		break;
+	}
+	(void) pthread_mutex_unlock(&dcl_guids_lock);
+
+	return (found);
+}
+
+static void
+dcl_query_done(dcl_handle_t *dh, int q, hrtime_t now)
+{
+	hrtime_t until;
+	int i;
+
+	dh->dh_q[q].dq_state = DQ_DONE;
+
+	/*
+	 * Once every query ranked above it has failed or run out of
+	 * candidates, release the next one held back, and any held as long,
+	 * at once; there is nothing left to wait for.
+	 */
+	for (i = 0; i < dh->dh_nq; i++)
+		if (dh->dh_q[i].dq_state != DQ_DONE)
+			break;
+	if (i == dh->dh_nq)
+		return;
+	for (until = dh->dh_q[i].dq_notbefore; i < dh->dh_nq; i++)
+		if (dh->dh_q[i].dq_notbefore <= until &&
+		    dh->dh_q[i].dq_notbefore > now)
+			dh->dh_q[i].dq_notbefore = now;
+}
+
+/*
+ * Never try or accept the DC at this address again.
+ */
+static void
+dcl_fail(dcl_handle_t *dh, const struct in6_addr *addr)
 {
 	lsa_srv_ctx_t *ctx;
+	int i, n;
+
+	for (i = 0; i < dh->dh_nq; i++) {
+		ctx = dh->dh_q[i].dq_srv;
+		if (dh->dh_q[i].dq_state == DQ_DNS)
+			continue;
+		for (n = 0; n < ctx->lsc_nsrv; n++)
+			if (IN6_ARE_ADDR_EQUAL(&ctx->lsc_srv[n].addr.sin6_addr,
+			    addr)) {
+				ctx->lsc_srv[n].sr_used = B_TRUE;
+				ctx->lsc_srv[n].sr_failed = B_TRUE;
+			}
+	}
+}
+
+/*
+ * Answer a locate from the cache, if it knows a DC for it.
+ */
+static boolean_t
+dcl_cache_hit(dcl_handle_t *dh)
+{
+	dc_cache_ent_t *ent;
+
+	ent = dc_cache_lookup(dh->dh_prefix, dh->dh_dname, DCL_SITE(dh));
+	if (ent == NULL)
+		return (B_FALSE);
+
+	if ((dh->dh_dci = dc_cache_dci(ent)) != NULL) {
+		(void) strlcpy(dh->dh_st.dls_dcname, ent->dce_dcname,
+		    sizeof (dh->dh_st.dls_dcname));
+		dh->dh_st.dls_dcaddr = ent->dce_addr;
+		dh->dh_st.dls_status = 0;
+		dh->dh_status = DCL_STEP_DONE;
+		dh->dh_cached = B_TRUE;
+	}
+	dc_cache_rele(ent);
+	return (dh->dh_cached);
+}
+
+static void dcl_dns_ready(dcl_handle_t *, int, hrtime_t);
+
+/*
+ * Start the queries for a locate.  With a site, the site-specific query
+ * is ranked first and the rest are held back for DCL_SITE_GRACE.  If an
+ * earlier reply named a next closest site for it, that site's query comes
+ * second and the rest are held back for another DCL_SITE_GRACE.  With a
+ * forest and DomainGuid, a query by GUID runs alongside the generic one;
+ * with only those, it runs alone.
+ */
+static int
+dcl_start(dcl_handle_t *dh, const char *prefix, const char *dname,
+    const char *site, const char *forest, const uint8_t *guid, uint32_t flags,
+    hrtime_t deadline)
+{
+	char sprefix[NS_MAXDNAME], nprefix[NS_MAXDNAME], gprefix[NS_MAXDNAME];
+	char next[NS_MAXLABEL + 1];
+	const char *prefixes[DCL_MAXQ], *domains[DCL_MAXQ];
+	const char *name = (dname != NULL) ? dname : forest;
+	hrtime_t now;
+	int i, tier[DCL_MAXQ], ntier = 0;
+
+	memset(dh, 0, sizeof (*dh));
+	if ((flags & DCL_F_SURVEY) != 0)
+		flags |= DCL_F_ALL;
+	dh->dh_fd = -1;
+	dh->dh_batch = ((flags & (DCL_F_SWEEP | DCL_F_ALL)) != 0) ? INT_MAX : 1;
+	dh->dh_flags = flags;
+	dh->dh_deadline = deadline;
+	dh->dh_st.dls_prefix = dh->dh_prefix;
+	dh->dh_st.dls_dname = dh->dh_name;
+	dh->dh_st.dls_status = -1;
+	DCL_MARK(&dh->dh_st, DCL_PHASE_START);
+	now = dh->dh_st.dls_time[DCL_PHASE_START];
+
+	/*
+	 * The handle may outlive the caller's strings.
+	 */
+	if (name == NULL ||
+	    strlcpy(dh->dh_prefix, prefix, sizeof (dh->dh_prefix)) >=
+	    sizeof (dh->dh_prefix) ||
+	    strlcpy(dh->dh_name, name, sizeof (dh->dh_name)) >=
+	    sizeof (dh->dh_name))
+		return (-1);
+	if (site != NULL &&
+	    strlcpy(dh->dh_site, site, sizeof (dh->dh_site)) >=
+	    sizeof (dh->dh_site))
+		return (-1);
+	if (dname != NULL)
+		dh->dh_dname = dh->dh_name;
+	if (guid != NULL) {
+		(void) memcpy(dh->dh_guidbuf, guid, sizeof (dh->dh_guidbuf));
+		dh->dh_guid = dh->dh_guidbuf;
+	}
+
+	/*
+	 * The cache knows one DC; a DCL_F_ALL locate wants them all.
+	 */
+	if ((flags & (DCL_F_CACHE | DCL_F_LOOKEDUP | DCL_F_ALL)) ==
+	    DCL_F_CACHE && dname != NULL && dcl_cache_hit(dh))
+		return (0);
+
+	/*
+	 * Recent locates of this query failed: fail this one at once
+	 * rather than send more queries and pings after them, unless it is
+	 * the one to try the DCs again.
+	 */
+	if ((flags & DCL_F_SURVEY) == 0 && dcl_backoff_held(dh, now)) {
+		lsa_metrics_count(LSA_METRICS_DOMAIN, dh->dh_name,
+		    LSA_M_BACKOFFS, 1);
+		dh->dh_backoff = B_TRUE;
+		dh->dh_status = DCL_STEP_FAIL;
+		return (0);
+	}
+
+	if (dname != NULL) {
+		if (site != NULL) {
+			if (dcl_site_prefix(sprefix, sizeof (sprefix), prefix,
+			    site) != 0)
+				return (-1);
+			tier[dh->dh_nq] = ntier++;
+			domains[dh->dh_nq] = dname;
+			prefixes[dh->dh_nq++] = sprefix;
+		}
+		if (site != NULL &&
+		    dcl_next_site(dname, site, next, sizeof (next)) &&
+		    dcl_site_prefix(nprefix, sizeof (nprefix), prefix,
+		    next) == 0) {
+			tier[dh->dh_nq] = ntier++;
+			domains[dh->dh_nq] = dname;
+			prefixes[dh->dh_nq++] = nprefix;
+		}
+		tier[dh->dh_nq] = ntier;
+		domains[dh->dh_nq] = dname;
+		prefixes[dh->dh_nq++] = prefix;
+	}
+	if (guid != NULL && forest != NULL) {
+		if (dcl_guid_prefix(gprefix, sizeof (gprefix), prefix,
+		    guid) != 0)
+			return (-1);
+		tier[dh->dh_nq] = ntier;
+		domains[dh->dh_nq] = forest;
+		prefixes[dh->dh_nq++] = gprefix;
+	}
+
+	/*
+	 * Send every query at once.  Every hold is set first, so a query
+	 * that fails at once releases the ones ranked below it.  Answers
+	 * from the static map are taken once all the queries are out.
+	 */
+	for (i = 0; i < dh->dh_nq; i++)
+		dh->dh_q[i].dq_notbefore = now + tier[i] * DCL_SITE_GRACE;
+	for (i = 0; i < dh->dh_nq; i++) {
+		dcl_query_t *dq = &dh->dh_q[i];
+
+		if ((dq->dq_srv = lsa_srv_init()) == NULL)
+			return (-1);
+		dq->dq_srv->lsc_limit = deadline;
+		if (lsa_srv_send(dq->dq_srv, prefixes[i], domains[i]) < 0)
+			dcl_query_done(dh, i, now);
+	}
+	for (i = 0; i < dh->dh_nq; i++)
+		if (dh->dh_q[i].dq_state == DQ_DNS &&
+		    lsa_srv_ready(dh->dh_q[i].dq_srv))
+			dcl_dns_ready(dh, i, now);
+
+	return (0);
+}
+
+static void
+dcl_fini(dcl_handle_t *dh)
+{
+	int i;
+
+	for (i = 0; i < dh->dh_nq; i++)
+		lsa_srv_fini(dh->dh_q[i].dq_srv);
+	ber_free(dh->dh_pdu, 1);
+	free(dh->dh_ring);
+	free(dh->dh_ex);
+	free(dh->dh_peer);
+	if (dh->dh_fd >= 0)
+		(void) lsa_wire_close(dh->dh_fd);
+	if (dh->dh_dci != NULL)
+		freedci(dh->dh_dci);
+	dc_locate_freeall(dh->dh_all, dh->dh_nall);
+}
+
+/*
+ * Give targets without glue the address their DC last reported, so only
+ * DCs never seen before need resolving.
+ */
+static void
+dcl_cache_addrs(lsa_srv_ctx_t *ctx)
+{
 	srv_rr_t *sr;
-	BerElement *pdu = NULL, *ret;
-	struct _berelement *be, *rbe;
- 	DOMAIN_CONTROLLER_INFO *dci = NULL;
-	int r, fd = -1;
-	struct sockaddr_storage addr;
-	struct sockaddr_in6 *paddr;
-	socklen_t addrlen;
-	char *dcaddr = NULL, *dcname = NULL;
-
-	ctx = lsa_srv_init();
-	if (ctx == NULL)
-		goto fail;
-
-	r = lsa_srv_lookup(ctx, prefix, dname);
-	if (r <= 0) 
-		goto fail;
+	int n;
+
+	for (n = 0; n < ctx->lsc_nsrv; n++) {
+		sr = &ctx->lsc_srv[n];
+		if (IN6_IS_ADDR_UNSPECIFIED(&sr->addr.sin6_addr))
+			(void) dc_cache_addr(sr->sr_name, &sr->addr.sin6_addr);
+	}
+}
+
+/*
+ * The targets without glue have been looked up, or r is -1 because some
+ * could not be.  A survey pings whatever did resolve and lists the rest
+ * unpinged.
+ */
+static void
+dcl_resolved(dcl_handle_t *dh, int q, int r, hrtime_t now)
+{
+	dcl_query_t *dq = &dh->dh_q[q];
+
+	if (r != 0 && (dh->dh_flags & DCL_F_SURVEY) == 0) {
+		dcl_query_done(dh, q, now);
+		return;
+	}
+	DCL_MARK_ONCE(&dh->dh_st, DCL_PHASE_ADDR);
+	dh->dh_st.dls_candidates += dq->dq_srv->lsc_nsrv;
+	dq->dq_state = DQ_PING;
+	dq->dq_cur = NULL;
+	dq->dq_nextping = 0;
+	if (dh->dh_hasfailed)
+		dcl_fail(dh, &dh->dh_failed);
 
 	if (lsa_srv_output)
-		lsa_srv_output(ctx);
+		lsa_srv_output(dq->dq_srv);
+}
+
+static void
+dcl_addr_ready(dcl_handle_t *dh, int q, hrtime_t now)
+{
+	int r;
+
+	if ((r = lsa_srv_resolve_recv(dh->dh_q[q].dq_srv)) != LSA_SRV_AGAIN)
+		dcl_resolved(dh, q, r, now);
+}
+
+static void
+dcl_dns_ready(dcl_handle_t *dh, int q, hrtime_t now)
+{
+	dcl_query_t *dq = &dh->dh_q[q];
+	int r;
+
+	if ((r = lsa_srv_recv(dq->dq_srv)) == LSA_SRV_AGAIN)
+		return;
+
+	DCL_MARK_ONCE(&dh->dh_st, DCL_PHASE_DNS);
+	if (r < 0)
+		lsa_metrics_count(LSA_METRICS_DOMAIN, dh->dh_name,
+		    LSA_M_DNS_ERRORS, 1);
+	else
+		lsa_metrics_time(LSA_METRICS_DOMAIN, dh->dh_name, LSA_H_DNS,
+		    now - dh->dh_st.dls_time[DCL_PHASE_START]);
+	if (r <= 0) {
+		dcl_query_done(dh, q, now);
+		return;
+	}
+
+	DCL_MARK_ONCE(&dh->dh_st, DCL_PHASE_SRV_PARSE);
+
+	if ((dh->dh_flags & DCL_F_CACHE) != 0)
+		dcl_cache_addrs(dq->dq_srv);
+	dq->dq_state = DQ_ADDR;
+	if (lsa_srv_resolve_send(dq->dq_srv) < 0)
+		dcl_resolved(dh, q, -1, now);
+	else if (lsa_srv_ready(dq->dq_srv))
+		dcl_addr_ready(dh, q, now);
+}
+
+/*
+ * Has a higher-ranked query already pinged this address, or given up on
+ * it?  A candidate counts as pinged from the moment its ping is sent, so
+ * the one a query has just pinged and is still waiting on is not pinged
+ * again by the queries after it.
+ */
+static boolean_t
+dcl_pinged(dcl_handle_t *dh, int q, const struct sockaddr_in6 *addr)
+{
+	lsa_srv_ctx_t *ctx;
+	int i, n;
+
+	for (i = 0; i < q; i++) {
+		ctx = dh->dh_q[i].dq_srv;
+		if (dh->dh_q[i].dq_state == DQ_DNS)
+			continue;
+		for (n = 0; n < ctx->lsc_nsrv; n++)
+			if ((ctx->lsc_srv[n].sr_pinged != 0 ||
+			    ctx->lsc_srv[n].sr_failed) &&
+			    IN6_ARE_ADDR_EQUAL(&ctx->lsc_srv[n].addr.sin6_addr,
+			    &addr->sin6_addr))
+				return (B_TRUE);
+	}
+
+	return (B_FALSE);
+}
+
+/*
+ * Send the ping PDU to the first n of dh_dst, as few syscalls as
+ * sendmmsg() allows.  A candidate the network says can't be reached is
+ * given up on, as never pinged, and one refused for any other reason is
+ * just skipped.  If the socket's buffer is full, stop there.  Returns
+ * the number of candidates dealt with; the rest are for the next tick.
+ */
+static int
+dcl_send(dcl_handle_t *dh, int n, hrtime_t now)
+{
+	struct _berelement *be = (struct _berelement *)dh->dh_pdu;
+	struct mmsghdr msg[DCL_BATCH];
+	struct iovec iov;
+	srv_rr_t *sr;
+	int i, j, r;
 
-	if ((fd = lsa_bind()) < 0)
-		goto fail;
+	iov.iov_base = be->ber_buf;
+	iov.iov_len = (size_t)(be->ber_end - be->ber_buf);
 
-	if ((pdu = ber_alloc()) == NULL)
-		goto fail;
-	
-	/* 
-	 * Is ntver right? It certainly works on w2k8... If others are needed,
-	 * that might require changes to lsa_cldap_parse
+	memset(msg, 0, n * sizeof (msg[0]));
+	for (i = 0; i < n; i++) {
+		msg[i].msg_hdr.msg_name = &dh->dh_dst[i];
+		msg[i].msg_hdr.msg_namelen = sizeof (dh->dh_dst[i]);
+		msg[i].msg_hdr.msg_iov = &iov;
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (i = 0; i < n; i += r) {
+		r = lsa_wire_sendmmsg(dh->dh_fd, msg + i, n - i, 0);
+		if (r < 0) {
+			switch (errno) {
+			case EINTR:
+				r = 0;
+				continue;
+			case EAGAIN:
+			case ENOBUFS:
+				return (i);
+			case EACCES:
+			case EHOSTUNREACH:
+			case ENETUNREACH:
+			case EADDRNOTAVAIL:
+				dh->dh_dstsr[i]->sr_failed = B_TRUE;
+				break;
+			default:
+				break;
+			}
+			r = 1;
+			continue;
+		}
+		if (r == 0)
+			return (i);
+		for (j = i; j < i + r; j++) {
+			sr = dh->dh_dstsr[j];
+			sr->sr_pinged = now;
+			lsa_metrics_count(LSA_METRICS_DC, sr->sr_name,
+			    LSA_M_PINGS, 1);
+		}
+		dh->dh_st.dls_pinged += r;
+	}
+	return (n);
+}
+
+static int
+dcl_ping(dcl_handle_t *dh, int q, hrtime_t now)
+{
+	dcl_query_t *dq = &dh->dh_q[q];
+	srv_rr_t *sr, *prev;
+	hrtime_t when = 0;
+	int i, r, n = 0;
+
+	if (dh->dh_fd < 0) {
+		if ((dh->dh_fd = lsa_bind()) < 0)
+			return (-1);
+		if ((dh->dh_ring = lsa_malloc(LSA_ALLOC_PDU,
+		    sizeof (dcl_ring_t))) == NULL)
+			return (-1);
+		for (i = 0; i < DCL_RING; i++) {
+			dh->dh_ring->dr_iov[i].iov_base = dh->dh_ring->dr_buf[i];
+			dh->dh_ring->dr_iov[i].iov_len = DCL_REPLYSZ;
+		}
+		lsa_alloc_note(LSA_ALLOC_PDU, 0);
+		if ((dh->dh_pdu = ber_alloc()) == NULL)
+			return (-1);
+		if ((dh->dh_flags & DCL_F_SURVEY) != 0)
+			r = lsa_cldap_setup_pdu(dh->dh_pdu, NULL, NULL, NULL,
+			    DCL_NTVER);
+		else
+			r = lsa_cldap_setup_pdu(dh->dh_pdu, dh->dh_dname, NULL,
+			    (dh->dh_dname == NULL) ? dh->dh_guid : NULL,
+			    DCL_NTVER);
+		if (r < 0) {
+			dh->dh_pdu = NULL;
+			return (-1);
+		}
+		DCL_MARK(&dh->dh_st, DCL_PHASE_SOCKET);
+	}
+
+	/*
+	 * Take the next dh_batch candidates this query hasn't seen, and
+	 * flush whenever a full batch is ready.  A target still without an
+	 * address was not resolved before the deadline.  A candidate over a
+	 * rate limit is pinged first once it is under it again.  A survey
+	 * pings each DC once and must have them all out well before its
+	 * deadline, so only the DCs' own limits apply to it.  If the socket
+	 * takes only part of a batch, the query starts over from its first
+	 * candidate at the next tick, passing those already pinged.
 	 */
-	r = lsa_cldap_setup_pdu(pdu, dname, NULL, NETLOGON_NT_VERSION_5EX); 
-
-	struct pollfd pingchk = {fd, POLLIN, 0};
-
-	if ((dcaddr = malloc(INET6_ADDRSTRLEN + 2)) == NULL)
-		goto fail;
-	if (strncpy(dcaddr, "\\\\", 3) == NULL)
-		goto fail;
-	if ((dcname = malloc(MAXHOSTNAMELEN + 3)) == NULL)
-		goto fail;
-
-	be = (struct _berelement *)pdu;
-	sr = NULL;
-	while ((sr = lsa_srv_next(ctx, sr)) != NULL) {
-		r = sendto(fd, be->ber_buf, (size_t)(be->ber_end - be->ber_buf),
-		    0, (struct sockaddr *)&sr->addr, sizeof(sr->addr));
-		if (poll(&pingchk, 1, 100) == 0)
+	for (i = 0; i < dh->dh_batch; i++) {
+		prev = dq->dq_cur;
+		do {
+			sr = lsa_srv_next(dq->dq_srv, dq->dq_cur);
+			if (sr == NULL)
+				break;
+			dq->dq_cur = sr;
+		} while (sr->sr_failed || sr->sr_pinged != 0 ||
+		    IN6_IS_ADDR_UNSPECIFIED(&sr->addr.sin6_addr) ||
+		    dcl_pinged(dh, q, &sr->addr));
+		if (sr == NULL)
+			break;
+		if ((when = lsa_rate_take(&sr->addr.sin6_addr,
+		    (dh->dh_flags & DCL_F_SURVEY) == 0, now)) != 0) {
+			lsa_metrics_count(LSA_METRICS_DC, sr->sr_name,
+			    LSA_M_DEFERRED, 1);
+			dq->dq_cur = prev;
+			break;
+		}
+		dh->dh_dstsr[n] = sr;
+		dh->dh_dst[n++] = sr->addr;
+		if (n == DCL_BATCH) {
+			if (dcl_send(dh, n, now) < n)
+				break;
+			n = 0;
+		}
+	}
+
+	if (n == DCL_BATCH || (n > 0 && dcl_send(dh, n, now) < n))
+		dq->dq_cur = NULL;
+	else if (sr == NULL)
+		dcl_query_done(dh, q, now);
+	if (i > 0)
+		dh->dh_lastping = now;
+	dq->dq_nextping = (when != 0) ? when :
+	    now + lsa_rate_jitter(DCL_PING_INTERVAL, DCL_PING_JITTER);
+	return (0);
+}
+
+/*
+ * Find the candidate a reply came from, for the trace.
+ */
+static srv_rr_t *
+dcl_lookup_addr(dcl_handle_t *dh, const struct sockaddr_in6 *addr)
+{
+	lsa_srv_ctx_t *ctx;
+	int i, n;
+
+	for (i = 0; i < dh->dh_nq; i++) {
+		ctx = dh->dh_q[i].dq_srv;
+		if (dh->dh_q[i].dq_state == DQ_DNS)
 			continue;
+		for (n = 0; n < ctx->lsc_nsrv; n++)
+			if (IN6_ARE_ADDR_EQUAL(&ctx->lsc_srv[n].addr.sin6_addr,
+			    &addr->sin6_addr))
+				return (&ctx->lsc_srv[n]);
+	}
 
-		if ((ret = ber_alloc()) == NULL)
-			goto fail;		
-		rbe = (struct _berelement *)ret;
-		recvfrom(fd, rbe->ber_buf, (size_t)(rbe->ber_end - rbe->ber_buf), 
-		    0, (struct sockaddr *)&addr, &addrlen);
+	return (NULL);
+}
 
-		if ((dci = malloc(sizeof (DOMAIN_CONTROLLER_INFO))) == NULL) {
-			ber_free(ret, 1);
-			goto fail;
+/*
+ * Add a reply to those collected by a DCL_F_ALL locate, and what else the
+ * DC said and the address it came from to those of a DCL_F_SURVEY one.
+ */
+static int
+dcl_keep(dcl_handle_t *dh, const dc_locate_reply_t *reply,
+    const struct sockaddr_in6 *peer, const lsa_cldap_ex_t *ex)
+{
+	dc_locate_reply_t *dlr;
+	lsa_cldap_ex_t *dx;
+	struct sockaddr_in6 *dp;
+	int cap;
+
+	if (dh->dh_nall == dh->dh_allcap) {
+		cap = (dh->dh_allcap == 0) ? 8 : dh->dh_allcap * 2;
+		if ((dlr = lsa_realloc(LSA_ALLOC_RESULT, dh->dh_all,
+		    cap * sizeof (*dlr))) == NULL)
+			return (-1);
+		dh->dh_all = dlr;
+		if ((dh->dh_flags & DCL_F_SURVEY) != 0) {
+			if ((dx = lsa_realloc(LSA_ALLOC_RESULT, dh->dh_ex,
+			    cap * sizeof (*dx))) == NULL)
+				return (-1);
+			dh->dh_ex = dx;
+			if ((dp = lsa_realloc(LSA_ALLOC_RESULT, dh->dh_peer,
+			    cap * sizeof (*dp))) == NULL)
+				return (-1);
+			dh->dh_peer = dp;
 		}
-		dci->DomainControllerName = dcname;
+		dh->dh_allcap = cap;
+	}
+
+	if ((dh->dh_flags & DCL_F_SURVEY) != 0) {
+		dh->dh_ex[dh->dh_nall] = *ex;
+		dh->dh_peer[dh->dh_nall] = *peer;
+	}
+	dh->dh_all[dh->dh_nall++] = *reply;
+	return (0);
+}
+
+/*
+ * Decode one NetLogon reply, received at time now.  Returns 1 if it
+ * produced a result, 0 if it should be ignored or was collected, -1 on a
+ * fatal error.
+ */
+static int
+dcl_reply(dcl_handle_t *dh, char *buf, size_t len,
+    const struct sockaddr_in6 *paddr, hrtime_t now)
+{
+	struct berval bv;
+	BerElement *ret;
+	DOMAIN_CONTROLLER_INFO *dci;
+	dc_locate_reply_t dlr;
+	lsa_cldap_ex_t ex;
+	const struct sockaddr_in6 *dcsa;
+	srv_rr_t *sr;
+	char *dcaddr = NULL, peer[INET6_ADDRSTRLEN];
+	const char *dcname;
+	int r;
 
-		r = lsa_cldap_parse(ret, dci);
+	dh->dh_replies++;
+	DCL_MARK_ONCE(&dh->dh_st, DCL_PHASE_PING);
+
+	sr = dcl_lookup_addr(dh, paddr);
+	if (sr != NULL) {
+		sr->sr_replied = B_TRUE;
+		dcname = sr->sr_name;
+	} else {
+		dcname = inet_ntop(AF_INET6, &paddr->sin6_addr, peer,
+		    sizeof (peer));
+	}
+	lsa_metrics_count(LSA_METRICS_DC, dcname, LSA_M_REPLIES, 1);
+	if (sr != NULL && sr->sr_failed)
+		return (0);
+
+	bv.bv_val = buf;
+	bv.bv_len = len;
+	lsa_alloc_note(LSA_ALLOC_REPLY, 0);
+	if ((ret = ber_init(&bv)) == NULL)
+		return (-1);
+
+	if ((dci = lsa_calloc(LSA_ALLOC_RESULT, 1,
+	    sizeof (DOMAIN_CONTROLLER_INFO))) == NULL ||
+	    (dci->DomainControllerName = lsa_malloc(LSA_ALLOC_RESULT,
+	    MAXHOSTNAMELEN + 3)) == NULL ||
+	    (dcaddr = lsa_malloc(LSA_ALLOC_RESULT,
+	    INET6_ADDRSTRLEN + 2)) == NULL) {
 		ber_free(ret, 1);
-		if (r == 0)
-			break;
-		if (r > 1)
-			goto fail;
+		freedci(dci);
+		return (-1);
 	}
 
-	if (sr == NULL)
-		goto fail;
+	ex.lce_ntver = DCL_NTVER;
+	r = lsa_cldap_parse_ex(ret, dci, &ex);
+	ber_free(ret, 1);
+	if (r != 0) {
+		if (r != 2)
+			lsa_metrics_count(LSA_METRICS_DC, dcname,
+			    LSA_M_PARSE_ERRORS, 1);
+		free(dcaddr);
+		freedci(dci);
+		return ((r > 1) ? -1 : 0);
+	}
+	DCL_MARK(&dh->dh_st, DCL_PHASE_PARSE);
 
-	paddr = (struct sockaddr_in6 *)&addr;
-	inet_ntop(paddr->sin6_family, &paddr->sin6_addr, dcaddr+2, 
-	    INET6_ADDRSTRLEN);
+	/*
+	 * Prefer the address the DC gave for itself to the one that
+	 * answered.
+	 */
+	dcsa = (ex.lce_addr.sin6_family == AF_INET6) ? &ex.lce_addr : paddr;
+	(void) strncpy(dcaddr, "\\\\", 3);
+	inet_ntop(AF_INET6, &dcsa->sin6_addr, dcaddr+2, INET6_ADDRSTRLEN);
 	dci->DomainControllerAddress = dcaddr;
 	dci->DomainControllerAddressType = DS_INET_ADDRESS;
 
-	ber_free(pdu, 1);
-	lsa_srv_fini(ctx);
-	(void) close(fd);
-	return (dci);
+	if (dh->dh_st.dls_status != 0) {
+		if (sr != NULL)
+			(void) strlcpy(dh->dh_st.dls_dcname, sr->sr_name,
+			    sizeof (dh->dh_st.dls_dcname));
+		dh->dh_st.dls_dcaddr = *paddr;
+		dh->dh_st.dls_status = 0;
+	}
+	dcl_guid_learn((dh->dh_dname != NULL &&
+	    (dh->dh_flags & DCL_F_SURVEY) == 0) ? dh->dh_dname :
+	    dci->DomainName, dci, ex.lce_nextsite);
+
+	dlr.dlr_dci = dci;
+	dlr.dlr_addr = *dcsa;
+	dlr.dlr_rtt = (sr != NULL && sr->sr_pinged != 0) ?
+	    now - sr->sr_pinged : 0;
+	if (dlr.dlr_rtt != 0)
+		lsa_metrics_time(LSA_METRICS_DC, dcname, LSA_H_RTT,
+		    dlr.dlr_rtt);
+	if (dh->dh_cb != NULL)
+		dh->dh_cb(&dlr, dh->dh_cbarg);
 
- fail:
-	lsa_srv_fini(ctx);
-	if (dci)
+	if ((dh->dh_flags & DCL_F_ALL) == 0) {
+		dh->dh_dci = dci;
+		if ((dh->dh_flags & DCL_F_CACHE) != 0 && dh->dh_dname != NULL)
+			dc_cache_rele(dc_cache_enter(dh->dh_prefix,
+			    dh->dh_dname, DCL_SITE(dh), dci, dcsa));
+		return (1);
+	}
+	if (dcl_keep(dh, &dlr, paddr, &ex) != 0) {
 		freedci(dci);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Drain every queued reply with recvmmsg().  Returns 1 once a reply has
+ * produced a result, 0 when the socket is empty, -1 on a fatal error.
+ */
+static int
+dcl_drain(dcl_handle_t *dh)
+{
+	dcl_ring_t *dr = dh->dh_ring;
+	hrtime_t now;
+	int i, n, r;
+
+	do {
+		for (i = 0; i < DCL_RING; i++) {
+			memset(&dr->dr_msg[i].msg_hdr, 0,
+			    sizeof (dr->dr_msg[i].msg_hdr));
+			dr->dr_msg[i].msg_hdr.msg_name = &dr->dr_from[i];
+			dr->dr_msg[i].msg_hdr.msg_namelen =
+			    sizeof (dr->dr_from[i]);
+			dr->dr_msg[i].msg_hdr.msg_iov = &dr->dr_iov[i];
+			dr->dr_msg[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		if ((n = lsa_wire_recvmmsg(dh->dh_fd, dr->dr_msg, DCL_RING,
+		    MSG_DONTWAIT)) <= 0)
+			return (0);
+
+		now = gethrtime();
+		for (i = 0; i < n; i++) {
+			r = dcl_reply(dh, dr->dr_buf[i], dr->dr_msg[i].msg_len,
+			    &dr->dr_from[i], now);
+			if (r != 0)
+				return (r);
+		}
+	} while (n == DCL_RING);
+
+	return (0);
+}
+
+/*
+ * When a locate that has nothing left to ask stops waiting for replies:
+ * the last ping's interval after it was sent, or for a survey with a
+ * deadline, the deadline.
+ */
+static hrtime_t
+dcl_linger(dcl_handle_t *dh)
+{
+	if ((dh->dh_flags & DCL_F_SURVEY) != 0 && dh->dh_deadline != 0)
+		return (dh->dh_deadline);
+	return (dh->dh_lastping + DCL_PING_INTERVAL);
+}
+
+/*
+ * Fill in the descriptors a started locate is waiting on, and the time
+ * it next needs to run even if none of them becomes ready.
+ */
+static int
+dcl_fds(dcl_handle_t *dh, struct pollfd *pfd, int npfd, hrtime_t *wake)
+{
+	hrtime_t due;
+	int i, n = 0, active = 0;
+
+	*wake = LLONG_MAX;
+	for (i = 0; i < dh->dh_nq; i++) {
+		dcl_query_t *dq = &dh->dh_q[i];
+
+		switch (dq->dq_state) {
+		case DQ_DNS:
+		case DQ_ADDR:
+			if (n < npfd && dq->dq_srv->lsc_fd >= 0) {
+				pfd[n].fd = dq->dq_srv->lsc_fd;
+				pfd[n].events = dq->dq_srv->lsc_events;
+				pfd[n++].revents = 0;
+			}
+			due = lsa_srv_deadline(dq->dq_srv);
+			break;
+		case DQ_PING:
+			due = MAX(dq->dq_notbefore, dq->dq_nextping);
+			break;
+		default:
+			continue;
+		}
+		if (due < *wake)
+			*wake = due;
+		active++;
+	}
+
+	/*
+	 * Nothing left to ask: give the last ping its time to be answered.
+	 */
+	if (active == 0)
+		*wake = dcl_linger(dh);
+	if (dh->dh_deadline != 0 && dh->dh_deadline < *wake)
+		*wake = dh->dh_deadline;
+
+	if (dh->dh_fd >= 0 && n < npfd) {
+		pfd[n].fd = dh->dh_fd;
+		pfd[n].events = POLLIN;
+		pfd[n++].revents = 0;
+	}
+
+	return (n);
+}
+
+/*
+ * Handle whatever poll() found ready.  Returns 1 once a reply has produced
+ * a result, 0 to keep going, -1 on a fatal error.
+ */
+static int
+dcl_events(dcl_handle_t *dh, const struct pollfd *pfd, int npfd, hrtime_t now)
+{
+	int i, q, r;
+
+	for (i = 0; i < npfd; i++) {
+		if ((pfd[i].revents & (POLLIN | POLLOUT | POLLERR | POLLHUP)) ==
+		    0)
+			continue;
+		if (pfd[i].fd == dh->dh_fd) {
+			if ((r = dcl_drain(dh)) != 0)
+				return (r);
+			continue;
+		}
+		for (q = 0; q < dh->dh_nq; q++) {
+			if (dh->dh_q[q].dq_srv == NULL ||
+			    dh->dh_q[q].dq_srv->lsc_fd != pfd[i].fd)
+				continue;
+			if (dh->dh_q[q].dq_state == DQ_DNS)
+				dcl_dns_ready(dh, q, now);
+			else if (dh->dh_q[q].dq_state == DQ_ADDR)
+				dcl_addr_ready(dh, q, now);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Retry DNS queries that have timed out and send the pings that are due.
+ * Returns -1 once there is nothing left to wait for, 0 otherwise.
+ */
+static int
+dcl_timers(dcl_handle_t *dh, hrtime_t now)
+{
+	int i, active = 0;
+
+	for (i = 0; i < dh->dh_nq; i++) {
+		dcl_query_t *dq = &dh->dh_q[i];
+
+		switch (dq->dq_state) {
+		case DQ_DNS:
+			if (now >= lsa_srv_deadline(dq->dq_srv) &&
+			    lsa_srv_retry(dq->dq_srv) < 0) {
+				lsa_metrics_count(LSA_METRICS_DOMAIN,
+				    dh->dh_name, LSA_M_DNS_ERRORS, 1);
+				dcl_query_done(dh, i, now);
+			}
+			break;
+		case DQ_ADDR:
+			if (now >= lsa_srv_deadline(dq->dq_srv) &&
+			    lsa_srv_retry(dq->dq_srv) < 0)
+				dcl_addr_ready(dh, i, now);
+			break;
+		case DQ_PING:
+			if (now >= MAX(dq->dq_notbefore, dq->dq_nextping) &&
+			    dcl_ping(dh, i, now) != 0)
+				return (-1);
+			break;
+		default:
+			break;
+		}
+		if (dq->dq_state != DQ_DONE)
+			active++;
+	}
+
+	if (active == 0 &&
+	    (dh->dh_fd < 0 || now >= dcl_linger(dh)))
+		return (-1);
+
+	/*
+	 * A survey has nothing more to hear once every DC has answered.
+	 */
+	if (active == 0 && (dh->dh_flags & DCL_F_SURVEY) != 0 &&
+	    dh->dh_replies >= dh->dh_st.dls_pinged)
+		return (-1);
+
+	return (0);
+}
+
+static dcl_handle_t *
+dcl_open(const char *prefix, const char *dname, const char *site,
+    const char *forest, const uint8_t *guid, uint32_t flags, hrtime_t deadline)
+{
+	dcl_handle_t *dh;
+
+	if ((dh = lsa_malloc(LSA_ALLOC_PDU, sizeof (*dh))) == NULL)
+		return (NULL);
+
+	if (dcl_start(dh, prefix, dname, site, forest, guid, flags,
+	    deadline) != 0) {
+		dc_locate_cancel(dh);
+		return (NULL);
+	}
+
+	return (dh);
+}
+
+static void
+dcl_run(dcl_handle_t *dh)
+{
+	struct pollfd pfd[DCL_MAXFDS];
+	int n, timeout;
+
+	do {
+		n = dc_locate_pollfds(dh, pfd, DCL_MAXFDS, &timeout);
+		if (poll(pfd, n, timeout) < 0)
+			n = 0;
+	} while (dc_locate_step(dh, pfd, n) == DCL_STEP_AGAIN);
+}
+
+/*
+ * Run a locate to completion and release it, keeping the errno
+ * dc_locate_wait() set.
+ */
+static DOMAIN_CONTROLLER_INFO *
+dcl_wait(dcl_handle_t *dh)
+{
+	DOMAIN_CONTROLLER_INFO *dci;
+	int err;
+
+	if (dh == NULL)
+		return (NULL);
+
+	dci = dc_locate_wait(dh);
+	err = errno;
+	dc_locate_cancel(dh);
+	errno = err;
+	return (dci);
+}
+
+/*
+ * Start a locate without waiting for it; see dc_locate_ex() for the
+ * arguments.  The caller polls the descriptors from dc_locate_pollfds()
+ * and calls dc_locate_step() whenever one is ready or the timeout has
+ * passed, until it returns DCL_STEP_DONE, DCL_STEP_FAIL or
+ * DCL_STEP_TIMEOUT.  Every query the locate makes, including the TCP
+ * requery of a truncated SRV answer and the address lookups of targets
+ * without glue, goes through those descriptors; a step never waits.
+ * Returns NULL if the locate could not be started.
+ */
+dc_locate_handle_t *
+dc_locate_start(const char *prefix, const char *dname, const char *site,
+    uint32_t flags, hrtime_t deadline)
+{
+	char forest[MAXHOSTNAMELEN];
+	uint8_t guid[16];
+
+	lsa_wire_locate(prefix, dname, site, NULL, NULL,
+	    flags & ~DCL_F_LOOKEDUP);
+	if ((flags & DCL_F_GUID) != 0 &&
+	    dcl_guid_known(dname, forest, sizeof (forest), guid))
+		return (dcl_open(prefix, dname, site, forest, guid, flags,
+		    deadline));
+
+	return (dcl_open(prefix, dname, site, NULL, NULL, flags, deadline));
+}
+
+/*
+ * Fill pfd[] with up to npfd descriptors to wait on for reading, and set
+ * *timeout to the milliseconds until dc_locate_step() must be called
+ * regardless.  The set changes as the locate progresses, so fetch it
+ * again after every step.  DCL_MAXFDS entries are always enough.
+ */
+int
+dc_locate_pollfds(dc_locate_handle_t *dh, struct pollfd *pfd, int npfd,
+    int *timeout)
+{
+	hrtime_t now, wake;
+	int n;
+
+	if (dh->dh_status != DCL_STEP_AGAIN) {
+		*timeout = 0;
+		return (0);
+	}
+
+	n = dcl_fds(dh, pfd, npfd, &wake);
+	now = gethrtime();
+	*timeout = (wake > now) ?
+	    (int)((wake - now + DCL_MSEC - 1) / DCL_MSEC) : 0;
+	return (n);
+}
+
+/*
+ * Advance a locate.  pfd[] holds the descriptors from dc_locate_pollfds()
+ * with revents filled in; it may be empty when only the timeout fired.
+ * Returns DCL_STEP_AGAIN until the locate has finished.  Replies that are
+ * waiting when the deadline passes still count; after that, nothing more
+ * is sent.
+ */
+int
+dc_locate_step(dc_locate_handle_t *dh, const struct pollfd *pfd, int npfd)
+{
+	hrtime_t now;
+	int r;
+
+	if (dh->dh_status != DCL_STEP_AGAIN)
+		return (dh->dh_status);
+
+	now = gethrtime();
+	if ((r = dcl_events(dh, pfd, npfd, now)) == 0) {
+		if (dh->dh_deadline != 0 && gethrtime() >= dh->dh_deadline) {
+			if ((dh->dh_flags & DCL_F_SURVEY) == 0)
+				lsa_metrics_count(LSA_METRICS_DOMAIN,
+				    dh->dh_name, LSA_M_DEADLINES, 1);
+			r = DCL_STEP_TIMEOUT;
+		} else {
+			r = dcl_timers(dh, now);
+		}
+	}
+	if (r < 0 && dh->dh_nall > 0)
+		r = 1;
+	if (r > 0)
+		dh->dh_status = DCL_STEP_DONE;
+	else if (r < 0)
+		dh->dh_status = (r == DCL_STEP_TIMEOUT) ? r : DCL_STEP_FAIL;
+
+	/*
+	 * Only pings that all went unanswered say the DCs are failing.  A
+	 * locate cut short by its deadline, or that failed before it could
+	 * ping, for want of an SRV answer or for a local error, says nothing
+	 * about them.
+	 */
+	if (dh->dh_status == DCL_STEP_AGAIN ||
+	    (dh->dh_flags & DCL_F_SURVEY) != 0)
+		return (dh->dh_status);
+	if (dh->dh_status == DCL_STEP_DONE)
+		dcl_backoff_note(dh, B_FALSE, now);
+	else if (dh->dh_status == DCL_STEP_FAIL &&
+	    dh->dh_st.dls_pinged > 0 && dh->dh_replies == 0)
+		dcl_backoff_note(dh, B_TRUE, now);
 	else
-		free(dcname);
-	free(dcaddr);
-	ber_free(pdu, 1);
-	if (fd >= 0)
-		(void) close(fd);
+		dcl_backoff_unprobe(dh);
+
+	return (dh->dh_status);
+}
+
+/*
+ * Take the answer of a locate that returned DCL_STEP_DONE.  The caller
+ * owns it and frees it with freedci().
+ */
+DOMAIN_CONTROLLER_INFO *
+dc_locate_result(dc_locate_handle_t *dh)
+{
+	DOMAIN_CONTROLLER_INFO *dci = dh->dh_dci;
+
+	dh->dh_dci = NULL;
+	return (dci);
+}
+
+/*
+ * The errno for a locate that finished without an answer.
+ */
+static int
+dcl_errno(const dcl_handle_t *dh)
+{
+	if (dh->dh_status == DCL_STEP_TIMEOUT)
+		return (ETIMEDOUT);
+	return (dh->dh_backoff ? EAGAIN : ENOENT);
+}
+
+/*
+ * Run a locate until it finishes and take its answer, keeping the handle
+ * for dc_locate_next().  Returns NULL with errno set to ETIMEDOUT if the
+ * deadline passed first, EAGAIN if it was not tried because locates of
+ * the same query had just failed, or ENOENT if no DC answered.
+ */
+DOMAIN_CONTROLLER_INFO *
+dc_locate_wait(dc_locate_handle_t *dh)
+{
+	dcl_run(dh);
+	if (dh->dh_status != DCL_STEP_DONE)
+		errno = dcl_errno(dh);
+	return (dc_locate_result(dh));
+}
+
+/*
+ * A locate answered from the cache has no candidates to fall back on;
+ * start the queries now, and skip the failed DC when they answer.
+ */
+static int
+dcl_uncache(dcl_handle_t *dh, const struct in6_addr *failed)
+{
+	char prefix[NS_MAXDNAME], dname[MAXHOSTNAMELEN];
+	char site[NS_MAXLABEL + 1], forest[MAXHOSTNAMELEN];
+	uint32_t flags = dh->dh_flags;
+	hrtime_t deadline = dh->dh_deadline;
+	uint8_t guid[16];
+	boolean_t byguid;
+
+	(void) strlcpy(prefix, dh->dh_prefix, sizeof (prefix));
+	(void) strlcpy(dname, dh->dh_name, sizeof (dname));
+	(void) strlcpy(site, dh->dh_site, sizeof (site));
+	byguid = (flags & DCL_F_GUID) != 0 &&
+	    dcl_guid_known(dname, forest, sizeof (forest), guid);
+
+	dcl_fini(dh);
+	if (dcl_start(dh, prefix, dname, (site[0] != '\0') ? site : NULL,
+	    byguid ? forest : NULL, byguid ? guid : NULL,
+	    flags & ~DCL_F_CACHE, deadline) != 0) {
+		dh->dh_status = DCL_STEP_FAIL;
+		return (-1);
+	}
+
+	dh->dh_flags = flags;
+	dh->dh_failed = *failed;
+	dh->dh_hasfailed = B_TRUE;
+	return (0);
+}
+
+/*
+ * Restart a finished locate after the caller has given up on the DC it
+ * returned, failed, or on the last DC it answered with if failed is NULL.
+ * The candidates from the original SRV answers are kept, so this only
+ * pings the ones not tried yet: no DNS queries are sent unless one was
+ * still outstanding.  A reply that arrived after the locate finished
+ * still counts.  With DCL_F_CACHE, the failed DC is dropped from the
+ * cache, and a locate that was answered from the cache starts its
+ * queries now.  The deadline the locate started with still holds.  Drive
+ * the handle with dc_locate_step() again afterwards.
+ */
+int
+dc_locate_resume(dc_locate_handle_t *dh, const DOMAIN_CONTROLLER_INFO *failed)
+{
+	struct in6_addr addr = dh->dh_st.dls_dcaddr.sin6_addr;
+	const char *p;
+	hrtime_t now = gethrtime();
+	int i;
+
+	if (failed != NULL && (p = failed->DomainControllerAddress) != NULL) {
+		while (*p == '\\')
+			p++;
+		if (inet_pton(AF_INET6, p, &addr) != 1)
+			return (-1);
+	}
+	if ((dh->dh_flags & DCL_F_CACHE) != 0 && dh->dh_dname != NULL)
+		dc_cache_remove(dh->dh_prefix, dh->dh_dname, DCL_SITE(dh));
+	if (dh->dh_cached)
+		return (dcl_uncache(dh, &addr));
+	if (dh->dh_st.dls_status == 0 || failed != NULL)
+		dcl_fail(dh, &addr);
+
+	if (dh->dh_dci != NULL) {
+		freedci(dh->dh_dci);
+		dh->dh_dci = NULL;
+	}
+	for (i = 0; i < dh->dh_nq; i++) {
+		dh->dh_q[i].dq_notbefore = now;
+		dh->dh_q[i].dq_nextping = 0;
+	}
+	dh->dh_st.dls_status = -1;
+	dh->dh_status = DCL_STEP_AGAIN;
+	return (0);
+}
+
+/*
+ * Fail over from a DC returned by dc_locate_wait() or an earlier
+ * dc_locate_next() to the next one that answers.
+ */
+DOMAIN_CONTROLLER_INFO *
+dc_locate_next(dc_locate_handle_t *dh, const DOMAIN_CONTROLLER_INFO *failed)
+{
+	if (dc_locate_resume(dh, failed) != 0)
+		return (NULL);
+
+	return (dc_locate_wait(dh));
+}
+
+/*
+ * Rank collected replies: DCs in the client's site first, then writable
+ * ones, then the fastest.
+ */
+static int
+dcl_reply_cmp(const void *a, const void *b)
+{
+	const dc_locate_reply_t *ra = a, *rb = b;
+	unsigned long fa = ra->dlr_dci->Flags, fb = rb->dlr_dci->Flags;
+
+	if (((fa ^ fb) & DS_CLOSEST_FLAG) != 0)
+		return (((fa & DS_CLOSEST_FLAG) != 0) ? -1 : 1);
+	if (((fa ^ fb) & DS_WRITABLE_FLAG) != 0)
+		return (((fa & DS_WRITABLE_FLAG) != 0) ? -1 : 1);
+	if (ra->dlr_rtt != rb->dlr_rtt)
+		return ((ra->dlr_rtt < rb->dlr_rtt) ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Have cb called with each reply as it arrives.
+ */
+void
+dc_locate_callback(dc_locate_handle_t *dh, dc_locate_cb_t cb, void *arg)
+{
+	dh->dh_cb = cb;
+	dh->dh_cbarg = arg;
+}
+
+/*
+ * Take the ranked replies of a DCL_F_ALL locate that returned
+ * DCL_STEP_DONE.  The caller frees them with dc_locate_freeall().
+ */
+dc_locate_reply_t *
+dc_locate_results(dc_locate_handle_t *dh, int *np)
+{
+	dc_locate_reply_t *all = dh->dh_all;
+
+	if (all != NULL)
+		qsort(all, dh->dh_nall, sizeof (*all), dcl_reply_cmp);
+	*np = dh->dh_nall;
+	dh->dh_all = NULL;
+	dh->dh_nall = dh->dh_allcap = 0;
+	return (all);
+}
+
+void
+dc_locate_freeall(dc_locate_reply_t *all, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		freedci(all[i].dlr_dci);
+	free(all);
+}
+
+/*
+ * Find the entry for an address among the first n of a survey, or for a
+ * name if the address is unspecified.
+ */
+static dc_survey_t *
+dcl_survey_find(dc_survey_t *all, int n, const struct in6_addr *addr,
+    const char *name)
+{
+	boolean_t byname = IN6_IS_ADDR_UNSPECIFIED(addr);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!IN6_ARE_ADDR_EQUAL(&all[i].ds_addr.sin6_addr, addr))
+			continue;
+		if (!byname || strcasecmp(all[i].ds_name, name) == 0)
+			return (&all[i]);
+	}
 	return (NULL);
 }
+
+/*
+ * Take the results of a finished DCL_F_SURVEY locate, as described for
+ * dc_survey_t.  Targets are listed once per address, and those never
+ * resolved once per name.  The caller frees them with
+ * dc_locate_freesurvey().  Returns NULL with *np set to 0 if there was
+ * nothing to list.
+ */
+dc_survey_t *
+dc_locate_survey(dc_locate_handle_t *dh, int *np)
+{
+	dc_survey_t *all, *ds;
+	dc_locate_reply_t *dlr;
+	const struct sockaddr_in6 *peer;
+	lsa_srv_ctx_t *ctx;
+	srv_rr_t *sr;
+	int i, j, n = 0, cap = dh->dh_nall;
+
+	*np = 0;
+	for (i = 0; i < dh->dh_nq; i++)
+		if (dh->dh_q[i].dq_state != DQ_DNS)
+			cap += dh->dh_q[i].dq_srv->lsc_nsrv;
+	if (cap == 0 || (all = lsa_calloc(LSA_ALLOC_RESULT, cap,
+	    sizeof (*all))) == NULL)
+		return (NULL);
+
+	for (i = 0; i < dh->dh_nq; i++) {
+		if (dh->dh_q[i].dq_state == DQ_DNS)
+			continue;
+		ctx = dh->dh_q[i].dq_srv;
+		for (j = 0; j < ctx->lsc_nsrv; j++) {
+			sr = &ctx->lsc_srv[j];
+			if (dcl_survey_find(all, n, &sr->addr.sin6_addr,
+			    sr->sr_name) != NULL)
+				continue;
+			ds = &all[n++];
+			(void) strlcpy(ds->ds_name, sr->sr_name,
+			    sizeof (ds->ds_name));
+			ds->ds_priority = sr->sr_priority;
+			ds->ds_weight = sr->sr_weight;
+			ds->ds_port = sr->sr_port;
+			ds->ds_pinged = (sr->sr_pinged != 0);
+			ds->ds_addr = sr->addr;
+		}
+	}
+
+	/*
+	 * Match up the replies, which now belong to the survey, by the
+	 * address each came from: the one pinged, whatever the DC says its
+	 * own is.
+	 */
+	for (i = 0; i < dh->dh_nall; i++) {
+		dlr = &dh->dh_all[i];
+		peer = (dh->dh_peer != NULL) ? &dh->dh_peer[i] : &dlr->dlr_addr;
+		ds = dcl_survey_find(all, n, &peer->sin6_addr, "");
+		if (ds != NULL && ds->ds_dci != NULL)
+			continue;	/* answered twice */
+		if (ds == NULL) {
+			ds = &all[n++];
+			ds->ds_addr = *peer;
+			ds->ds_pinged = B_TRUE;
+		}
+		ds->ds_dci = dlr->dlr_dci;
+		ds->ds_rtt = dlr->dlr_rtt;
+		if (dh->dh_ex != NULL)
+			ds->ds_ex = dh->dh_ex[i];
+		dlr->dlr_dci = NULL;
+	}
+
+	*np = n;
+	return (all);
+}
+
+void
+dc_locate_freesurvey(dc_survey_t *all, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		freedci(all[i].ds_dci);
+	free(all);
+}
+
+/*
+ * Add a finished locate to the metrics.  A DC counts as timed out if it
+ * was pinged at least DCL_PING_INTERVAL before the end and never answered.
+ */
+static void
+dcl_metrics(dcl_handle_t *dh)
+{
+	const char *dname = (dh->dh_name[0] != '\0') ? dh->dh_name : NULL;
+	hrtime_t now = gethrtime();
+	lsa_srv_ctx_t *ctx;
+	srv_rr_t *sr;
+	uint64_t timeouts = 0;
+	int i, n;
+
+	for (i = 0; i < dh->dh_nq; i++) {
+		if ((ctx = dh->dh_q[i].dq_srv) == NULL ||
+		    dh->dh_q[i].dq_state == DQ_DNS)
+			continue;
+		for (n = 0; n < ctx->lsc_nsrv; n++) {
+			sr = &ctx->lsc_srv[n];
+			if (sr->sr_pinged == 0 || sr->sr_replied ||
+			    now - sr->sr_pinged < DCL_PING_INTERVAL)
+				continue;
+			lsa_metrics_count(LSA_METRICS_DC, sr->sr_name,
+			    LSA_M_TIMEOUTS, 1);
+			timeouts++;
+		}
+	}
+
+	lsa_metrics_count(LSA_METRICS_DOMAIN, dname, LSA_M_LOCATES, 1);
+	if (dh->dh_st.dls_status != 0)
+		lsa_metrics_count(LSA_METRICS_DOMAIN, dname, LSA_M_FAILURES, 1);
+	lsa_metrics_count(LSA_METRICS_DOMAIN, dname, LSA_M_TIMEOUTS, timeouts);
+	lsa_metrics_time(LSA_METRICS_DOMAIN, dname, LSA_H_LOCATE,
+	    now - dh->dh_st.dls_time[DCL_PHASE_START]);
+}
+
+/*
+ * Stop a locate, finished or not, and release the handle.
+ */
+void
+dc_locate_cancel(dc_locate_handle_t *dh)
+{
+	if (dh == NULL)
+		return;
+
+	dh->dh_st.dls_timeouts = dh->dh_st.dls_pinged - dh->dh_replies;
+	dcl_backoff_unprobe(dh);
+	dcl_metrics(dh);
+	dcl_fini(dh);
+	if (dc_locate_trace)
+		dc_locate_trace(&dh->dh_st);
+	free(dh);
+}
+
+/*
+ * Locate a DC for a domain, preferring the given site when one is known.
+ * The site-specific and generic SRV queries are sent together; DCs from
+ * the generic answer are only pinged once the site query has failed or
+ * DCL_SITE_GRACE has passed, so an empty or misconfigured site costs at
+ * most the grace window rather than a second round trip.  Once a DC has
+ * named the next closest site for the client's, that site's query is sent
+ * too and ranked between the two, so a site without a working DC falls
+ * back to the nearest one before any DC in the domain.
+ *
+ * With DCL_F_SWEEP, every candidate of a query is pinged as soon as its
+ * answer arrives, in a few sendmmsg() calls, rather than one candidate
+ * per DCL_PING_INTERVAL.
+ *
+ * With DCL_F_GUID, if an earlier reply for this domain told us its
+ * DomainGuid and forest, the DomainGuid query is sent as well, so a
+ * renamed domain or broken delegation does not hold up the locate.
+ *
+ * A nonzero deadline bounds the whole locate.  Resolver retries are not
+ * sent, targets without glue are not looked up and no DC is pinged once
+ * it has passed.  Returns NULL with errno set to ETIMEDOUT if no DC
+ * answered by then, to EAGAIN if locates of the same query failed so
+ * recently that this one was not tried, or to ENOENT if no DC answered
+ * at all.
+ */
+DOMAIN_CONTROLLER_INFO *
+dc_locate_ex(const char *prefix, const char *dname, const char *site,
+    uint32_t flags, hrtime_t deadline)
+{
+	return (dcl_wait(dc_locate_start(prefix, dname, site, flags,
+	    deadline)));
+}
+
+/*
+ * Locate a DC as dc_locate_ex() does, into the caller's dci with its
+ * strings in buf, so there is nothing to free.  DCI_BUFSZ bytes are always
+ * enough.  With DCL_F_CACHE, a locate the cache answers allocates nothing.
+ * Returns 0, or -1 with errno set as for dc_locate_ex(), or to ERANGE if
+ * buf was too small.
+ */
+int
+dc_locate_buf(const char *prefix, const char *dname, const char *site,
+    uint32_t flags, hrtime_t deadline, DOMAIN_CONTROLLER_INFO *dci, char *buf,
+    size_t len)
+{
+	DOMAIN_CONTROLLER_INFO *res;
+	struct sockaddr_in6 addr;
+	dc_locate_stats_t st;
+	hrtime_t start = gethrtime();
+	int rc, err;
+
+	if ((flags & DCL_F_CACHE) != 0 &&
+	    ((rc = dc_cache_get(prefix, dname, site, dci, buf, len,
+	    &addr)) == 0 || errno != ENOENT)) {
+		err = errno;
+		lsa_metrics_count(LSA_METRICS_DOMAIN, dname, LSA_M_LOCATES, 1);
+		lsa_metrics_time(LSA_METRICS_DOMAIN, dname, LSA_H_LOCATE,
+		    gethrtime() - start);
+		if (dc_locate_trace) {
+			(void) memset(&st, 0, sizeof (st));
+			st.dls_prefix = prefix;
+			st.dls_dname = dname;
+			st.dls_time[DCL_PHASE_START] = start;
+			st.dls_status = rc;
+			if (rc == 0)
+				(void) strlcpy(st.dls_dcname,
+				    dci->DomainControllerName + 2,
+				    sizeof (st.dls_dcname));
+			st.dls_dcaddr = addr;
+			dc_locate_trace(&st);
+		}
+		errno = err;
+		return (rc);
+	}
+
+	if ((flags & DCL_F_CACHE) != 0)
+		flags |= DCL_F_LOOKEDUP;
+	if ((res = dc_locate_ex(prefix, dname, site, flags, deadline)) == NULL)
+		return (-1);
+	rc = copydci(dci, res, buf, len);
+	freedci(res);
+	return (rc);
+}
+
+/*
+ * Locate every DC of a domain that answers, ranked as described for
+ * dc_locate_reply_t; see dc_locate_ex() for the other arguments.  cb, if
+ * not NULL, is called with each reply as it arrives, so the caller can
+ * start on the first one while the rest come in.  If the deadline passes
+ * first, the replies collected by then are returned.  The DC cache, which
+ * knows one DC per query, never answers it, even with DCL_F_CACHE.
+ * Returns NULL with *np set to 0 and errno set as for dc_locate_ex() if
+ * no DC answered.
+ */
+dc_locate_reply_t *
+dc_locate_all(const char *prefix, const char *dname, const char *site,
+    uint32_t flags, hrtime_t deadline, dc_locate_cb_t cb, void *arg, int *np)
+{
+	dc_locate_handle_t *dh;
+	dc_locate_reply_t *all;
+	int err;
+
+	*np = 0;
+	if ((dh = dc_locate_start(prefix, dname, site, flags | DCL_F_ALL,
+	    deadline)) == NULL)
+		return (NULL);
+
+	dc_locate_callback(dh, cb, arg);
+	dcl_run(dh);
+	err = dcl_errno(dh);
+	all = dc_locate_results(dh, np);
+	dc_locate_cancel(dh);
+	if (*np == 0)
+		errno = err;
+	return (all);
+}
+
+DOMAIN_CONTROLLER_INFO *
+dc_locate_site(const char *prefix, const char *dname, const char *site)
+{
+	return (dc_locate_ex(prefix, dname, site, 0, 0));
+}
+
+/*
+ * Locate a DC for the domain with the given DomainGuid in a forest, via
+ * _ldap._tcp.<DomainGuid>.domains._msdcs.<DnsForestName>, giving up at the
+ * deadline as dc_locate_ex() does.
+ */
+DOMAIN_CONTROLLER_INFO *
+dc_locate_guid(const char *prefix, const char *forest, const uint8_t *guid,
+    hrtime_t deadline)
+{
+	lsa_wire_locate(prefix, NULL, NULL, forest, guid, 0);
+	return (dcl_wait(dcl_open(prefix, NULL, NULL, forest, guid, 0,
+	    deadline)));
+}
+
+DOMAIN_CONTROLLER_INFO *
+dc_locate(const char *prefix, const char *dname)
+{
+	return (dc_locate_ex(prefix, dname, NULL, 0, 0));
+}
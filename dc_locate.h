@@ -1,7 +1,166 @@
 #ifndef _DC_LOC_H
 #define _DC_LOC_H
 
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include "lsa_cldap.h"
+
+/*
+ * Phases of a locate, in the order they complete.
+ */
+typedef enum dc_locate_phase {
+	DCL_PHASE_START = 0,	/* dc_locate() entered */
+	DCL_PHASE_DNS,		/* first SRV answer received */
+	DCL_PHASE_SRV_PARSE,	/* SRV answer parsed into candidates */
+	DCL_PHASE_ADDR,		/* candidates without glue resolved */
+	DCL_PHASE_SOCKET,	/* ping socket bound and PDU encoded */
+	DCL_PHASE_PING,		/* first reply received */
+	DCL_PHASE_PARSE,	/* NetLogon reply decoded */
+	DCL_PHASE_MAX
+} dc_locate_phase_t;
+
+/*
+ * Per-call trace of a locate.  dls_time[] holds the gethrtime() value at
+ * the end of each phase, or 0 if the locate never got that far.
+ */
+typedef struct dc_locate_stats {
+	const char		*dls_prefix;
+	const char		*dls_dname;
+	hrtime_t		dls_time[DCL_PHASE_MAX];
+	int			dls_candidates;	/* SRV targets found */
+	int			dls_pinged;	/* pings sent */
+	int			dls_timeouts;	/* pings with no reply */
+	int			dls_status;	/* 0 if a DC answered */
+	char			dls_dcname[MAXHOSTNAMELEN]; /* SRV target */
+	struct sockaddr_in6	dls_dcaddr;
+} dc_locate_stats_t;
+
+/*
+ * Define this to be handed the trace of every dc_locate() call as it
+ * returns.  Nothing is reported if it is not defined.
+ */
+void dc_locate_trace(const dc_locate_stats_t *) __attribute__((weak));
+
+/*
+ * dc_locate_ex() flags.
+ */
+#define	DCL_F_GUID	0x0001	/* also query by a DomainGuid learned earlier */
+#define	DCL_F_SWEEP	0x0002	/* ping all candidates at once */
+#define	DCL_F_ALL	0x0004	/* collect every reply, see dc_locate_all() */
+#define	DCL_F_CACHE	0x0008	/* answer from, and fill, the DC cache */
+#define	DCL_F_SURVEY	0x0010	/* ping all, see dc_locate_survey() */
+
 DOMAIN_CONTROLLER_INFO * dc_locate(const char *, const char *);
 
+DOMAIN_CONTROLLER_INFO * dc_locate_site(const char *, const char *,
+    const char *);
+
+/*
+ * The locates below that take an hrtime_t give up at that gethrtime()
+ * value, or never if it is 0.  One that runs out of time before any DC
+ * answered fails with errno set to ETIMEDOUT; with DCL_F_ALL, the replies
+ * collected by then are returned.  One held off after recent failures of
+ * the same query fails at once with errno set to EAGAIN.
+ */
+DOMAIN_CONTROLLER_INFO * dc_locate_ex(const char *, const char *,
+    const char *, uint32_t, hrtime_t);
+
+DOMAIN_CONTROLLER_INFO * dc_locate_guid(const char *, const char *,
+    const uint8_t *, hrtime_t);
+
+int dc_locate_buf(const char *, const char *, const char *, uint32_t,
+    hrtime_t, DOMAIN_CONTROLLER_INFO *, char *, size_t);
+
+/*
+ * Non-blocking locate, for callers driving many of them from one event
+ * loop.  dc_locate_step() returns one of DCL_STEP_*; a handle needs at
+ * most DCL_MAXFDS descriptors.
+ */
+typedef struct dcl_handle dc_locate_handle_t;
+
+#define	DCL_STEP_AGAIN	0	/* still running */
+#define	DCL_STEP_DONE	1	/* a DC answered; see dc_locate_result() */
+#define	DCL_STEP_FAIL	(-1)	/* no DC answered */
+#define	DCL_STEP_TIMEOUT (-2)	/* no DC answered by the deadline */
+
+#define	DCL_MAXFDS	5
+
+dc_locate_handle_t * dc_locate_start(const char *, const char *,
+    const char *, uint32_t, hrtime_t);
+
+int dc_locate_pollfds(dc_locate_handle_t *, struct pollfd *, int, int *);
+
+int dc_locate_step(dc_locate_handle_t *, const struct pollfd *, int);
+
+DOMAIN_CONTROLLER_INFO * dc_locate_result(dc_locate_handle_t *);
+
+DOMAIN_CONTROLLER_INFO * dc_locate_wait(dc_locate_handle_t *);
+
+DOMAIN_CONTROLLER_INFO * dc_locate_next(dc_locate_handle_t *,
+    const DOMAIN_CONTROLLER_INFO *);
+
+int dc_locate_resume(dc_locate_handle_t *, const DOMAIN_CONTROLLER_INFO *);
+
+void dc_locate_cancel(dc_locate_handle_t *);
+
+/*
+ * One reply to a locate.  With DCL_F_ALL, a locate pings every candidate
+ * at once and collects each reply that arrives within the ping interval
+ * (100ms) of the last ping.  The collected replies are ranked: DCs that set
+ * DS_CLOSEST_FLAG first, then writable DCs, then by round trip.
+ *
+ * dlr_addr is the address the DC gave for itself, as in its
+ * DomainControllerAddress, or else the one its reply came from.
+ *
+ * The callback sees each reply as it arrives, before ranking.  The reply
+ * itself is only valid during the call, but dlr_dci stays valid until the
+ * results are freed.
+ */
+typedef struct dc_locate_reply {
+	DOMAIN_CONTROLLER_INFO	*dlr_dci;
+	struct sockaddr_in6	dlr_addr;
+	hrtime_t		dlr_rtt;	/* 0 if unknown */
+} dc_locate_reply_t;
+
+typedef void (*dc_locate_cb_t)(const dc_locate_reply_t *, void *);
+
+dc_locate_reply_t * dc_locate_all(const char *, const char *, const char *,
+    uint32_t, hrtime_t, dc_locate_cb_t, void *, int *);
+
+void dc_locate_freeall(dc_locate_reply_t *, int);
+
+void dc_locate_callback(dc_locate_handle_t *, dc_locate_cb_t, void *);
+
+dc_locate_reply_t * dc_locate_results(dc_locate_handle_t *, int *);
+
+/*
+ * One SRV target of a survey, with everything its DC said of itself.  A
+ * DCL_F_SURVEY locate is a DCL_F_ALL locate whose pings name no domain,
+ * so DCs of any domain in the forest answer, and which waits for replies
+ * until its deadline, or until every DC pinged has answered.
+ * dc_locate_survey() then lists every target of its SRV answers once, in
+ * their order, whether it answered or not, followed by any DC that
+ * answered from an address no target had.
+ */
+typedef struct dc_survey {
+	char			ds_name[MAXHOSTNAMELEN]; /* SRV target, or "" */
+	uint16_t		ds_priority;
+	uint16_t		ds_weight;
+	uint16_t		ds_port;
+	boolean_t		ds_pinged;	/* resolved and pinged */
+	struct sockaddr_in6	ds_addr;
+	hrtime_t		ds_rtt;		/* 0 if unknown */
+	DOMAIN_CONTROLLER_INFO	*ds_dci;	/* NULL if it did not answer */
+	lsa_cldap_ex_t		ds_ex;		/* valid if ds_dci is */
+} dc_survey_t;
+
+dc_survey_t * dc_locate_survey(dc_locate_handle_t *, int *);
+
+void dc_locate_freesurvey(dc_survey_t *, int);
+
+void dc_locate_forget(void);
+
 #endif /* _DC_LOC_H */
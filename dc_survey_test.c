@@ -0,0 +1,200 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Check that a DCL_F_SURVEY locate of many more DCs than the process's
+ * ping bucket holds, under the default rate limits, pings them all and
+ * finishes well within lsa_survey's default deadline, matching each
+ * reply to the DC pinged although the DC names another address for
+ * itself.  The DCs are listed in a static SRV map written at startup.
+ * Their replies come from a trace the test writes itself and replays:
+ * each ping is answered with the NetLogon reply in corpus/w2k8r2dc.cldap,
+ * one every TEST_SPACING.
+ *
+ *	./dc_survey_test [corpus]
+ *
+ * Exits non-zero if any check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/param.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dc_locate.h"
+#include "lsa_hosts.h"
+#include "lsa_rate.h"
+#include "lsa_wire.h"
+#include "test_check.h"
+
+#define	TEST_PREFIX	"_ldap._tcp.dc._msdcs"
+#define	TEST_DOMAIN	"w2k8.ma.nexenta.com"
+#define	TEST_CORPUS	"corpus"
+#define	TEST_REPLY	"w2k8r2dc.cldap"
+#define	TEST_NDCS	(6 * LSA_RATE_BURST)
+#define	TEST_SPACING	(500 * (NANOSEC / MICROSEC))
+#define	TEST_DEADLINE	(1000 * (NANOSEC / MILLISEC))
+#define	TEST_MSEC	((double)NANOSEC / MILLISEC)
+
+static int test_own;
+
+static void
+test_addr(int i, struct sockaddr_in6 *sin6)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	(void) snprintf(buf, sizeof (buf), "::ffff:10.20.%d.%d", i / 250,
+	    i % 250 + 1);
+	(void) memset(sin6, 0, sizeof (*sin6));
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_port = htons(LDAP_PORT);
+	(void) inet_pton(AF_INET6, buf, &sin6->sin6_addr);
+}
+
+/*
+ * Count the replies whose address is the one the DC gave for itself,
+ * not the one pinged.
+ */
+static void
+test_reply(const dc_locate_reply_t *dlr, void *arg)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (inet_ntop(AF_INET6, &dlr->dlr_addr.sin6_addr, buf,
+	    sizeof (buf)) != NULL &&
+	    strcmp(dlr->dlr_dci->DomainControllerAddress + 2, buf) == 0)
+		test_own++;
+}
+
+/*
+ * The SRV map: TEST_NDCS targets with glue.
+ */
+static int
+test_hosts(const char *path)
+{
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(path, "w")) == NULL)
+		return (-1);
+	for (i = 0; i < TEST_NDCS; i++) {
+		(void) fprintf(fp, "SRV %s.%s dc%03d.%s %d\n", TEST_PREFIX,
+		    TEST_DOMAIN, i, TEST_DOMAIN, LDAP_PORT);
+		(void) fprintf(fp, "A dc%03d.%s 10.20.%d.%d\n", i, TEST_DOMAIN,
+		    i / 250, i % 250 + 1);
+	}
+	return (fclose(fp));
+}
+
+/*
+ * The trace: a ping to every DC at once, and their replies spread out.
+ */
+static int
+test_trace(const char *path, const uchar_t *reply, size_t len)
+{
+	lsa_wire_rec_t rec;
+	FILE *fp;
+	int i, err = 0;
+
+	if ((fp = fopen(path, "w")) == NULL)
+		return (-1);
+	if (fwrite(LSA_WIRE_MAGIC, 1, LSA_WIRE_MAGICSZ, fp) !=
+	    LSA_WIRE_MAGICSZ)
+		err = -1;
+	(void) memset(&rec, 0, sizeof (rec));
+	rec.ltr_kind = LSA_WIRE_PING;
+	for (i = 0; i < TEST_NDCS && err == 0; i++) {
+		test_addr(i, &rec.ltr_peer);
+		if (fwrite(&rec, sizeof (rec), 1, fp) != 1)
+			err = -1;
+	}
+	rec.ltr_kind = LSA_WIRE_REPLY;
+	rec.ltr_len = len;
+	for (i = 0; i < TEST_NDCS && err == 0; i++) {
+		rec.ltr_time = (i + 1) * TEST_SPACING;
+		test_addr(i, &rec.ltr_peer);
+		if (fwrite(&rec, sizeof (rec), 1, fp) != 1 ||
+		    fwrite(reply, 1, len, fp) != len)
+			err = -1;
+	}
+	if (fclose(fp) != 0)
+		err = -1;
+	return (err);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *dir = (argc > 1) ? argv[1] : TEST_CORPUS;
+	char path[MAXPATHLEN], hosts[MAXPATHLEN], trace[MAXPATHLEN];
+	uchar_t reply[2048];
+	dc_locate_handle_t *dh;
+	dc_survey_t *all;
+	hrtime_t start, elapsed;
+	ssize_t len;
+	int fd, i, n, pinged = 0, answered = 0;
+
+	(void) snprintf(path, sizeof (path), "%s/%s", dir, TEST_REPLY);
+	if ((fd = open(path, O_RDONLY)) < 0 ||
+	    (len = read(fd, reply, sizeof (reply))) <= 0) {
+		fprintf(stderr, "dc_survey_test: can't read %s\n", path);
+		return (1);
+	}
+	(void) close(fd);
+
+	(void) snprintf(hosts, sizeof (hosts), "/tmp/dc_survey_test.%d.hosts",
+	    (int)getpid());
+	(void) snprintf(trace, sizeof (trace), "/tmp/dc_survey_test.%d.trace",
+	    (int)getpid());
+	if (test_hosts(hosts) != 0 || lsa_hosts_load(hosts) != 0 ||
+	    test_trace(trace, reply, len) != 0 ||
+	    lsa_wire_replay(trace, B_TRUE) != 0) {
+		fprintf(stderr, "dc_survey_test: can't set up the DCs\n");
+		(void) unlink(hosts);
+		(void) unlink(trace);
+		return (1);
+	}
+	(void) unlink(hosts);
+	(void) unlink(trace);
+
+	start = gethrtime();
+	dh = dc_locate_start(TEST_PREFIX, TEST_DOMAIN, NULL, DCL_F_SURVEY,
+	    start + TEST_DEADLINE);
+	test_check(dh != NULL, "survey started");
+	if (dh == NULL)
+		return (1);
+	dc_locate_callback(dh, test_reply, NULL);
+	(void) dc_locate_wait(dh);
+	elapsed = gethrtime() - start;
+	all = dc_locate_survey(dh, &n);
+	dc_locate_cancel(dh);
+	lsa_wire_stop();
+
+	for (i = 0; i < n; i++) {
+		if (all[i].ds_pinged)
+			pinged++;
+		if (all[i].ds_dci != NULL)
+			answered++;
+	}
+	printf("%d DCs, %d pinged, %d answered in %.1f ms\n", n, pinged,
+	    answered, elapsed / TEST_MSEC);
+	test_check(n == TEST_NDCS, "every DC listed");
+	test_check(pinged == TEST_NDCS, "every DC pinged");
+	test_check(answered == TEST_NDCS, "every DC answered");
+	test_check(test_own == TEST_NDCS, "replies carry the DCs' own addresses");
+	test_check(elapsed < TEST_DEADLINE, "finished before the deadline");
+	dc_locate_freesurvey(all, n);
+
+	return (test_done());
+}
@@ -0,0 +1,91 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Allocation counters.  The counts are process-wide and only ever grow;
+ * to see what one call allocated, take lsa_alloc_stats() before and after
+ * it on an otherwise idle process.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic.h>
+#include "lsa_alloc.h"
+
+static uint64_t lsa_alloc_count[LSA_ALLOC_MAX];
+static uint64_t lsa_alloc_bytes[LSA_ALLOC_MAX];
+
+static const char *lsa_alloc_names[LSA_ALLOC_MAX] = {
+	"dns",
+	"candidates",
+	"pdu",
+	"reply",
+	"result",
+	"cache",
+	"metrics"
+};
+
+void
+lsa_alloc_note(lsa_alloc_phase_t ph, size_t sz)
+{
+	atomic_inc_64(&lsa_alloc_count[ph]);
+	if (sz != 0)
+		atomic_add_64(&lsa_alloc_bytes[ph], sz);
+}
+
+void *
+lsa_malloc(lsa_alloc_phase_t ph, size_t sz)
+{
+	lsa_alloc_note(ph, sz);
+	return (malloc(sz));
+}
+
+void *
+lsa_calloc(lsa_alloc_phase_t ph, size_t n, size_t sz)
+{
+	lsa_alloc_note(ph, n * sz);
+	return (calloc(n, sz));
+}
+
+void *
+lsa_realloc(lsa_alloc_phase_t ph, void *p, size_t sz)
+{
+	lsa_alloc_note(ph, sz);
+	return (realloc(p, sz));
+}
+
+char *
+lsa_strdup(lsa_alloc_phase_t ph, const char *s)
+{
+	lsa_alloc_note(ph, strlen(s) + 1);
+	return (strdup(s));
+}
+
+void
+lsa_alloc_stats(lsa_alloc_stats_t *las)
+{
+	int i;
+
+	for (i = 0; i < LSA_ALLOC_MAX; i++) {
+		las->las_count[i] = lsa_alloc_count[i];
+		las->las_bytes[i] = lsa_alloc_bytes[i];
+	}
+}
+
+const char *
+lsa_alloc_name(lsa_alloc_phase_t ph)
+{
+	return ((ph < LSA_ALLOC_MAX) ? lsa_alloc_names[ph] : "?");
+}
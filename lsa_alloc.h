@@ -0,0 +1,56 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+#ifndef _LSA_ALLOC_H
+#define _LSA_ALLOC_H
+
+#include <sys/types.h>
+
+/*
+ * Heap allocations made by the locator, counted by the part of a lookup
+ * that made them.  A call into liblber or the resolver that allocates is
+ * counted once, at the call, with no size.
+ */
+typedef enum lsa_alloc_phase {
+	LSA_ALLOC_DNS = 0,	/* SRV queries, answers and their parsing */
+	LSA_ALLOC_CAND,		/* candidate list and target addresses */
+	LSA_ALLOC_PDU,		/* locate handle, ping socket ring and PDU */
+	LSA_ALLOC_REPLY,	/* NetLogon reply decoding */
+	LSA_ALLOC_RESULT,	/* DOMAIN_CONTROLLER_INFO handed back */
+	LSA_ALLOC_CACHE,	/* DC cache entries and strings */
+	LSA_ALLOC_METRICS,	/* a domain's or DC's first metrics */
+	LSA_ALLOC_MAX
+} lsa_alloc_phase_t;
+
+typedef struct lsa_alloc_stats {
+	uint64_t	las_count[LSA_ALLOC_MAX];
+	uint64_t	las_bytes[LSA_ALLOC_MAX];
+} lsa_alloc_stats_t;
+
+void *lsa_malloc(lsa_alloc_phase_t, size_t);
+
+void *lsa_calloc(lsa_alloc_phase_t, size_t, size_t);
+
+void *lsa_realloc(lsa_alloc_phase_t, void *, size_t);
+
+char *lsa_strdup(lsa_alloc_phase_t, const char *);
+
+void lsa_alloc_note(lsa_alloc_phase_t, size_t);
+
+void lsa_alloc_stats(lsa_alloc_stats_t *);
+
+const char *lsa_alloc_name(lsa_alloc_phase_t);
+
+#endif /* _LSA_ALLOC_H */
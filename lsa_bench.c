@@ -0,0 +1,384 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Microbenchmarks for the DNS and CLDAP parsing/encoding hot paths.
+ *
+ * Every benchmark parses or builds messages in memory and never touches
+ * a socket.  The corpus is each file in the corpus directory (-c, by
+ * default ./corpus), one message as it is sent on the wire: an SRV answer
+ * in a *.srv file, a NetLogon reply datagram in a *.cldap one.  The
+ * w2k8r2dc files there are those of the w2k8 DC in README.  Synthetic
+ * multi-DC SRV answers (with A glue) of increasing size are added to
+ * them.
+ *
+ * Output is one line per benchmark: name, corpus file, records, ns/op,
+ * allocs/op.  Allocations are counted by test_alloc.c.
+ *
+ *	./lsa_bench [-c corpus] [filter]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/param.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+#include <ldap.h>
+#include <lber.h>
+#include "lsa_cldap.h"
+#include "lsa_srv.h"
+#include "test_alloc.h"
+
+#define	BENCH_MINTIME	(200 * (NANOSEC / MILLISEC))
+#define	BENCH_DOMAIN	"w2k8.ma.nexenta.com"
+#define	BENCH_SVC	"_ldap._tcp.dc._msdcs"
+#define	BENCH_CORPUS	"corpus"
+#define	BENCH_REPLYSZ	2048
+
+/*
+ * The NtVer dc_locate() pings with, which the corpus replies answer.
+ */
+#define	BENCH_NTVER	(NETLOGON_NT_VERSION_5EX | \
+	NETLOGON_NT_VERSION_5EX_WITH_IP | NETLOGON_NT_VERSION_WITH_CLOSEST_SITE)
+
+static int bench_sizes[] = { 8, 64, 256 };
+#define	BENCH_NSIZES	(sizeof (bench_sizes) / sizeof (bench_sizes[0]))
+
+/*
+ * Corpus: SRV answers.
+ */
+typedef struct bench_dns {
+	uchar_t		bd_msg[NS_MAXMSG];
+	int		bd_len;
+	int		bd_count;
+} bench_dns_t;
+
+static int
+bench_dns_build(bench_dns_t *bd, int count)
+{
+	uchar_t		*dnptrs[2 + 2 * 256], **lastdnptr;
+	uchar_t		*cp = bd->bd_msg, *eom = bd->bd_msg + sizeof (bd->bd_msg);
+	uchar_t		*rdlen;
+	HEADER		*hp = (HEADER *)bd->bd_msg;
+	char		qname[NS_MAXDNAME], target[NS_MAXDNAME];
+	int		i, n;
+
+	if (count > 256)
+		return (-1);
+
+	(void) snprintf(qname, sizeof (qname), "%s.%s", BENCH_SVC,
+	    BENCH_DOMAIN);
+
+	memset(bd->bd_msg, 0, HFIXEDSZ);
+	hp->id = htons(0x1234);
+	hp->qr = 1;
+	hp->aa = 1;
+	hp->rd = 1;
+	hp->ra = 1;
+	hp->qdcount = htons(1);
+	hp->ancount = htons(count);
+	hp->arcount = htons(count);
+	cp += HFIXEDSZ;
+
+	dnptrs[0] = bd->bd_msg;
+	dnptrs[1] = NULL;
+	lastdnptr = dnptrs + sizeof (dnptrs) / sizeof (dnptrs[0]);
+
+	/*
+	 * Question.
+	 */
+	if ((n = dn_comp(qname, cp, eom - cp, dnptrs, lastdnptr)) < 0)
+		return (-1);
+	cp += n;
+	NS_PUT16(T_SRV, cp);
+	NS_PUT16(C_IN, cp);
+
+	/*
+	 * Answers: priorities and weights are spread so that sorting and
+	 * weighted selection both have work to do.
+	 */
+	for (i = 0; i < count; i++) {
+		(void) snprintf(target, sizeof (target), "dc%03d.%s", i,
+		    BENCH_DOMAIN);
+		if ((n = dn_comp(qname, cp, eom - cp, dnptrs, lastdnptr)) < 0)
+			return (-1);
+		cp += n;
+		NS_PUT16(T_SRV, cp);
+		NS_PUT16(C_IN, cp);
+		NS_PUT32(600, cp);
+		rdlen = cp;
+		cp += 2;
+		NS_PUT16(i % 4, cp);
+		NS_PUT16((i * 37) % 100, cp);
+		NS_PUT16(LDAP_PORT, cp);
+		if ((n = dn_comp(target, cp, eom - cp, dnptrs, lastdnptr)) < 0)
+			return (-1);
+		cp += n;
+		NS_PUT16(cp - rdlen - 2, rdlen);
+	}
+
+	/*
+	 * A glue for every target, so parsing never falls back to
+	 * getaddrinfo().
+	 */
+	for (i = 0; i < count; i++) {
+		(void) snprintf(target, sizeof (target), "dc%03d.%s", i,
+		    BENCH_DOMAIN);
+		if ((n = dn_comp(target, cp, eom - cp, dnptrs, lastdnptr)) < 0)
+			return (-1);
+		cp += n;
+		if (eom - cp < RRFIXEDSZ + NS_INADDRSZ)
+			return (-1);
+		NS_PUT16(T_A, cp);
+		NS_PUT16(C_IN, cp);
+		NS_PUT32(600, cp);
+		NS_PUT16(NS_INADDRSZ, cp);
+		*cp++ = 10;
+		*cp++ = 10;
+		*cp++ = (i >> 8) & 0xff;
+		*cp++ = (i & 0xff) + 1;
+	}
+
+	bd->bd_len = cp - bd->bd_msg;
+	bd->bd_count = count;
+	return (0);
+}
+
+/*
+ * Read a corpus file whole.  Returns its length, or -1.
+ */
+static int
+bench_load(const char *dir, const char *name, uchar_t *buf, size_t len)
+{
+	char path[MAXPATHLEN];
+	ssize_t n;
+	int fd;
+
+	(void) snprintf(path, sizeof (path), "%s/%s", dir, name);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (-1);
+	n = read(fd, buf, len);
+	(void) close(fd);
+	return ((n > 0 && (size_t)n < len) ? n : -1);
+}
+
+static boolean_t
+bench_suffix(const char *name, const char *suffix)
+{
+	size_t n = strlen(name), len = strlen(suffix);
+
+	return (n > len && strcmp(name + n - len, suffix) == 0);
+}
+
+/*
+ * Benchmark bodies.
+ */
+typedef struct bench_arg {
+	lsa_srv_ctx_t	*ba_ctx;
+	bench_dns_t	*ba_dns;
+	struct berval	ba_reply;
+	DOMAIN_CONTROLLER_INFO *ba_dci;
+} bench_arg_t;
+
+static void
+bench_srv_parse(bench_arg_t *ba)
+{
+	if (lsa_srv_parse(ba->ba_ctx, ba->ba_dns->bd_msg,
+	    ba->ba_dns->bd_len) != ba->ba_dns->bd_count)
+		abort();
+}
+
+static void
+bench_srv_next(bench_arg_t *ba)
+{
+	srv_rr_t *sr = NULL;
+	int n = 0;
+
+	while ((sr = lsa_srv_next(ba->ba_ctx, sr)) != NULL)
+		n++;
+	if (n != ba->ba_dns->bd_count)
+		abort();
+}
+
+static void
+bench_cldap_setup_pdu(bench_arg_t *ba)
+{
+	BerElement *pdu;
+
+	if ((pdu = ber_alloc()) == NULL)
+		abort();
+	if (lsa_cldap_setup_pdu(pdu, BENCH_DOMAIN, NULL, NULL,
+	    NETLOGON_NT_VERSION_5EX) < 0)
+		abort();
+	ber_free(pdu, 1);
+}
+
+static void
+bench_cldap_parse(bench_arg_t *ba)
+{
+	DOMAIN_CONTROLLER_INFO *dci = ba->ba_dci;
+	lsa_cldap_ex_t ex;
+	BerElement *ber;
+
+	if ((ber = ber_init(&ba->ba_reply)) == NULL)
+		abort();
+	ex.lce_ntver = BENCH_NTVER;
+	if (lsa_cldap_parse_ex(ber, dci, &ex) != 0)
+		abort();
+	ber_free(ber, 1);
+
+	free(dci->DomainName);
+	free(dci->DnsForestName);
+	free(dci->DcSiteName);
+	free(dci->ClientSiteName);
+	dci->DomainName = dci->DnsForestName = NULL;
+	dci->DcSiteName = dci->ClientSiteName = NULL;
+}
+
+static void
+bench_run(const char *filter, const char *name, const char *corpus,
+    int size, void (*func)(bench_arg_t *), bench_arg_t *ba)
+{
+	hrtime_t	start, elapsed;
+	uint64_t	allocs;
+	int		i, iters;
+
+	if (filter != NULL && strstr(name, filter) == NULL)
+		return;
+
+	/*
+	 * Warm up, then double the iteration count until one run takes
+	 * long enough to be measured reliably.
+	 */
+	func(ba);
+	for (iters = 1; ; iters *= 2) {
+		allocs = test_nallocs;
+		start = gethrtime();
+		for (i = 0; i < iters; i++)
+			func(ba);
+		elapsed = gethrtime() - start;
+		allocs = test_nallocs - allocs;
+		if (elapsed >= BENCH_MINTIME)
+			break;
+	}
+
+	(void) printf("%-20s %-16s %6d %12.1f ns/op %10.1f allocs/op\n",
+	    name, corpus, size, (double)elapsed / iters,
+	    (double)allocs / iters);
+}
+
+static void
+bench_srv(const char *filter, const char *corpus, bench_arg_t *ba)
+{
+	bench_run(filter, "lsa_srv_parse", corpus, ba->ba_dns->bd_count,
+	    bench_srv_parse, ba);
+	bench_srv_parse(ba);
+	bench_run(filter, "lsa_srv_next", corpus, ba->ba_dns->bd_count,
+	    bench_srv_next, ba);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*dir = BENCH_CORPUS, *filter, *name;
+	struct dirent	**ents;
+	bench_arg_t	ba;
+	bench_dns_t	*bd;
+	char		*reply;
+	int		c, i, n, nents;
+
+	while ((c = getopt(argc, argv, "c:")) != -1) {
+		switch (c) {
+		case 'c':
+			dir = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c corpus] [filter]\n",
+			    argv[0]);
+			return (1);
+		}
+	}
+	filter = (optind < argc) ? argv[optind] : NULL;
+
+	memset(&ba, 0, sizeof (ba));
+	if ((ba.ba_ctx = lsa_srv_init()) == NULL ||
+	    (bd = malloc(sizeof (*bd))) == NULL ||
+	    (reply = malloc(BENCH_REPLYSZ)) == NULL ||
+	    (ba.ba_dci = calloc(1, sizeof (*ba.ba_dci))) == NULL ||
+	    (ba.ba_dci->DomainControllerName =
+	    malloc(MAXHOSTNAMELEN + 3)) == NULL) {
+		fprintf(stderr, "lsa_bench: out of memory\n");
+		return (1);
+	}
+	ba.ba_dns = bd;
+	ba.ba_reply.bv_val = reply;
+
+	if ((nents = scandir(dir, &ents, NULL, alphasort)) < 0) {
+		fprintf(stderr, "lsa_bench: can't read corpus %s\n", dir);
+		return (1);
+	}
+	for (i = 0; i < nents; i++) {
+		name = ents[i]->d_name;
+		if (bench_suffix(name, ".srv")) {
+			if ((n = bench_load(dir, name, bd->bd_msg,
+			    sizeof (bd->bd_msg))) < 0 ||
+			    (bd->bd_count = lsa_srv_parse(ba.ba_ctx,
+			    bd->bd_msg, n)) <= 0) {
+				fprintf(stderr, "lsa_bench: %s: not an SRV "
+				    "answer\n", name);
+				continue;
+			}
+			bd->bd_len = n;
+			bench_srv(filter, name, &ba);
+		} else if (bench_suffix(name, ".cldap")) {
+			if ((n = bench_load(dir, name, (uchar_t *)reply,
+			    BENCH_REPLYSZ)) < 0) {
+				fprintf(stderr, "lsa_bench: %s: can't read\n",
+				    name);
+				continue;
+			}
+			ba.ba_reply.bv_len = n;
+			bench_run(filter, "lsa_cldap_parse", name, 1,
+			    bench_cldap_parse, &ba);
+		}
+	}
+
+	for (i = 0; i < BENCH_NSIZES; i++) {
+		if (bench_dns_build(bd, bench_sizes[i]) != 0) {
+			fprintf(stderr, "lsa_bench: corpus overflow\n");
+			return (1);
+		}
+		bench_srv(filter, "synthetic", &ba);
+	}
+	bench_run(filter, "lsa_cldap_setup_pdu", "-", 1,
+	    bench_cldap_setup_pdu, &ba);
+
+	for (i = 0; i < nents; i++)
+		free(ents[i]);
+	free(ents);
+	freedci(ba.ba_dci);
+	free(reply);
+	free(bd);
+	lsa_srv_fini(ba.ba_ctx);
+	return (0);
+}
@@ -18,8 +18,10 @@
 #include <stddef.h>
 #include <inttypes.h>
 #include <string.h>
+#include <errno.h>
 #include <netdb.h>
 #include "lsa_cldap.h"
+#include "lsa_alloc.h"
 
 extern int ldap_put_filter(BerElement *ber, char *);
 
@@ -37,6 +39,18 @@ lsa_cldap_escape_le64(char *buf, uint64_t val, int bytes)
 	return (p - buf);
 }
 
+static int
+lsa_cldap_escape_bytes(char *buf, const uint8_t *val, int bytes)
+{
+	char *p = buf;
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		p += sprintf(p, "\\%.2" PRIx8, val[i]);
+
+	return (p - buf);
+}
+
 /*
  * Construct CLDAPMessage PDU for NetLogon search request.
  *
@@ -68,14 +82,15 @@ lsa_cldap_escape_le64(char *buf, uint64_t val, int bytes)
  */
 int
 lsa_cldap_setup_pdu(BerElement *ber, const char *dname,
-    const char *host, uint32_t ntver)
+    const char *host, const uint8_t *guid, uint32_t ntver)
 {
-	int		ret = 0, len = 0, msgid;
+	int		ret = -1, len = 0, msgid;
 	char		*basedn = "";
 	int scope = LDAP_SCOPE_BASE, deref = LDAP_DEREF_NEVER,
 	    sizelimit = 0, timelimit = 0, attrsonly = 0;
 	char		filter[MAXHOSTNAMELEN]; 
 	char		ntver_esc[13];
+	char		guid_esc[16 * 3 + 1];
 
 	/*
 	 * XXX Crappy semi-unique msgid.
@@ -99,9 +114,14 @@ lsa_cldap_setup_pdu(BerElement *ber, const char *dname,
 	/*
 	 * Construct search filter in LDAP format.
 	 */
-	len += snprintf(filter, sizeof (filter), "(&(DnsDomain=%s)", dname);
-	if (len >= sizeof (filter))
-		goto fail;
+	len += snprintf(filter, sizeof (filter), "(&");
+
+	if (dname != NULL) {
+		len += snprintf(filter + len, sizeof (filter) - len,
+		    "(DnsDomain=%s)", dname);
+		if (len >= sizeof (filter))
+			goto fail;
+	}
 
 	if (host != NULL) {
 		len += snprintf(filter + len, sizeof (filter) - len,
@@ -109,6 +129,14 @@ lsa_cldap_setup_pdu(BerElement *ber, const char *dname,
 		if (len >= sizeof (filter))
 			goto fail;
 	}
+
+	if (guid != NULL) {
+		lsa_cldap_escape_bytes(guid_esc, guid, 16);
+		len += snprintf(filter + len, sizeof (filter) - len,
+		    "(DomainGuid=%s)", guid_esc);
+		if (len >= sizeof (filter))
+			goto fail;
+	}
 	
 	len += snprintf(filter + len, sizeof (filter) - len,
 	    "(NtVer=%s))", ntver_esc);
@@ -189,18 +217,51 @@ lsa_decode_name(uchar_t *base, uchar_t *cp, char *str)
 
 int
 lsa_cldap_parse(BerElement *ber, DOMAIN_CONTROLLER_INFO *dci)
-{ 
+{
+	return (lsa_cldap_parse_ex(ber, dci, NULL));
+}
+
+/*
+ * DcSockAddr is a SOCKADDR_IN with sin_family in little-endian order;
+ * keep it as a v4-mapped address.
+ */
+static void
+lsa_decode_sockaddr(const uchar_t *cp, int len, struct sockaddr_in6 *sa)
+{
+	uint32_t *a6 = (uint32_t *)&sa->sin6_addr;
+
+	if (len < 8 || (cp[0] | (cp[1] << 8)) != AF_INET)
+		return;
+
+	sa->sin6_family = AF_INET6;
+	a6[0] = a6[1] = 0;
+	a6[2] = htonl(0xffff);
+	(void) memcpy(&a6[3], cp + 4, 4);
+}
+
+int
+lsa_cldap_parse_ex(BerElement *ber, DOMAIN_CONTROLLER_INFO *dci,
+    lsa_cldap_ex_t *ex)
+{
 	uchar_t *base = NULL, *cp = NULL;
 	char val[512]; /* how big should val be? */
 	int l, i, msgid, rc = 0;
+	int sasize = 0;
 	uint16_t opcode;
 	uint8_t *gid = dci->DomainGuid;
+	uint32_t ntver = (ex != NULL) ? ex->lce_ntver : 0;
 	field_5ex_t f = OPCODE;
+
+	if (ex != NULL) {
+		(void) memset(ex, 0, sizeof (*ex));
+		ex->lce_ntver = ntver;
+	}
 	
 	/* 
 	 * Later, compare msgid's/some validation?
 	 */
 
+	lsa_alloc_note(LSA_ALLOC_REPLY, 0);
 	if (ber_scanf(ber, "{i{x{{x[la", &msgid, &l, &cp) == LBER_ERROR) {
 		rc = 1;
 		goto out;
@@ -212,6 +273,8 @@ lsa_cldap_parse(BerElement *ber, DOMAIN_CONTROLLER_INFO *dci)
 		case OPCODE:
 			opcode = *(uint16_t *)cp;
 			cp +=2;
+			if (ex != NULL)
+				ex->lce_opcode = opcode;
 		  /* If there really is an alignment issue, when can do this
 			opcode = *cp++;
 			opcode |= (*cp++ << 8);
@@ -235,14 +298,16 @@ lsa_cldap_parse(BerElement *ber, DOMAIN_CONTROLLER_INFO *dci)
 			break;
 		case FOREST_NAME:
 			cp += lsa_decode_name(base, cp, val);
-			if ((dci->DnsForestName = strdup(val)) == NULL) {
+			if ((dci->DnsForestName =
+			    lsa_strdup(LSA_ALLOC_RESULT, val)) == NULL) {
 				rc = 2;
 				goto out;
 			}
 			break;
 		case DNS_DOMAIN_NAME:
 			cp += lsa_decode_name(base, cp, val);
-			if ((dci->DomainName = strdup(val)) == NULL) {
+			if ((dci->DomainName =
+			    lsa_strdup(LSA_ALLOC_RESULT, val)) == NULL) {
 				rc = 2;
 				goto out;
 			}
@@ -256,47 +321,77 @@ lsa_cldap_parse(BerElement *ber, DOMAIN_CONTROLLER_INFO *dci)
 				goto out;
 			}
 			break;
+		/*
+		 * DCI doesn't use the NetBIOS names; the caller may.
+		 */
 		case NET_DOMAIN_NAME:
-			/* 
-			 * DCI doesn't seem to use this
-			 */
 			cp += lsa_decode_name(base, cp, val); 
+			if (ex != NULL)
+				(void) strlcpy(ex->lce_nbdomain, val,
+				    sizeof (ex->lce_nbdomain));
 			break;
 		case NET_COMP_NAME:
-			/* 
-			 * DCI doesn't seem to use this
-			 */
 			cp += lsa_decode_name(base, cp, val); 
+			if (ex != NULL)
+				(void) strlcpy(ex->lce_nbname, val,
+				    sizeof (ex->lce_nbname));
 			break;
 		case USER_NAME:
 			/* 
-			 * DCI doesn't seem to use this
+			 * Nor this
 			 */
 			cp += lsa_decode_name(base, cp, val);
 			break;
 		case DC_SITE_NAME:
 			cp += lsa_decode_name(base, cp, val);
-			if ((dci->DcSiteName = strdup(val)) == NULL) {
+			if ((dci->DcSiteName =
+			    lsa_strdup(LSA_ALLOC_RESULT, val)) == NULL) {
 				rc = 2;
 				goto out;
 			}
 			break;
 		case CLIENT_SITE_NAME:
 			cp += lsa_decode_name(base, cp, val);
-			if (((dci->ClientSiteName = strdup(val)) == NULL) && 
+			if (((dci->ClientSiteName =
+			    lsa_strdup(LSA_ALLOC_RESULT, val)) == NULL) &&
 			    (val[0] != '\0')) {
 				rc = 2;
 				goto out;
 			}
 			break;
 		/*
-		 * These are all possible, but we don't really care about them.
-		 * Sockaddr_size && sockaddr might be useful at some point
+		 * Only there if the ping asked for them.
 		 */
 		case SOCKADDR_SIZE:
+			if ((ntver & NETLOGON_NT_VERSION_5EX_WITH_IP) != 0)
+				sasize = *cp++;
+			break;
 		case SOCKADDR:
+			if (sasize == 0)
+				break;
+			if (cp + sasize > base + l) {
+				rc = 1;
+				goto out;
+			}
+			lsa_decode_sockaddr(cp, sasize, &ex->lce_addr);
+			cp += sasize;
+			break;
 		case NEXT_CLOSEST_SITE_NAME:
+			if ((ntver &
+			    NETLOGON_NT_VERSION_WITH_CLOSEST_SITE) == 0)
+				break;
+			cp += lsa_decode_name(base, cp, val);
+			(void) strlcpy(ex->lce_nextsite, val,
+			    sizeof (ex->lce_nextsite));
+			break;
 		case NTVER:
+			if (ex != NULL && cp + 4 <= base + l)
+				ex->lce_dcver = *(uint32_t *)cp;
+			cp += 4;
+			break;
+		/*
+		 * These are all possible, but we don't really care about them.
+		 */
 		case LM_NT_TOKEN:
 		case LM_20_TOKEN:
 			break;
@@ -314,6 +409,49 @@ lsa_cldap_parse(BerElement *ber, DOMAIN_CONTROLLER_INFO *dci)
 	return (rc);
 }
 
+static int
+lsa_dci_put(char **dst, const char *s, char **bufp, size_t *lenp)
+{
+	size_t n;
+
+	*dst = NULL;
+	if (s == NULL)
+		return (0);
+	if ((n = strlen(s) + 1) > *lenp)
+		return (-1);
+	*dst = memcpy(*bufp, s, n);
+	*bufp += n;
+	*lenp -= n;
+	return (0);
+}
+
+/*
+ * Copy src into dst, with the strings in buf rather than on the heap, so
+ * dst needs no freeing and lives as long as buf.  Returns -1 with errno
+ * set to ERANGE if buf is too small; DCI_BUFSZ is always enough for a
+ * locate result.
+ */
+int
+copydci(DOMAIN_CONTROLLER_INFO *dst, const DOMAIN_CONTROLLER_INFO *src,
+    char *buf, size_t len)
+{
+	*dst = *src;
+	if (lsa_dci_put(&dst->DomainControllerName, src->DomainControllerName,
+	    &buf, &len) != 0 ||
+	    lsa_dci_put(&dst->DomainControllerAddress,
+	    src->DomainControllerAddress, &buf, &len) != 0 ||
+	    lsa_dci_put(&dst->DomainName, src->DomainName, &buf, &len) != 0 ||
+	    lsa_dci_put(&dst->DnsForestName, src->DnsForestName,
+	    &buf, &len) != 0 ||
+	    lsa_dci_put(&dst->DcSiteName, src->DcSiteName, &buf, &len) != 0 ||
+	    lsa_dci_put(&dst->ClientSiteName, src->ClientSiteName,
+	    &buf, &len) != 0) {
+		errno = ERANGE;
+		return (-1);
+	}
+	return (0);
+}
+
 void
 freedci(DOMAIN_CONTROLLER_INFO *dci)
 {
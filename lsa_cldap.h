@@ -18,6 +18,8 @@
 
 #include <ldap.h>
 #include <sys/list.h>
+#include <netinet/in.h>
+#include <sys/param.h>
 
 typedef struct _DOMAIN_CONTROLLER_INFO {
 	char		*DomainControllerName;
@@ -87,9 +89,39 @@ typedef enum {
 } field_5ex_t;
 
 int lsa_cldap_setup_pdu(BerElement *, const char *, 
-    const char *, uint32_t);
+    const char *, const uint8_t *, uint32_t);
+
+/*
+ * Parts of a NETLOGON_SAM_LOGON_RESPONSE_EX that DOMAIN_CONTROLLER_INFO
+ * has no room for, some only present when the ping asked for them.
+ * lce_ntver is the NtVersion the ping was sent with; the rest is filled
+ * in by lsa_cldap_parse_ex().
+ */
+#define	LSA_NETBIOS_NAMELEN	16
+
+typedef struct lsa_cldap_ex {
+	uint32_t		lce_ntver;
+	uint16_t		lce_opcode;
+	uint32_t		lce_dcver;	/* the DC's NtVersion */
+	char			lce_nbdomain[LSA_NETBIOS_NAMELEN];
+	char			lce_nbname[LSA_NETBIOS_NAMELEN];
+	struct sockaddr_in6	lce_addr;	/* DcSockAddr, v4-mapped */
+	char			lce_nextsite[MAXHOSTNAMELEN]; /* or "" */
+} lsa_cldap_ex_t;
 
 int lsa_cldap_parse(BerElement *, DOMAIN_CONTROLLER_INFO *);
 
+int lsa_cldap_parse_ex(BerElement *, DOMAIN_CONTROLLER_INFO *,
+    lsa_cldap_ex_t *);
+
 void freedci(DOMAIN_CONTROLLER_INFO *);
+
+/*
+ * Room for the strings of any locate result: no name decoded from a
+ * NetLogon reply is longer than 511 bytes.
+ */
+#define	DCI_BUFSZ	4096
+
+int copydci(DOMAIN_CONTROLLER_INFO *, const DOMAIN_CONTROLLER_INFO *,
+    char *, size_t);
 #endif /* _LSA_CLDAP_H */
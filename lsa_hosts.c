@@ -0,0 +1,313 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Static SRV map.
+ *
+ * A map answer is built as the DNS message a server would have sent, so
+ * it goes through lsa_srv_parse() and the rest of the candidate pipeline
+ * unchanged: SRV records are sorted by priority and weight there, and
+ * targets with an A or AAAA line get their address as glue.  Targets
+ * without one are still resolved by lsa_srv_resolve().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include "lsa_hosts.h"
+
+#define	LSA_HOSTS_LINESZ	1024
+#define	LSA_HOSTS_TTL		600
+#define	LSA_HOSTS_NPTRS		64	/* names remembered for compression */
+
+typedef struct lsa_hosts_rr {
+	uint16_t	lhr_type;	/* T_SRV, T_A or T_AAAA */
+	uint16_t	lhr_priority;
+	uint16_t	lhr_weight;
+	uint16_t	lhr_port;
+	char		lhr_name[MAXHOSTNAMELEN];
+	char		lhr_target[MAXHOSTNAMELEN];	/* "" if no records */
+	uchar_t		lhr_addr[NS_IN6ADDRSZ];
+} lsa_hosts_rr_t;
+
+static pthread_rwlock_t lsa_hosts_lock = PTHREAD_RWLOCK_INITIALIZER;
+static lsa_hosts_rr_t *lsa_hosts_rr;
+static int lsa_hosts_nrr;
+
+/*
+ * Copy a name without its trailing dot.
+ */
+static int
+lsa_hosts_name(char *buf, const char *name)
+{
+	size_t len;
+
+	if ((len = strlcpy(buf, name, MAXHOSTNAMELEN)) >= MAXHOSTNAMELEN)
+		return (-1);
+	if (len > 1 && buf[len - 1] == '.')
+		buf[len - 1] = '\0';
+	return (0);
+}
+
+static int
+lsa_hosts_num(const char *s, uint16_t *val)
+{
+	unsigned long n;
+	char *end;
+
+	errno = 0;
+	n = strtoul(s, &end, 10);
+	if (errno != 0 || *end != '\0' || end == s || n > UINT16_MAX)
+		return (-1);
+	*val = (uint16_t)n;
+	return (0);
+}
+
+/*
+ * Parse one line into rr.  Returns 1 for a record, 0 for a line to skip,
+ * -1 if it is malformed.
+ */
+static int
+lsa_hosts_parse(char *line, lsa_hosts_rr_t *rr)
+{
+	char *f[6], *last;
+	int n;
+
+	for (n = 0; n < 6; n++)
+		if ((f[n] = strtok_r((n == 0) ? line : NULL, " \t\r\n",
+		    &last)) == NULL)
+			break;
+	if (n == 0 || f[0][0] == '#')
+		return (0);
+
+	(void) memset(rr, 0, sizeof (*rr));
+	if (strcasecmp(f[0], "SRV") == 0) {
+		rr->lhr_type = T_SRV;
+		if (n < 2 || n == 3 || lsa_hosts_name(rr->lhr_name, f[1]) != 0)
+			return (-1);
+		if (n == 2)
+			return (1);
+		if (lsa_hosts_name(rr->lhr_target, f[2]) != 0 ||
+		    lsa_hosts_num(f[3], &rr->lhr_port) != 0 ||
+		    (n > 4 && lsa_hosts_num(f[4], &rr->lhr_priority) != 0) ||
+		    (n > 5 && lsa_hosts_num(f[5], &rr->lhr_weight) != 0))
+			return (-1);
+		return (1);
+	}
+
+	if (strcasecmp(f[0], "A") == 0)
+		rr->lhr_type = T_A;
+	else if (strcasecmp(f[0], "AAAA") == 0)
+		rr->lhr_type = T_AAAA;
+	else
+		return (0);
+	if (n != 3 || lsa_hosts_name(rr->lhr_name, f[1]) != 0 ||
+	    inet_pton((rr->lhr_type == T_A) ? AF_INET : AF_INET6, f[2],
+	    rr->lhr_addr) != 1)
+		return (-1);
+	return (1);
+}
+
+/*
+ * Load the map at path, replacing any loaded before; a NULL path unloads
+ * it.  Returns -1, with errno set to EINVAL for a malformed line, if the
+ * file could not be loaded, in which case the old map stays.
+ */
+int
+lsa_hosts_load(const char *path)
+{
+	lsa_hosts_rr_t *rrs = NULL, *p, rr;
+	char line[LSA_HOSTS_LINESZ];
+	FILE *fp = NULL;
+	int n = 0, r;
+
+	if (path != NULL) {
+		if ((fp = fopen(path, "r")) == NULL)
+			return (-1);
+		while (fgets(line, sizeof (line), fp) != NULL) {
+			if ((r = lsa_hosts_parse(line, &rr)) == 0)
+				continue;
+			if (r < 0) {
+				errno = EINVAL;
+				goto fail;
+			}
+			if ((p = realloc(rrs, (n + 1) * sizeof (*p))) == NULL)
+				goto fail;
+			rrs = p;
+			rrs[n++] = rr;
+		}
+		if (ferror(fp))
+			goto fail;
+		(void) fclose(fp);
+	}
+
+	(void) pthread_rwlock_wrlock(&lsa_hosts_lock);
+	p = lsa_hosts_rr;
+	lsa_hosts_rr = rrs;
+	lsa_hosts_nrr = n;
+	(void) pthread_rwlock_unlock(&lsa_hosts_lock);
+	free(p);
+	return (0);
+fail:
+	(void) fclose(fp);
+	free(rrs);
+	return (-1);
+}
+
+boolean_t
+lsa_hosts_loaded(void)
+{
+	return (lsa_hosts_rr != NULL);
+}
+
+/*
+ * Has a target already had its glue added for an earlier SRV record?
+ */
+static boolean_t
+lsa_hosts_seen(int i, const char *qname, const char *target)
+{
+	const lsa_hosts_rr_t *rr;
+
+	while (--i >= 0) {
+		rr = &lsa_hosts_rr[i];
+		if (rr->lhr_type == T_SRV &&
+		    strcasecmp(rr->lhr_name, qname) == 0 &&
+		    strcasecmp(rr->lhr_target, target) == 0)
+			return (B_TRUE);
+	}
+	return (B_FALSE);
+}
+
+static uchar_t *
+lsa_hosts_put_rr(uchar_t *cp, uchar_t *eom, const char *name, uint16_t type,
+    uchar_t **dnptrs, uchar_t **lastdnptr)
+{
+	int n;
+
+	if ((n = dn_comp(name, cp, eom - cp, dnptrs, lastdnptr)) < 0 ||
+	    eom - cp - n < NS_RRFIXEDSZ)
+		return (NULL);
+	cp += n;
+	NS_PUT16(type, cp);
+	NS_PUT16(C_IN, cp);
+	NS_PUT32(LSA_HOSTS_TTL, cp);
+	return (cp);
+}
+
+/*
+ * Build the answer to an SRV query for qname into msg.  Returns its
+ * length, or -1 if the map does not list qname or the answer does not
+ * fit in len bytes.
+ */
+int
+lsa_hosts_answer(const char *qname, uchar_t *msg, int len)
+{
+	uchar_t *dnptrs[LSA_HOSTS_NPTRS], **lastdnptr;
+	uchar_t *cp = msg, *eom = msg + len, *rdlen;
+	HEADER *hp = (HEADER *)msg;
+	const lsa_hosts_rr_t *rr, *ar;
+	char name[MAXHOSTNAMELEN];
+	int i, j, n, an = 0, arcount = 0, found = 0;
+
+	if (lsa_hosts_rr == NULL || lsa_hosts_name(name, qname) != 0 ||
+	    len < HFIXEDSZ)
+		return (-1);
+
+	dnptrs[0] = msg;
+	dnptrs[1] = NULL;
+	lastdnptr = dnptrs + LSA_HOSTS_NPTRS;
+	(void) memset(msg, 0, HFIXEDSZ);
+	cp += HFIXEDSZ;
+	if ((n = dn_comp(name, cp, eom - cp, dnptrs, lastdnptr)) < 0 ||
+	    eom - cp - n < NS_QFIXEDSZ)
+		return (-1);
+	cp += n;
+	NS_PUT16(T_SRV, cp);
+	NS_PUT16(C_IN, cp);
+
+	(void) pthread_rwlock_rdlock(&lsa_hosts_lock);
+	for (i = 0; i < lsa_hosts_nrr && cp != NULL; i++) {
+		rr = &lsa_hosts_rr[i];
+		if (rr->lhr_type != T_SRV ||
+		    strcasecmp(rr->lhr_name, name) != 0)
+			continue;
+		found++;
+		if (rr->lhr_target[0] == '\0')
+			continue;
+		if ((cp = lsa_hosts_put_rr(cp, eom, name, T_SRV, dnptrs,
+		    lastdnptr)) == NULL || eom - cp < 8)
+			break;
+		rdlen = cp;
+		cp += NS_INT16SZ;
+		NS_PUT16(rr->lhr_priority, cp);
+		NS_PUT16(rr->lhr_weight, cp);
+		NS_PUT16(rr->lhr_port, cp);
+		if ((n = dn_comp(rr->lhr_target, cp, eom - cp, dnptrs,
+		    lastdnptr)) < 0) {
+			cp = NULL;
+			break;
+		}
+		cp += n;
+		NS_PUT16(cp - rdlen - NS_INT16SZ, rdlen);
+		an++;
+	}
+
+	for (i = 0; i < lsa_hosts_nrr && cp != NULL; i++) {
+		rr = &lsa_hosts_rr[i];
+		if (rr->lhr_type != T_SRV || rr->lhr_target[0] == '\0' ||
+		    strcasecmp(rr->lhr_name, name) != 0 ||
+		    lsa_hosts_seen(i, name, rr->lhr_target))
+			continue;
+		for (j = 0; j < lsa_hosts_nrr && cp != NULL; j++) {
+			ar = &lsa_hosts_rr[j];
+			if (ar->lhr_type == T_SRV ||
+			    strcasecmp(ar->lhr_name, rr->lhr_target) != 0)
+				continue;
+			n = (ar->lhr_type == T_A) ? NS_INADDRSZ : NS_IN6ADDRSZ;
+			if ((cp = lsa_hosts_put_rr(cp, eom, ar->lhr_name,
+			    ar->lhr_type, dnptrs, lastdnptr)) == NULL ||
+			    eom - cp < NS_INT16SZ + n) {
+				cp = NULL;
+				break;
+			}
+			NS_PUT16(n, cp);
+			(void) memcpy(cp, ar->lhr_addr, n);
+			cp += n;
+			arcount++;
+		}
+	}
+	(void) pthread_rwlock_unlock(&lsa_hosts_lock);
+
+	if (found == 0 || cp == NULL)
+		return (-1);
+
+	hp->qr = 1;
+	hp->aa = 1;
+	hp->rd = 1;
+	hp->ra = 1;
+	hp->rcode = (an == 0) ? NXDOMAIN : NOERROR;
+	hp->qdcount = htons(1);
+	hp->ancount = htons(an);
+	hp->arcount = htons(arcount);
+	return (cp - msg);
+}
@@ -0,0 +1,39 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+#ifndef _LSA_HOSTS_H
+#define _LSA_HOSTS_H
+
+#include <sys/types.h>
+
+/*
+ * Static SRV map, in the format of Samba's dns_hosts_file.  While one is
+ * loaded, SRV queries for the names it lists are answered from it, with
+ * its addresses as glue, instead of being sent to DNS.  Lines are:
+ *
+ *	SRV name target port [priority [weight]]
+ *	SRV name			(the name has no records)
+ *	A name IPv4-address
+ *	AAAA name IPv6-address
+ *
+ * Other record types, blank lines and lines starting with # are ignored.
+ */
+int lsa_hosts_load(const char *);
+
+boolean_t lsa_hosts_loaded(void);
+
+int lsa_hosts_answer(const char *, uchar_t *, int);
+
+#endif /* _LSA_HOSTS_H */
@@ -0,0 +1,308 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Kerberos locate plugin backed by the DC locator.
+ *
+ * libkrb5 asks its locate plugins for a realm's KDCs before making SRV
+ * queries of its own.  This one takes the realm to be an AD domain and
+ * answers with the DCs that replied to a locate of
+ * _kerberos._tcp.dc._msdcs, ranked as dc_locate_all() ranks them: DCs in
+ * the client's site first, then writable ones, then the fastest.  DCs
+ * that did not reply are left out.  The DC the locator's cache holds for
+ * the realm, if there is one, goes first, since a locate has found it
+ * working since.
+ *
+ * The list for a realm is kept for DC_CACHE_TTL, so most ticket requests
+ * cost no DNS query or ping.  One thread at a time refreshes an expired
+ * list, for at most KRB_DEADLINE; the others go on with the old one, or
+ * wait for the refresh if there is none yet.  The client's site named by
+ * the replies is remembered too, and later locates for the realm query
+ * its site's records first.  Realms no DC answers for are left to
+ * libkrb5 for KRB_NEG_TTL, and so are lookups for an address family none
+ * of the realm's KDCs has.
+ *
+ * Install the module as <plugin dir>/libkrb5/lsa_krb5.so.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/param.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <krb5.h>
+#include <krb5/locate_plugin.h>
+#include "dc_locate.h"
+#include "dc_cache.h"
+#include "lsa_rate.h"
+
+#define	KRB_PREFIX		"_kerberos._tcp.dc._msdcs"
+#define	KRB_PORT		88
+#define	KRB_KPASSWD_PORT	464
+#define	KRB_MAXKDC		16
+#define	KRB_NEG_TTL		60	/* seconds */
+#define	KRB_DEADLINE		3	/* seconds, for one refresh */
+
+/*
+ * What is known of one realm.  kr_nkdc is 0 if no DC answered, and
+ * kr_expiry is 0 until a refresh has finished.
+ */
+typedef struct krb_realm {
+	struct krb_realm	*kr_next;
+	char			kr_dname[MAXHOSTNAMELEN];
+	char			kr_site[NS_MAXLABEL + 1];
+	hrtime_t		kr_expiry;
+	boolean_t		kr_refreshing;
+	int			kr_nkdc;
+	struct sockaddr_in6	kr_kdc[KRB_MAXKDC];
+} krb_realm_t;
+
+static pthread_mutex_t krb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t krb_cv = PTHREAD_COND_INITIALIZER;
+static krb_realm_t *krb_realms;
+
+/*
+ * Find a realm's record, making one if needed.  Called with krb_lock
+ * held.
+ */
+static krb_realm_t *
+krb_realm(const char *dname)
+{
+	krb_realm_t *kr;
+
+	for (kr = krb_realms; kr != NULL; kr = kr->kr_next)
+		if (strcmp(kr->kr_dname, dname) == 0)
+			return (kr);
+
+	if ((kr = calloc(1, sizeof (*kr))) == NULL)
+		return (NULL);
+	(void) strlcpy(kr->kr_dname, dname, sizeof (kr->kr_dname));
+	kr->kr_next = krb_realms;
+	krb_realms = kr;
+	return (kr);
+}
+
+/*
+ * Locate every DC of dname that answers, in site if one is known, and
+ * make the result the realm's list.  The best DC is entered in the cache
+ * under the client's site the replies name, which is the site the list is
+ * then kept for and looked up in.  Called with kr_refreshing set, which
+ * it clears.
+ */
+static void
+krb_refresh(const char *dname, const char *site)
+{
+	dc_locate_reply_t *all;
+	const char *csite = site;
+	krb_realm_t *kr;
+	int i, n;
+
+	all = dc_locate_all(KRB_PREFIX, dname, (*site != '\0') ? site : NULL,
+	    DCL_F_GUID, gethrtime() + (hrtime_t)KRB_DEADLINE * NANOSEC, NULL,
+	    NULL, &n);
+	if (n > 0) {
+		if (all[0].dlr_dci->ClientSiteName != NULL)
+			csite = all[0].dlr_dci->ClientSiteName;
+		dc_cache_rele(dc_cache_enter(KRB_PREFIX, dname,
+		    (*csite != '\0') ? csite : NULL, all[0].dlr_dci,
+		    &all[0].dlr_addr));
+	}
+
+	(void) pthread_mutex_lock(&krb_lock);
+	if ((kr = krb_realm(dname)) != NULL) {
+		kr->kr_nkdc = MIN(n, KRB_MAXKDC);
+		for (i = 0; i < kr->kr_nkdc; i++)
+			kr->kr_kdc[i] = all[i].dlr_addr;
+		(void) strlcpy(kr->kr_site, csite, sizeof (kr->kr_site));
+		kr->kr_expiry = gethrtime() + lsa_rate_jitter((hrtime_t)
+		    ((n > 0) ? DC_CACHE_TTL : KRB_NEG_TTL) * NANOSEC,
+		    DC_CACHE_JITTER);
+		kr->kr_refreshing = B_FALSE;
+	}
+	(void) pthread_cond_broadcast(&krb_cv);
+	(void) pthread_mutex_unlock(&krb_lock);
+
+	dc_locate_freeall(all, n);
+}
+
+/*
+ * Copy out a realm's KDCs, locating them first if the list is missing or
+ * has expired and no other thread is doing so, with the DC the cache
+ * holds moved or added to the front.  Returns how many there are.
+ */
+static int
+krb_kdcs(const char *dname, struct sockaddr_in6 *kdc)
+{
+	char site[NS_MAXLABEL + 1];
+	dc_cache_ent_t *ent;
+	krb_realm_t *kr;
+	int i, n;
+
+	(void) pthread_mutex_lock(&krb_lock);
+	if ((kr = krb_realm(dname)) == NULL) {
+		(void) pthread_mutex_unlock(&krb_lock);
+		return (0);
+	}
+	if (gethrtime() >= kr->kr_expiry && !kr->kr_refreshing) {
+		kr->kr_refreshing = B_TRUE;
+		(void) strlcpy(site, kr->kr_site, sizeof (site));
+		(void) pthread_mutex_unlock(&krb_lock);
+		krb_refresh(dname, site);
+		(void) pthread_mutex_lock(&krb_lock);
+	}
+	while (kr->kr_expiry == 0 && kr->kr_refreshing)
+		(void) pthread_cond_wait(&krb_cv, &krb_lock);
+	(void) strlcpy(site, kr->kr_site, sizeof (site));
+	n = kr->kr_nkdc;
+	(void) memcpy(kdc, kr->kr_kdc, n * sizeof (*kdc));
+	(void) pthread_mutex_unlock(&krb_lock);
+
+	if (n == 0)
+		return (0);
+
+	ent = dc_cache_lookup(KRB_PREFIX, dname,
+	    (site[0] != '\0') ? site : NULL);
+	if (ent == NULL)
+		return (n);
+	for (i = 0; i < n; i++)
+		if (IN6_ARE_ADDR_EQUAL(&kdc[i].sin6_addr,
+		    &ent->dce_addr.sin6_addr))
+			break;
+	if (i == n && n == KRB_MAXKDC)
+		i--;
+	else if (i == n)
+		n++;
+	(void) memmove(&kdc[1], &kdc[0], i * sizeof (*kdc));
+	kdc[0] = ent->dce_addr;
+	dc_cache_rele(ent);
+	return (n);
+}
+
+/*
+ * Hand one KDC to libkrb5, as IPv4 if its address is IPv4-mapped, for
+ * each socket type asked for, unless it is not of the family asked for.
+ * Counts what the callback took in *np.  Returns the callback's nonzero
+ * result if it wants no more.
+ */
+static int
+krb_emit(const struct sockaddr_in6 *kdc, in_port_t port, int socktype,
+    int family, int (*cbfunc)(void *, int, struct sockaddr *), void *cbdata,
+    int *np)
+{
+	struct sockaddr_in6 sin6;
+	struct sockaddr_in sin;
+	struct sockaddr *sa;
+	int r;
+
+	if (IN6_IS_ADDR_V4MAPPED(&kdc->sin6_addr)) {
+		if (family == AF_INET6)
+			return (0);
+		(void) memset(&sin, 0, sizeof (sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		IN6_V4MAPPED_TO_INADDR(&kdc->sin6_addr, &sin.sin_addr);
+		sa = (struct sockaddr *)&sin;
+	} else {
+		if (family == AF_INET)
+			return (0);
+		sin6 = *kdc;
+		sin6.sin6_port = htons(port);
+		sa = (struct sockaddr *)&sin6;
+	}
+
+	if (socktype != SOCK_STREAM) {
+		if ((r = cbfunc(cbdata, SOCK_DGRAM, sa)) != 0)
+			return (r);
+		(*np)++;
+	}
+	if (socktype != SOCK_DGRAM) {
+		if ((r = cbfunc(cbdata, SOCK_STREAM, sa)) != 0)
+			return (r);
+		(*np)++;
+	}
+	return (0);
+}
+
+/* ARGSUSED */
+static krb5_error_code
+krb_init(krb5_context ctx, void **data)
+{
+	*data = NULL;
+	return (0);
+}
+
+/* ARGSUSED */
+static void
+krb_fini(void *data)
+{
+}
+
+/* ARGSUSED */
+static krb5_error_code
+krb_lookup(void *data, enum locate_service_type svc, const char *realm,
+    int socktype, int family, int (*cbfunc)(void *, int, struct sockaddr *),
+    void *cbdata)
+{
+	struct sockaddr_in6 kdc[KRB_MAXKDC];
+	char dname[MAXHOSTNAMELEN];
+	in_port_t port;
+	int i, n, r, emitted = 0;
+
+	switch (svc) {
+	case locate_service_kdc:
+		port = KRB_PORT;
+		break;
+	case locate_service_kpasswd:
+		port = KRB_KPASSWD_PORT;
+		break;
+	default:
+		return (KRB5_PLUGIN_NO_HANDLE);
+	}
+	if ((socktype != 0 && socktype != SOCK_DGRAM &&
+	    socktype != SOCK_STREAM) ||
+	    (family != AF_UNSPEC && family != AF_INET && family != AF_INET6))
+		return (KRB5_PLUGIN_NO_HANDLE);
+
+	/*
+	 * AD realms are their domain's DNS name in upper case.
+	 */
+	if (strlcpy(dname, realm, sizeof (dname)) >= sizeof (dname))
+		return (KRB5_PLUGIN_NO_HANDLE);
+	for (i = 0; dname[i] != '\0'; i++)
+		dname[i] = tolower((unsigned char)dname[i]);
+
+	/*
+	 * If none of the KDCs is of the family asked for, libkrb5 has to
+	 * look for itself.
+	 */
+	if ((n = krb_kdcs(dname, kdc)) == 0)
+		return (KRB5_PLUGIN_NO_HANDLE);
+	for (i = 0; i < n; i++)
+		if ((r = krb_emit(&kdc[i], port, socktype, family, cbfunc,
+		    cbdata, &emitted)) != 0)
+			return (r);
+	return ((emitted > 0) ? 0 : KRB5_PLUGIN_NO_HANDLE);
+}
+
+const krb5plugin_service_locate_ftable service_locator = {
+	0,			/* minor version */
+	krb_init,
+	krb_fini,
+	krb_lookup
+};
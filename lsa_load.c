@@ -0,0 +1,321 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Load generator for the locator.
+ *
+ * Each of -t threads runs locates back to back with dc_locate_buf(),
+ * cycling through every prefix (-p, repeatable) and domain given, for -d
+ * seconds or until -n locates have been made in all.  With -c the cache
+ * is used, as a daemon would; -s gives the client's site; -T gives each
+ * locate a deadline of that many milliseconds; -r sets the ping rate
+ * limits, for the process and for each DC, in pings per second with a
+ * tenth of a second's worth of burst, 0 for none; -h loads a static SRV
+ * map, which can point the locator at a stand-in DC on loopback.
+ *
+ * The report gives throughput, latency percentiles, the share of locates
+ * that failed, ran out of time, were failed at once after recent
+ * failures and that the cache answered, and the share of pings that
+ * timed out.  A locate counts as a cache hit if it found a DC without
+ * pinging one.
+ *
+ *	./lsa_load [-c] [-t threads] [-d seconds | -n count] [-s site]
+ *	    [-T msec] [-r pps,dcpps] [-h hosts] [-p prefix]... domain...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <atomic.h>
+#include <sys/param.h>
+#include "dc_locate.h"
+#include "lsa_hosts.h"
+#include "lsa_rate.h"
+
+#define	LOAD_MSEC	((double)NANOSEC / MILLISEC)
+#define	LOAD_PREFIX	"_ldap._tcp.dc._msdcs"
+#define	LOAD_MAXNAMES	64
+
+/*
+ * Latencies are kept in a histogram with LOAD_SUB buckets per power of
+ * two of nanoseconds, so a percentile is off by at most 1/LOAD_SUB.
+ */
+#define	LOAD_SUBBITS	5
+#define	LOAD_SUB	(1 << LOAD_SUBBITS)
+#define	LOAD_NBUCKETS	(64 * LOAD_SUB)
+
+typedef struct load_stream {
+	pthread_t	ls_tid;
+	int		ls_id;
+	uint64_t	ls_locates;
+	uint64_t	ls_failed;
+	uint64_t	ls_expired;	/* failed with ETIMEDOUT */
+	uint64_t	ls_backedoff;	/* failed with EAGAIN */
+	uint64_t	ls_hits;
+	uint64_t	ls_pinged;
+	uint64_t	ls_timeouts;
+	hrtime_t	ls_max;
+	uint64_t	ls_hist[LOAD_NBUCKETS];
+} load_stream_t;
+
+static const char *load_prefix[LOAD_MAXNAMES];
+static int load_nprefix;
+static char **load_domain;
+static int load_ndomain;
+static const char *load_site;
+static uint32_t load_flags;
+static hrtime_t load_budget;	/* per locate, with -T */
+static hrtime_t load_end;
+static uint64_t load_left;	/* locates still to make, with -n */
+static boolean_t load_counted;
+
+/*
+ * The stream the calling thread runs, for dc_locate_trace().
+ */
+static __thread load_stream_t *load_cur;
+
+void
+dc_locate_trace(const dc_locate_stats_t *st)
+{
+	load_stream_t *ls = load_cur;
+
+	if (ls == NULL)
+		return;
+	if (st->dls_status == 0 && st->dls_pinged == 0)
+		ls->ls_hits++;
+	ls->ls_pinged += st->dls_pinged;
+	ls->ls_timeouts += st->dls_timeouts;
+}
+
+static int
+load_bucket(hrtime_t ns)
+{
+	int shift;
+
+	if (ns < LOAD_SUB)
+		return ((ns < 0) ? 0 : (int)ns);
+	for (shift = 0; (ns >> shift) >= 2 * LOAD_SUB; shift++)
+		;
+	return (((shift + 1) << LOAD_SUBBITS) +
+	    (int)((ns >> shift) & (LOAD_SUB - 1)));
+}
+
+/*
+ * The least latency that falls in bucket b.
+ */
+static hrtime_t
+load_bucket_min(int b)
+{
+	if (b < LOAD_SUB)
+		return (b);
+	return ((hrtime_t)(LOAD_SUB + (b & (LOAD_SUB - 1))) <<
+	    ((b >> LOAD_SUBBITS) - 1));
+}
+
+static void *
+load_stream(void *arg)
+{
+	load_stream_t *ls = arg;
+	DOMAIN_CONTROLLER_INFO dci;
+	char buf[DCI_BUFSZ];
+	hrtime_t t, lat;
+	int i = ls->ls_id;
+	int p, d;
+
+	load_cur = ls;
+	for (;; i++) {
+		if (load_counted) {
+			if ((int64_t)atomic_add_64_nv(&load_left, -1) < 0)
+				break;
+		} else if (gethrtime() >= load_end) {
+			break;
+		}
+
+		p = i % load_nprefix;
+		d = (i / load_nprefix) % load_ndomain;
+		t = gethrtime();
+		if (dc_locate_buf(load_prefix[p], load_domain[d], load_site,
+		    load_flags, (load_budget != 0) ? t + load_budget : 0, &dci,
+		    buf, sizeof (buf)) != 0) {
+			ls->ls_failed++;
+			if (errno == ETIMEDOUT)
+				ls->ls_expired++;
+			else if (errno == EAGAIN)
+				ls->ls_backedoff++;
+		}
+		lat = gethrtime() - t;
+
+		ls->ls_locates++;
+		ls->ls_hist[load_bucket(lat)]++;
+		if (lat > ls->ls_max)
+			ls->ls_max = lat;
+	}
+	return (NULL);
+}
+
+static double
+load_pct(uint64_t n, uint64_t of)
+{
+	return ((of > 0) ? 100.0 * n / of : 0.0);
+}
+
+static void
+load_report(load_stream_t *streams, int nstreams, hrtime_t wall)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9 };
+	load_stream_t all;
+	uint64_t seen, want;
+	int b, i, s;
+
+	(void) memset(&all, 0, sizeof (all));
+	for (s = 0; s < nstreams; s++) {
+		all.ls_locates += streams[s].ls_locates;
+		all.ls_failed += streams[s].ls_failed;
+		all.ls_expired += streams[s].ls_expired;
+		all.ls_backedoff += streams[s].ls_backedoff;
+		all.ls_hits += streams[s].ls_hits;
+		all.ls_pinged += streams[s].ls_pinged;
+		all.ls_timeouts += streams[s].ls_timeouts;
+		if (streams[s].ls_max > all.ls_max)
+			all.ls_max = streams[s].ls_max;
+		for (b = 0; b < LOAD_NBUCKETS; b++)
+			all.ls_hist[b] += streams[s].ls_hist[b];
+	}
+
+	printf("%d threads, %.3f s, %" PRIu64 " locates, %.1f/s\n",
+	    nstreams, wall / LOAD_MSEC / MILLISEC, all.ls_locates,
+	    (wall > 0) ? all.ls_locates * (double)NANOSEC / wall : 0.0);
+	printf("failed %" PRIu64 " (%.2f%%, %" PRIu64 " past deadline, %"
+	    PRIu64 " backing off), cache hits %" PRIu64 " (%.2f%%), "
+	    "ping timeouts %" PRIu64 "/%" PRIu64 " (%.2f%%)\n",
+	    all.ls_failed, load_pct(all.ls_failed, all.ls_locates),
+	    all.ls_expired, all.ls_backedoff, all.ls_hits,
+	    load_pct(all.ls_hits, all.ls_locates),
+	    all.ls_timeouts, all.ls_pinged,
+	    load_pct(all.ls_timeouts, all.ls_pinged));
+
+	printf("latency");
+	for (i = 0, b = 0, seen = 0; i < sizeof (pcts) / sizeof (pcts[0]);
+	    i++) {
+		want = (uint64_t)(all.ls_locates * pcts[i] / 100.0 + 0.5);
+		if (want == 0)
+			want = 1;
+		while (b < LOAD_NBUCKETS - 1 && seen + all.ls_hist[b] < want)
+			seen += all.ls_hist[b++];
+		printf("  p%g %.3f ms", pcts[i], (all.ls_locates > 0) ?
+		    load_bucket_min(b) / LOAD_MSEC : 0.0);
+	}
+	printf("  max %.3f ms\n", all.ls_max / LOAD_MSEC);
+}
+
+static void
+load_usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-c] [-t threads] [-d seconds | -n count] "
+	    "[-s site]\n\t[-T msec] [-r pps,dcpps] [-h hosts] [-p prefix]... "
+	    "domain...\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	load_stream_t *streams;
+	double secs = 10;
+	hrtime_t start;
+	unsigned int rate, dcrate;
+	int c, s, nstreams = 1;
+
+	while ((c = getopt(argc, argv, "cd:h:n:p:r:s:T:t:")) != -1) {
+		switch (c) {
+		case 'c':
+			load_flags |= DCL_F_CACHE;
+			break;
+		case 'd':
+			secs = atof(optarg);
+			break;
+		case 'h':
+			if (lsa_hosts_load(optarg) != 0) {
+				perror(optarg);
+				return (1);
+			}
+			break;
+		case 'n':
+			load_left = strtoull(optarg, NULL, 10);
+			load_counted = B_TRUE;
+			break;
+		case 'p':
+			if (load_nprefix == LOAD_MAXNAMES) {
+				load_usage(argv[0]);
+				return (1);
+			}
+			load_prefix[load_nprefix++] = optarg;
+			break;
+		case 'r':
+			if (sscanf(optarg, "%u,%u", &rate, &dcrate) != 2) {
+				load_usage(argv[0]);
+				return (1);
+			}
+			lsa_rate_set(rate, rate / 10, dcrate, dcrate / 10);
+			break;
+		case 's':
+			load_site = optarg;
+			break;
+		case 'T':
+			load_budget = (hrtime_t)(atof(optarg) * LOAD_MSEC);
+			break;
+		case 't':
+			nstreams = atoi(optarg);
+			break;
+		default:
+			load_usage(argv[0]);
+			return (1);
+		}
+	}
+	if (optind == argc || nstreams < 1 || secs <= 0 || load_budget < 0) {
+		load_usage(argv[0]);
+		return (1);
+	}
+	if (load_nprefix == 0)
+		load_prefix[load_nprefix++] = LOAD_PREFIX;
+	load_domain = &argv[optind];
+	load_ndomain = argc - optind;
+
+	if ((streams = calloc(nstreams, sizeof (*streams))) == NULL) {
+		fprintf(stderr, "lsa_load: out of memory\n");
+		return (1);
+	}
+
+	start = gethrtime();
+	load_end = start + (hrtime_t)(secs * NANOSEC);
+	for (s = 0; s < nstreams; s++) {
+		streams[s].ls_id = s;
+		if (pthread_create(&streams[s].ls_tid, NULL, load_stream,
+		    &streams[s]) != 0) {
+			fprintf(stderr, "lsa_load: can't start thread %d\n", s);
+			nstreams = s;
+			break;
+		}
+	}
+	for (s = 0; s < nstreams; s++)
+		(void) pthread_join(streams[s].ls_tid, NULL);
+
+	load_report(streams, nstreams, gethrtime() - start);
+	free(streams);
+	return (0);
+}
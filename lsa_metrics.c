@@ -0,0 +1,508 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Aggregate locator metrics.
+ *
+ * Each scope has a fixed open-addressed table of per-name records.  A
+ * record is created the first time a name is seen and installed with a
+ * compare-and-swap, and never moves or goes away, so finding one needs no
+ * lock.  Names past the table's capacity share an overflow record, shown
+ * as "-".
+ *
+ * Counts are kept per thread: each thread has a stripe of its own for
+ * every record it has counted for, made the first time, so threads
+ * counting for the same domain write no cache line in common.  A thread's
+ * stripes outlive it and go to the next thread to start.  A dump adds up
+ * every thread's stripes.
+ *
+ * lsa_metrics_dump() writes everything in the Prometheus text format, so
+ * a collector can compute quantiles such as p99 locate time from the
+ * cumulative histogram buckets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <atomic.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "lsa_metrics.h"
+#include "lsa_alloc.h"
+
+#define	LSA_METRICS_SLOTS	1024	/* per scope, power of 2 */
+#define	LSA_METRICS_OVER	LSA_METRICS_SLOTS	/* overflow slot */
+
+typedef struct lsa_hist {
+	uint64_t	lh_count;
+	uint64_t	lh_sum;		/* microseconds */
+	uint64_t	lh_bucket[LSA_HIST_NBUCKETS];
+} lsa_hist_t;
+
+typedef struct lsa_metrics_stripe {
+	char		lms_pad0[64];	/* off whatever else is nearby */
+	uint64_t	lms_count[LSA_M_MAX];
+	lsa_hist_t	lms_hist[LSA_H_MAX];
+	char		lms_pad1[64];
+} lsa_metrics_stripe_t;
+
+typedef struct lsa_metrics_rec {
+	uint32_t		lmr_hash;
+	char			lmr_name[MAXHOSTNAMELEN];
+} lsa_metrics_rec_t;
+
+/*
+ * One per thread that has counted anything: its stripe of each record,
+ * by the record's slot, or NULL if it has counted nothing there.  Only
+ * the thread that has it writes to it.
+ */
+typedef struct lsa_metrics_thr {
+	struct lsa_metrics_thr	*lmt_next;
+	volatile uint32_t	lmt_inuse;
+	lsa_metrics_stripe_t	*lmt_stripe[LSA_METRICS_NSCOPES]
+	    [LSA_METRICS_SLOTS + 1];
+} lsa_metrics_thr_t;
+
+static lsa_metrics_rec_t *lsa_metrics_tab[LSA_METRICS_NSCOPES]
+	[LSA_METRICS_SLOTS];
+static lsa_metrics_rec_t lsa_metrics_over[LSA_METRICS_NSCOPES] = {
+	{ 0, "-" },
+	{ 0, "-" }
+};
+
+static lsa_metrics_thr_t *lsa_metrics_thrs;
+static pthread_key_t lsa_metrics_key;
+static pthread_once_t lsa_metrics_once = PTHREAD_ONCE_INIT;
+static __thread lsa_metrics_thr_t *lsa_metrics_self;
+
+static const char *lsa_metrics_label[LSA_METRICS_NSCOPES] = {
+	"domain", "dc"
+};
+
+/*
+ * What lsa_metrics_dump() writes, in order.
+ */
+static const struct lsa_metrics_desc {
+	const char		*lmd_name;
+	lsa_metrics_scope_t	lmd_scope;
+	boolean_t		lmd_hist;
+	int			lmd_which;	/* lsa_metric_t or _hist_t */
+	const char		*lmd_help;
+} lsa_metrics_desc[] = {
+	{ "lsa_locates_total", LSA_METRICS_DOMAIN, B_FALSE, LSA_M_LOCATES,
+	    "Locates finished" },
+	{ "lsa_locate_failures_total", LSA_METRICS_DOMAIN, B_FALSE,
+	    LSA_M_FAILURES, "Locates no DC answered" },
+	{ "lsa_locate_deadlines_total", LSA_METRICS_DOMAIN, B_FALSE,
+	    LSA_M_DEADLINES, "Locates cut short by their deadline" },
+	{ "lsa_locate_backoffs_total", LSA_METRICS_DOMAIN, B_FALSE,
+	    LSA_M_BACKOFFS, "Locates failed at once after recent failures" },
+	{ "lsa_cache_hits_total", LSA_METRICS_DOMAIN, B_FALSE,
+	    LSA_M_CACHE_HIT, "Locates answered from the DC cache" },
+	{ "lsa_cache_misses_total", LSA_METRICS_DOMAIN, B_FALSE,
+	    LSA_M_CACHE_MISS, "Cache lookups with nothing cached" },
+	{ "lsa_cache_refreshes_total", LSA_METRICS_DOMAIN, B_FALSE,
+	    LSA_M_CACHE_REFRESH, "Cache lookups whose answer had expired" },
+	{ "lsa_dns_errors_total", LSA_METRICS_DOMAIN, B_FALSE,
+	    LSA_M_DNS_ERRORS, "SRV queries that failed or did not parse" },
+	{ "lsa_domain_timeouts_total", LSA_METRICS_DOMAIN, B_FALSE,
+	    LSA_M_TIMEOUTS, "Pings with no reply, by domain" },
+	{ "lsa_locate_latency_us", LSA_METRICS_DOMAIN, B_TRUE,
+	    LSA_H_LOCATE, "Locate latency" },
+	{ "lsa_dns_latency_us", LSA_METRICS_DOMAIN, B_TRUE,
+	    LSA_H_DNS, "SRV query latency" },
+	{ "lsa_pings_total", LSA_METRICS_DC, B_FALSE, LSA_M_PINGS,
+	    "Pings sent" },
+	{ "lsa_pings_deferred_total", LSA_METRICS_DC, B_FALSE,
+	    LSA_M_DEFERRED, "Pings held back by a rate limit" },
+	{ "lsa_replies_total", LSA_METRICS_DC, B_FALSE, LSA_M_REPLIES,
+	    "Ping replies received" },
+	{ "lsa_dc_timeouts_total", LSA_METRICS_DC, B_FALSE, LSA_M_TIMEOUTS,
+	    "Pings with no reply, by DC" },
+	{ "lsa_parse_errors_total", LSA_METRICS_DC, B_FALSE,
+	    LSA_M_PARSE_ERRORS, "Ping replies that did not decode" },
+	{ "lsa_ping_rtt_us", LSA_METRICS_DC, B_TRUE, LSA_H_RTT,
+	    "Ping round trip" }
+};
+
+#define	LSA_METRICS_NDESC \
+	(sizeof (lsa_metrics_desc) / sizeof (lsa_metrics_desc[0]))
+
+static uint32_t
+lsa_metrics_hash(const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	while (*s != '\0') {
+		h ^= (uchar_t)tolower((uchar_t)*s++);
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+/*
+ * Find the slot of the record for name, creating the record if this is
+ * its first use.  Returns LSA_METRICS_OVER if the table is full.
+ */
+static int
+lsa_metrics_slot(lsa_metrics_scope_t scope, const char *name)
+{
+	lsa_metrics_rec_t **tab = lsa_metrics_tab[scope];
+	lsa_metrics_rec_t *lmr, *new = NULL;
+	uint32_t h, i, slot;
+
+	if (name == NULL)
+		return (LSA_METRICS_OVER);
+
+	h = lsa_metrics_hash(name);
+	for (i = 0; i < LSA_METRICS_SLOTS; i++) {
+		slot = (h + i) & (LSA_METRICS_SLOTS - 1);
+		if ((lmr = tab[slot]) == NULL) {
+			if (new == NULL) {
+				if ((new = lsa_calloc(LSA_ALLOC_METRICS, 1,
+				    sizeof (*new))) == NULL)
+					break;
+				new->lmr_hash = h;
+				(void) strlcpy(new->lmr_name, name,
+				    sizeof (new->lmr_name));
+				membar_producer();
+			}
+			lmr = atomic_cas_ptr(&tab[slot], NULL, new);
+			if (lmr == NULL)
+				return (slot);
+		}
+		membar_consumer();
+		if (lmr->lmr_hash == h &&
+		    strcasecmp(lmr->lmr_name, name) == 0) {
+			free(new);
+			return (slot);
+		}
+	}
+
+	free(new);
+	return (LSA_METRICS_OVER);
+}
+
+/*
+ * A thread's stripes are given back when the thread exits.
+ */
+static void
+lsa_metrics_thr_done(void *arg)
+{
+	lsa_metrics_thr_t *lmt = arg;
+
+	membar_exit();
+	lmt->lmt_inuse = 0;
+}
+
+static void
+lsa_metrics_thr_init(void)
+{
+	(void) pthread_key_create(&lsa_metrics_key, lsa_metrics_thr_done);
+}
+
+/*
+ * Give the calling thread its stripes, taking over those of an exited
+ * thread if there are any.  They are never freed.
+ */
+static lsa_metrics_thr_t *
+lsa_metrics_thr_get(void)
+{
+	lsa_metrics_thr_t *lmt, *next;
+
+	(void) pthread_once(&lsa_metrics_once, lsa_metrics_thr_init);
+	for (lmt = lsa_metrics_thrs; lmt != NULL; lmt = lmt->lmt_next)
+		if (lmt->lmt_inuse == 0 &&
+		    atomic_cas_32(&lmt->lmt_inuse, 0, 1) == 0)
+			break;
+
+	if (lmt == NULL) {
+		if ((lmt = lsa_calloc(LSA_ALLOC_METRICS, 1,
+		    sizeof (*lmt))) == NULL)
+			return (NULL);
+		lmt->lmt_inuse = 1;
+		do {
+			next = lsa_metrics_thrs;
+			lmt->lmt_next = next;
+			membar_producer();
+		} while (atomic_cas_ptr(&lsa_metrics_thrs, next, lmt) != next);
+	}
+
+	membar_enter();
+	(void) pthread_setspecific(lsa_metrics_key, lmt);
+	lsa_metrics_self = lmt;
+	return (lmt);
+}
+
+/*
+ * The calling thread's stripe of name's record, or NULL if there is no
+ * memory for it, in which case the count is lost.
+ */
+static lsa_metrics_stripe_t *
+lsa_metrics_stripe(lsa_metrics_scope_t scope, const char *name)
+{
+	lsa_metrics_thr_t *lmt = lsa_metrics_self;
+	lsa_metrics_stripe_t *lms;
+	int slot;
+
+	if (lmt == NULL && (lmt = lsa_metrics_thr_get()) == NULL)
+		return (NULL);
+	slot = lsa_metrics_slot(scope, name);
+	if ((lms = lmt->lmt_stripe[scope][slot]) == NULL) {
+		if ((lms = lsa_calloc(LSA_ALLOC_METRICS, 1,
+		    sizeof (*lms))) == NULL)
+			return (NULL);
+		membar_producer();
+		lmt->lmt_stripe[scope][slot] = lms;
+	}
+	return (lms);
+}
+
+/*
+ * The adds are atomic only so that a dump never reads a count half
+ * written; no other thread writes to the stripe.
+ */
+void
+lsa_metrics_count(lsa_metrics_scope_t scope, const char *name,
+    lsa_metric_t m, uint64_t n)
+{
+	lsa_metrics_stripe_t *lms;
+
+	if (n != 0 && (lms = lsa_metrics_stripe(scope, name)) != NULL)
+		atomic_add_64(&lms->lms_count[m], n);
+}
+
+/*
+ * Add one latency, in nanoseconds, to a histogram.
+ */
+void
+lsa_metrics_time(lsa_metrics_scope_t scope, const char *name,
+    lsa_metric_hist_t which, hrtime_t t)
+{
+	lsa_metrics_stripe_t *lms;
+	lsa_hist_t *lh;
+	uint64_t us = (t > 0) ? (uint64_t)t / (NANOSEC / MICROSEC) : 0;
+	int i = 0;
+
+	if ((lms = lsa_metrics_stripe(scope, name)) == NULL)
+		return;
+	lh = &lms->lms_hist[which];
+	while (i < LSA_HIST_NBUCKETS - 1 && (1ULL << i) < us)
+		i++;
+	atomic_inc_64(&lh->lh_bucket[i]);
+	atomic_add_64(&lh->lh_sum, us);
+	atomic_inc_64(&lh->lh_count);
+}
+
+/*
+ * Write a label value, escaped as the text format requires.
+ */
+static void
+lsa_metrics_label_put(FILE *fp, lsa_metrics_scope_t scope,
+    const char *name)
+{
+	(void) fprintf(fp, "{%s=\"", lsa_metrics_label[scope]);
+	for (; *name != '\0'; name++) {
+		if (*name == '"' || *name == '\\')
+			(void) putc('\\', fp);
+		(void) putc(*name, fp);
+	}
+	(void) putc('"', fp);
+}
+
+/*
+ * Add up every thread's stripe of one counter or histogram of a record.
+ * Returns the number of threads that have counted anything for it.
+ */
+static int
+lsa_metrics_sum(const struct lsa_metrics_desc *lmd, int slot,
+    lsa_hist_t *sum)
+{
+	const lsa_metrics_thr_t *lmt;
+	const lsa_metrics_stripe_t *lms;
+	int i, n = 0;
+
+	(void) memset(sum, 0, sizeof (*sum));
+	for (lmt = lsa_metrics_thrs; lmt != NULL; lmt = lmt->lmt_next) {
+		membar_consumer();
+		if ((lms = lmt->lmt_stripe[lmd->lmd_scope][slot]) == NULL)
+			continue;
+		membar_consumer();
+		n++;
+		if (!lmd->lmd_hist) {
+			sum->lh_count += lms->lms_count[lmd->lmd_which];
+			continue;
+		}
+		sum->lh_count += lms->lms_hist[lmd->lmd_which].lh_count;
+		sum->lh_sum += lms->lms_hist[lmd->lmd_which].lh_sum;
+		for (i = 0; i < LSA_HIST_NBUCKETS; i++)
+			sum->lh_bucket[i] +=
+			    lms->lms_hist[lmd->lmd_which].lh_bucket[i];
+	}
+	return (n);
+}
+
+static void
+lsa_metrics_put(FILE *fp, const struct lsa_metrics_desc *lmd, int slot,
+    const lsa_metrics_rec_t *lmr)
+{
+	lsa_hist_t sum, *lh = &sum;
+	uint64_t cum = 0;
+	int i;
+
+	(void) lsa_metrics_sum(lmd, slot, &sum);
+	if (!lmd->lmd_hist) {
+		(void) fprintf(fp, "%s", lmd->lmd_name);
+		lsa_metrics_label_put(fp, lmd->lmd_scope, lmr->lmr_name);
+		(void) fprintf(fp, "} %" PRIu64 "\n", sum.lh_count);
+		return;
+	}
+
+	for (i = 0; i < LSA_HIST_NBUCKETS; i++) {
+		cum += lh->lh_bucket[i];
+		(void) fprintf(fp, "%s_bucket", lmd->lmd_name);
+		lsa_metrics_label_put(fp, lmd->lmd_scope, lmr->lmr_name);
+		if (i < LSA_HIST_NBUCKETS - 1)
+			(void) fprintf(fp, ",le=\"%llu\"} %" PRIu64 "\n",
+			    1ULL << i, cum);
+		else
+			(void) fprintf(fp, ",le=\"+Inf\"} %" PRIu64 "\n",
+			    cum);
+	}
+	(void) fprintf(fp, "%s_sum", lmd->lmd_name);
+	lsa_metrics_label_put(fp, lmd->lmd_scope, lmr->lmr_name);
+	(void) fprintf(fp, "} %" PRIu64 "\n", lh->lh_sum);
+	(void) fprintf(fp, "%s_count", lmd->lmd_name);
+	lsa_metrics_label_put(fp, lmd->lmd_scope, lmr->lmr_name);
+	(void) fprintf(fp, "} %" PRIu64 "\n", lh->lh_count);
+}
+
+/*
+ * Write every metric of every domain and DC seen so far.  Counts taken
+ * while others are being recorded may be off by those in flight.
+ */
+int
+lsa_metrics_dump(FILE *fp)
+{
+	const struct lsa_metrics_desc *lmd;
+	const lsa_metrics_rec_t *lmr;
+	lsa_hist_t sum;
+	size_t d;
+	int i;
+
+	for (d = 0; d < LSA_METRICS_NDESC; d++) {
+		lmd = &lsa_metrics_desc[d];
+		(void) fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n",
+		    lmd->lmd_name, lmd->lmd_help, lmd->lmd_name,
+		    lmd->lmd_hist ? "histogram" : "counter");
+		for (i = 0; i < LSA_METRICS_SLOTS; i++) {
+			if ((lmr = lsa_metrics_tab[lmd->lmd_scope][i]) == NULL)
+				continue;
+			membar_consumer();
+			lsa_metrics_put(fp, lmd, i, lmr);
+		}
+		if (lsa_metrics_sum(lmd, LSA_METRICS_OVER, &sum) != 0)
+			lsa_metrics_put(fp, lmd, LSA_METRICS_OVER,
+			    &lsa_metrics_over[lmd->lmd_scope]);
+	}
+
+	return ((fflush(fp) == 0 && !ferror(fp)) ? 0 : -1);
+}
+
+/*
+ * How long to wait before accepting again when out of descriptors or
+ * memory, so as not to spin while the connection waits in the backlog.
+ */
+#define	LSA_METRICS_BACKOFF	100	/* ms */
+
+static void *
+lsa_metrics_accept(void *arg)
+{
+	int fd, lfd = (int)(intptr_t)arg;
+	FILE *fp;
+
+	for (;;) {
+		if ((fd = accept(lfd, NULL, NULL)) < 0) {
+			switch (errno) {
+			case EBADF:
+			case EINVAL:
+			case ENOTSOCK:
+				return (NULL);	/* the socket is gone */
+			case EINTR:
+			case ECONNABORTED:
+				break;
+			default:
+				(void) poll(NULL, 0, LSA_METRICS_BACKOFF);
+				break;
+			}
+			continue;
+		}
+		if ((fp = fdopen(fd, "w")) == NULL) {
+			(void) close(fd);
+			continue;
+		}
+		(void) lsa_metrics_dump(fp);
+		(void) fclose(fp);
+	}
+	/* NOTREACHED */
+	return (NULL);
+}
+
+/*
+ * Serve lsa_metrics_dump() on a UNIX stream socket at path, for a daemon
+ * to call once at startup: each connection gets one dump and is closed.
+ */
+int
+lsa_metrics_serve(const char *path)
+{
+	struct sockaddr_un sun;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int fd;
+
+	(void) memset(&sun, 0, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof (sun.sun_path)) >=
+	    sizeof (sun.sun_path))
+		return (-1);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return (-1);
+	(void) unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof (sun)) != 0 ||
+	    listen(fd, 8) != 0)
+		goto fail;
+
+	(void) pthread_attr_init(&attr);
+	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, lsa_metrics_accept,
+	    (void *)(intptr_t)fd) != 0) {
+		(void) pthread_attr_destroy(&attr);
+		goto fail;
+	}
+	(void) pthread_attr_destroy(&attr);
+	return (0);
+fail:
+	(void) close(fd);
+	return (-1);
+}
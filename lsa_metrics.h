@@ -0,0 +1,74 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+#ifndef _LSA_METRICS_H
+#define _LSA_METRICS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+/*
+ * Locator metrics, kept per domain and per DC for the life of the
+ * process.  Counters and histograms are updated with atomic adds and no
+ * lock, so recording costs a table probe and an increment or two.
+ */
+typedef enum lsa_metrics_scope {
+	LSA_METRICS_DOMAIN = 0,
+	LSA_METRICS_DC,
+	LSA_METRICS_NSCOPES
+} lsa_metrics_scope_t;
+
+typedef enum lsa_metric {
+	LSA_M_LOCATES = 0,	/* domain: locates finished */
+	LSA_M_FAILURES,		/* domain: locates no DC answered */
+	LSA_M_DEADLINES,	/* domain: locates cut short by their deadline */
+	LSA_M_BACKOFFS,		/* domain: failed at once, backing off */
+	LSA_M_CACHE_HIT,	/* domain */
+	LSA_M_CACHE_MISS,	/* domain: nothing cached */
+	LSA_M_CACHE_REFRESH,	/* domain: the cached answer had expired */
+	LSA_M_DNS_ERRORS,	/* domain: SRV query failed or unparsable */
+	LSA_M_TIMEOUTS,		/* domain and DC: pings with no reply */
+	LSA_M_PINGS,		/* DC */
+	LSA_M_DEFERRED,		/* DC: pings held back by a rate limit */
+	LSA_M_REPLIES,		/* DC */
+	LSA_M_PARSE_ERRORS,	/* DC: replies that did not decode */
+	LSA_M_MAX
+} lsa_metric_t;
+
+typedef enum lsa_metric_hist {
+	LSA_H_LOCATE = 0,	/* domain: dc_locate() latency */
+	LSA_H_DNS,		/* domain: SRV query latency */
+	LSA_H_RTT,		/* DC: ping round trip */
+	LSA_H_MAX
+} lsa_metric_hist_t;
+
+/*
+ * Latency histograms have log2 buckets in microseconds: bucket i counts
+ * values up to 2^i us, and the last counts everything above.
+ */
+#define	LSA_HIST_NBUCKETS	24
+
+void lsa_metrics_count(lsa_metrics_scope_t, const char *, lsa_metric_t,
+    uint64_t);
+
+void lsa_metrics_time(lsa_metrics_scope_t, const char *, lsa_metric_hist_t,
+    hrtime_t);
+
+int lsa_metrics_dump(FILE *);
+
+int lsa_metrics_serve(const char *);
+
+#endif /* _LSA_METRICS_H */
@@ -0,0 +1,157 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Ping rate limits.
+ *
+ * Each bucket is kept as the time it will be full again: taking a token
+ * moves that time on by one interval, and a token is there to take as
+ * long as the time is less than a burst's worth of intervals away.  An
+ * idle bucket costs nothing to keep.  The DC buckets live in a small
+ * open-addressed table; a DC that does not fit takes over the slot of a
+ * full bucket, which has nothing to lose, or else the one nearest to
+ * full.  Both kinds are changed under one lock, so a ping takes a token
+ * from each or from neither.
+ */
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include "lsa_rate.h"
+
+#define	LSA_RATE_NDCS		256	/* power of 2 */
+#define	LSA_RATE_PROBE		8
+
+typedef struct lsa_rate_dc {
+	struct in6_addr	lrd_addr;
+	hrtime_t	lrd_full;	/* when the bucket is full again */
+} lsa_rate_dc_t;
+
+typedef struct lsa_rate_limit {
+	uint32_t	lrl_rate;
+	uint32_t	lrl_burst;
+} lsa_rate_limit_t;
+
+static pthread_mutex_t lsa_rate_lock = PTHREAD_MUTEX_INITIALIZER;
+static lsa_rate_limit_t lsa_rate_proc = { LSA_RATE_PINGS, LSA_RATE_BURST };
+static lsa_rate_limit_t lsa_rate_dc = { LSA_RATE_DC_PINGS, LSA_RATE_DC_BURST };
+static hrtime_t lsa_rate_full;
+static lsa_rate_dc_t lsa_rate_dcs[LSA_RATE_NDCS];
+
+/*
+ * Set the limits: pings per second and burst for the process, then for
+ * each DC.  A rate of 0 lifts that limit; a burst of 0 is taken as 1.
+ */
+void
+lsa_rate_set(uint32_t rate, uint32_t burst, uint32_t dcrate, uint32_t dcburst)
+{
+	(void) pthread_mutex_lock(&lsa_rate_lock);
+	lsa_rate_proc.lrl_rate = rate;
+	lsa_rate_proc.lrl_burst = MAX(burst, 1);
+	lsa_rate_dc.lrl_rate = dcrate;
+	lsa_rate_dc.lrl_burst = MAX(dcburst, 1);
+	lsa_rate_full = 0;
+	(void) memset(lsa_rate_dcs, 0, sizeof (lsa_rate_dcs));
+	(void) pthread_mutex_unlock(&lsa_rate_lock);
+}
+
+/*
+ * When a token can next be taken from a bucket: now, or later.
+ */
+static hrtime_t
+lsa_rate_when(const lsa_rate_limit_t *lrl, hrtime_t full, hrtime_t now)
+{
+	hrtime_t interval;
+
+	if (lrl->lrl_rate == 0)
+		return (now);
+	interval = NANOSEC / lrl->lrl_rate;
+	return (MAX(now, full - (hrtime_t)(lrl->lrl_burst - 1) * interval));
+}
+
+static void
+lsa_rate_charge(const lsa_rate_limit_t *lrl, hrtime_t *full, hrtime_t now)
+{
+	if (lrl->lrl_rate != 0)
+		*full = MAX(*full, now) + NANOSEC / lrl->lrl_rate;
+}
+
+static lsa_rate_dc_t *
+lsa_rate_find(const struct in6_addr *addr, hrtime_t now)
+{
+	lsa_rate_dc_t *lrd, *victim = NULL;
+	uint32_t h = 0;
+	int i;
+
+	for (i = 0; i < sizeof (*addr); i++)
+		h = h * 31 + addr->s6_addr[i];
+
+	for (i = 0; i < LSA_RATE_PROBE; i++) {
+		lrd = &lsa_rate_dcs[(h + i) & (LSA_RATE_NDCS - 1)];
+		if (IN6_ARE_ADDR_EQUAL(&lrd->lrd_addr, addr))
+			return (lrd);
+		if (victim == NULL || lrd->lrd_full < victim->lrd_full)
+			victim = lrd;
+	}
+
+	victim->lrd_addr = *addr;
+	if (victim->lrd_full > now)
+		victim->lrd_full = now;
+	return (victim);
+}
+
+/*
+ * Take a token to ping the DC at addr, from its bucket and, if proc is
+ * set, the process's.  Returns 0 if the ping may go now, or else the
+ * gethrtime() value at which the buckets will have one, having taken
+ * none.
+ */
+hrtime_t
+lsa_rate_take(const struct in6_addr *addr, boolean_t proc, hrtime_t now)
+{
+	lsa_rate_dc_t *lrd = NULL;
+	hrtime_t when = now;
+
+	(void) pthread_mutex_lock(&lsa_rate_lock);
+	if (proc)
+		when = lsa_rate_when(&lsa_rate_proc, lsa_rate_full, now);
+	if (lsa_rate_dc.lrl_rate != 0) {
+		lrd = lsa_rate_find(addr, now);
+		when = MAX(when, lsa_rate_when(&lsa_rate_dc, lrd->lrd_full,
+		    now));
+	}
+	if (when <= now) {
+		if (proc)
+			lsa_rate_charge(&lsa_rate_proc, &lsa_rate_full, now);
+		if (lrd != NULL)
+			lsa_rate_charge(&lsa_rate_dc, &lrd->lrd_full, now);
+		when = 0;
+	}
+	(void) pthread_mutex_unlock(&lsa_rate_lock);
+
+	return (when);
+}
+
+hrtime_t
+lsa_rate_jitter(hrtime_t t, int pct)
+{
+	hrtime_t span = t / 100 * pct;
+
+	if (span <= 0)
+		return (t);
+	return (t - span + (hrtime_t)((double)random() / INT32_MAX * 2 * span));
+}
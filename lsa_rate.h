@@ -0,0 +1,47 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+#ifndef _LSA_RATE_H
+#define _LSA_RATE_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+/*
+ * Limits on the CLDAP pings a process sends: a token bucket for the
+ * process as a whole and one for each DC address.  A bucket holds up to
+ * its burst of pings and refills at its rate, in pings per second.  A
+ * rate of 0 means no limit.  The defaults leave an ordinary locate alone
+ * but keep a process whose locates are all failing at once from
+ * flooding the DCs that are left.
+ */
+#define	LSA_RATE_PINGS		200	/* per second, whole process */
+#define	LSA_RATE_BURST		50
+#define	LSA_RATE_DC_PINGS	20	/* per second, to any one DC */
+#define	LSA_RATE_DC_BURST	10
+
+void lsa_rate_set(uint32_t, uint32_t, uint32_t, uint32_t);
+
+hrtime_t lsa_rate_take(const struct in6_addr *, boolean_t, hrtime_t);
+
+/*
+ * A time spread at random over the given percentage either side of it,
+ * so timers that many hosts or threads set together do not fire
+ * together.
+ */
+hrtime_t lsa_rate_jitter(hrtime_t, int);
+
+#endif /* _LSA_RATE_H */
@@ -0,0 +1,250 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Replay a trace taken with lsa_wire_capture() through dc_locate() and
+ * lsa_srv_lookup(), on any host, offline.
+ *
+ * Every locate and lookup in the trace is started again in order, and its
+ * queries and pings are answered from the trace.  By default each call
+ * starts at its recorded offset and each answer takes its recorded delay;
+ * with -f, both happen as fast as possible.  Each pass starts with an
+ * empty DC cache and nothing learned from earlier replies, as the traced
+ * process did.  Output is one line per call, with its latency and the DC
+ * found, then a summary for each pass.
+ *
+ *	./lsa_replay [-f] [-n passes] trace
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include "dc_locate.h"
+#include "dc_cache.h"
+#include "lsa_srv.h"
+#include "lsa_rate.h"
+#include "lsa_wire.h"
+
+#define	REPLAY_MSEC	((double)NANOSEC / MILLISEC)
+
+typedef struct replay_call {
+	lsa_wire_rec_t	rc_rec;
+	const char	*rc_arg[4];	/* see lsa_wire_locate() */
+	const uint8_t	*rc_guid;
+	uchar_t		*rc_data;
+} replay_call_t;
+
+/*
+ * Pick the locates and lookups out of a trace.
+ */
+static int
+replay_load(const char *path, replay_call_t **callsp, int *np)
+{
+	replay_call_t *calls = NULL, *rc;
+	lsa_wire_rec_t rec;
+	uchar_t *buf;
+	FILE *fp;
+	size_t off;
+	int i, n = 0, r;
+
+	if ((fp = lsa_wire_open(path)) == NULL)
+		return (-1);
+	if ((buf = malloc(UINT16_MAX)) == NULL) {
+		(void) fclose(fp);
+		return (-1);
+	}
+
+	while ((r = lsa_wire_read(fp, &rec, buf, UINT16_MAX)) > 0) {
+		if (rec.ltr_kind != LSA_WIRE_LOCATE &&
+		    rec.ltr_kind != LSA_WIRE_LOOKUP)
+			continue;
+		if ((rc = realloc(calls, (n + 1) * sizeof (*rc))) == NULL) {
+			r = -1;
+			break;
+		}
+		calls = rc;
+		if ((calls[n].rc_data = malloc(rec.ltr_len + 1)) == NULL) {
+			r = -1;
+			break;
+		}
+		rc = &calls[n++];
+		rc->rc_rec = rec;
+		rc->rc_guid = NULL;
+		(void) memset(rc->rc_arg, 0, sizeof (rc->rc_arg));
+		(void) memcpy(rc->rc_data, buf, rec.ltr_len);
+		rc->rc_data[rec.ltr_len] = '\0';
+
+		for (i = 0, off = 0; i < 4 && off < rec.ltr_len; i++) {
+			rc->rc_arg[i] = (const char *)rc->rc_data + off;
+			off += strlen(rc->rc_arg[i]) + 1;
+		}
+		if (off + 16 <= rec.ltr_len)
+			rc->rc_guid = rc->rc_data + off;
+	}
+	free(buf);
+	(void) fclose(fp);
+
+	*callsp = calls;
+	*np = n;
+	return (r);
+}
+
+static const char *
+replay_arg(const replay_call_t *rc, int i)
+{
+	if (rc->rc_arg[i] == NULL || rc->rc_arg[i][0] == '\0')
+		return (NULL);
+	return (rc->rc_arg[i]);
+}
+
+/*
+ * Make one call.  Returns 0 if it found a DC or SRV records.
+ */
+static int
+replay_call(const replay_call_t *rc, char *what, size_t len)
+{
+	DOMAIN_CONTROLLER_INFO *dci;
+	dc_locate_reply_t *all;
+	lsa_srv_ctx_t *ctx;
+	const char *site;
+	int n;
+
+	if (rc->rc_rec.ltr_kind == LSA_WIRE_LOOKUP) {
+		if ((ctx = lsa_srv_init()) == NULL)
+			return (-1);
+		n = lsa_srv_lookup(ctx, rc->rc_arg[0], rc->rc_arg[1]);
+		lsa_srv_fini(ctx);
+		(void) snprintf(what, len, "lookup %s.%s: %d targets",
+		    rc->rc_arg[0], rc->rc_arg[1], n);
+		return ((n > 0) ? 0 : -1);
+	}
+
+	site = replay_arg(rc, 2);
+	if (replay_arg(rc, 1) == NULL) {
+		dci = dc_locate_guid(rc->rc_arg[0], replay_arg(rc, 3),
+		    rc->rc_guid, 0);
+	} else if ((rc->rc_rec.ltr_flags & DCL_F_ALL) != 0) {
+		all = dc_locate_all(rc->rc_arg[0], rc->rc_arg[1], site,
+		    rc->rc_rec.ltr_flags, 0, NULL, NULL, &n);
+		(void) snprintf(what, len, "locate %s.%s%s%s: %d DCs",
+		    rc->rc_arg[0], rc->rc_arg[1], site ? " site " : "",
+		    site ? site : "", n);
+		dc_locate_freeall(all, n);
+		return ((n > 0) ? 0 : -1);
+	} else {
+		dci = dc_locate_ex(rc->rc_arg[0], rc->rc_arg[1], site,
+		    rc->rc_rec.ltr_flags, 0);
+	}
+
+	(void) snprintf(what, len, "locate %s.%s%s%s: %s", rc->rc_arg[0],
+	    replay_arg(rc, 1) ? rc->rc_arg[1] : replay_arg(rc, 3),
+	    site ? " site " : "", site ? site : "",
+	    dci ? dci->DomainControllerName : "-");
+	n = (dci != NULL) ? 0 : -1;
+	freedci(dci);
+	return (n);
+}
+
+static void
+replay_sleep(hrtime_t until)
+{
+	struct timespec ts;
+	hrtime_t left;
+
+	if ((left = until - gethrtime()) <= 0)
+		return;
+	ts.tv_sec = left / NANOSEC;
+	ts.tv_nsec = left % NANOSEC;
+	(void) nanosleep(&ts, NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	replay_call_t *calls = NULL;
+	boolean_t fast = B_FALSE;
+	hrtime_t base, t, lat, total, worst;
+	char what[3 * NS_MAXDNAME];
+	int c, i, pass, passes = 1, ncalls, failed;
+
+	while ((c = getopt(argc, argv, "fn:")) != -1) {
+		switch (c) {
+		case 'f':
+			fast = B_TRUE;
+			break;
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if (optind != argc - 1 || passes < 1) {
+		fprintf(stderr, "usage: %s [-f] [-n passes] trace\n", argv[0]);
+		return (1);
+	}
+
+	/*
+	 * The pings go nowhere, and the trace already shows the limits the
+	 * traced process kept to.
+	 */
+	lsa_rate_set(0, 0, 0, 0);
+
+	if (replay_load(argv[optind], &calls, &ncalls) != 0 ||
+	    lsa_wire_replay(argv[optind], !fast) != 0) {
+		fprintf(stderr, "%s: can't load trace\n", argv[optind]);
+		return (1);
+	}
+
+	for (pass = 0; pass < passes; pass++) {
+		lsa_wire_rewind();
+		dc_cache_flush();
+		dc_locate_forget();
+		failed = 0;
+		total = worst = 0;
+		base = gethrtime();
+
+		for (i = 0; i < ncalls; i++) {
+			if (!fast)
+				replay_sleep(base + calls[i].rc_rec.ltr_time -
+				    calls[0].rc_rec.ltr_time);
+			t = gethrtime();
+			if (replay_call(&calls[i], what, sizeof (what)) != 0)
+				failed++;
+			lat = gethrtime() - t;
+			total += lat;
+			if (lat > worst)
+				worst = lat;
+			printf("%10.3f ms  %s\n", lat / REPLAY_MSEC, what);
+		}
+
+		printf("pass %d: %d calls, %d failed, mean %.3f ms, "
+		    "max %.3f ms, wall %.3f ms\n\n", pass + 1, ncalls, failed,
+		    (ncalls > 0) ? total / REPLAY_MSEC / ncalls : 0.0,
+		    worst / REPLAY_MSEC, (gethrtime() - base) / REPLAY_MSEC);
+	}
+
+	lsa_wire_stop();
+	for (i = 0; i < ncalls; i++)
+		free(calls[i].rc_data);
+	free(calls);
+	return (0);
+}
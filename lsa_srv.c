@@ -21,225 +21,1034 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
 #include <netdb.h>
 #include <ldap.h>
 #include "lsa_srv.h"
+#include "lsa_wire.h"
+#include "lsa_alloc.h"
+#include "lsa_metrics.h"
+#include "lsa_hosts.h"
+#include "lsa_rate.h"
 
-static void
-lsa_srvlist_insert(list_t *l, srv_rr_t *rr)
+uint16_t lsa_srv_edns = LSA_EDNS_PAYLOAD;
+
+/*
+ * Candidates are kept in one array, sorted once by priority then weight.
+ * Ties keep answer order, which is what the target offsets record.
+ */
+static int
+lsa_srv_cmp(const void *a, const void *b)
 {
-        srv_rr_t *sr;
-        uint16_t pri = rr->sr_priority;
-        uint16_t weight = rr->sr_weight;
+	const srv_rr_t *sa = a, *sb = b;
 
-        for (sr = list_tail(l); sr != NULL; sr = list_prev(l, sr)) {
-                if ((sr->sr_priority < pri) ||
-                    ((sr->sr_priority == pri) && (sr->sr_weight < weight))) {
-                        list_insert_after(l, sr, rr);
-                        return;
-                }
-        }
+	if (sa->sr_priority != sb->sr_priority)
+		return (sa->sr_priority < sb->sr_priority ? -1 : 1);
+	if (sa->sr_weight != sb->sr_weight)
+		return (sa->sr_weight < sb->sr_weight ? -1 : 1);
+	return (sa->sr_nameoff - sb->sr_nameoff);
+}
 
-        list_insert_head(l, rr);
+/*
+ * Glue is sorted by first-label offset, AAAA ahead of A.
+ */
+static int
+lsa_glue_cmp(const void *a, const void *b)
+{
+	const addr_rr_t *aa = a, *ab = b;
+
+	if (aa->ar_canon != ab->ar_canon)
+		return (aa->ar_canon - ab->ar_canon);
+	if (aa->ar_type != ab->ar_type)
+		return (aa->ar_type == AF_INET6 ? -1 : 1);
+	return (aa->ar_name - ab->ar_name);
 }
 
-static void
-lsa_addrlist_destroy(list_t *l)
+/*
+ * Make sure an array in the context can hold n elements of size sz.
+ * Storage is kept across parses, so reparsing allocates nothing once
+ * the arrays are big enough.
+ */
+static int
+lsa_srv_grow(lsa_alloc_phase_t ph, void **arr, int *cap, int n,
+    size_t sz)
 {
-	addr_rr_t *ar;
-	
-	for (ar = list_head(l); ar != NULL; ar = list_head(l)) {
-		free(ar->name);
-		free(ar->addr);
-		list_remove_head(l);
-		free(ar);
+	void *p;
+
+	if (n <= *cap)
+		return (0);
+	if (n < *cap * 2)
+		n = *cap * 2;
+	if ((p = lsa_realloc(ph, *arr, n * sz)) == NULL)
+		return (-1);
+	*arr = p;
+	*cap = n;
+	return (0);
+}
+
+/*
+ * DNS names are never expanded while walking the message; they are kept
+ * as offsets into it and compared in place.  Only the names of the
+ * candidates we keep are expanded, once, at the end of the parse.
+ */
+
+/*
+ * Skip over a possibly compressed name at cp, without following pointers.
+ * Returns a pointer past the name, or NULL if the name runs off the end.
+ */
+static const uchar_t *
+lsa_dname_skip(const uchar_t *cp, const uchar_t *eom)
+{
+	uint8_t len;
+
+	while (cp < eom) {
+		len = *cp;
+		if ((len & NS_CMPRSFLGS) == NS_CMPRSFLGS)
+			return ((cp + 2 <= eom) ? cp + 2 : NULL);
+		if ((len & NS_CMPRSFLGS) != 0)
+			return (NULL);
+		cp += len + 1;
+		if (len == 0)
+			return (cp);
 	}
+
+	return (NULL);
 }
 
-static void
-lsa_srvlist_destroy(list_t *l)
+/*
+ * Follow compression pointers at off until a label is reached.
+ * Pointers must point strictly backwards, which rules out loops.
+ * Returns the offset of the label, or -1 if the name is malformed.
+ */
+static int
+lsa_dname_canon(const uchar_t *msg, const uchar_t *eom, int off)
 {
-	srv_rr_t *sr;
+	int next;
+
+	while (msg + off < eom && (msg[off] & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+		if (msg + off + 1 >= eom)
+			return (-1);
+		next = ((msg[off] & ~NS_CMPRSFLGS) << 8) | msg[off + 1];
+		if (next >= off)
+			return (-1);
+		off = next;
+	}
+
+	return ((msg + off < eom) ? off : -1);
+}
 
-	for (sr = list_head(l); sr != NULL; sr = list_head(l)) {
-		free(sr->sr_name);
-		list_remove_head(l);
-		free(sr);
+/*
+ * Compare two names in the message label by label, without expanding them.
+ * Names that share a suffix through compression compare equal as soon as
+ * both reach the same offset.
+ */
+static boolean_t
+lsa_dname_eq(const uchar_t *msg, const uchar_t *eom, int a, int b)
+{
+	uint8_t len;
+	int labels;
+
+	for (labels = 0; labels < NS_MAXDNAME / 2; labels++) {
+		if ((a = lsa_dname_canon(msg, eom, a)) < 0 ||
+		    (b = lsa_dname_canon(msg, eom, b)) < 0)
+			return (B_FALSE);
+		if (a == b)
+			return (B_TRUE);
+		len = msg[a];
+		if (len != msg[b] || (len & NS_CMPRSFLGS) != 0)
+			return (B_FALSE);
+		if (len == 0)
+			return (B_TRUE);
+		if (msg + a + 1 + len > eom || msg + b + 1 + len > eom)
+			return (B_FALSE);
+		if (strncasecmp((const char *)msg + a + 1,
+		    (const char *)msg + b + 1, len) != 0)
+			return (B_FALSE);
+		a += len + 1;
+		b += len + 1;
 	}
+
+	return (B_FALSE);
 }
 
 /*
- * Parse SRV record into a srv_rr_t.
- * Returns a pointer to the next record on success, NULL on failure.
+ * Walk one resource record, leaving *cp at the start of the next one.
+ * RDATA is always skipped by its length, whatever the type.
  */
+static int
+lsa_parse_rr(const uchar_t *msg, const uchar_t *eom, const uchar_t **cp,
+    lsa_rr_t *rr)
+{
+	const uchar_t *p;
+
+	rr->rr_name = *cp - msg;
+	if ((p = lsa_dname_skip(*cp, eom)) == NULL)
+		return (P_ERR_FAIL);
+	if (p + NS_RRFIXEDSZ > eom)
+		return (P_ERR_FAIL);
+
+	NS_GET16(rr->rr_type, p);
+	NS_GET16(rr->rr_class, p);
+	NS_GET32(rr->rr_ttl, p);
+	NS_GET16(rr->rr_rdlen, p);
+
+	if (p + rr->rr_rdlen > eom)
+		return (P_ERR_FAIL);
 
+	rr->rr_rdata = p;
+	*cp = p + rr->rr_rdlen;
+	return (P_SUCCESS);
+}
+
+/*
+ * Parse SRV RDATA into a srv_rr_t.  The target is recorded as an offset
+ * into the message; it is expanded later, only if the record is kept.
+ */
 static int
-lsa_parse_srv(const uchar_t *msg, const uchar_t *eom, uchar_t **cp,
-    uchar_t *namebuf, size_t bufsize, srv_rr_t *sr)
+lsa_parse_srv(const uchar_t *msg, const uchar_t *eom, const lsa_rr_t *rr,
+    srv_rr_t *sr)
 {
+	const uchar_t *p = rr->rr_rdata, *end = p + rr->rr_rdlen;
+	int target;
+
+	if (rr->rr_rdlen < 7)
+		return (P_ERR_FAIL);
+
 	/*
 	 * Get priority, weight, port, and target name.
 	 */
-	uint16_t priority, weight, port;
-	int len;
-	char *name;
-
-	NS_GET16(priority, *cp);
-	NS_GET16(weight, *cp);
-	NS_GET16(port, *cp);
-	len = dn_expand(msg, eom, *cp, namebuf, bufsize);
-	if (len < 0)
-		return P_ERR_FAIL;
+	NS_GET16(sr->sr_priority, p);
+	NS_GET16(sr->sr_weight, p);
+	NS_GET16(sr->sr_port, p);
+	if (lsa_dname_skip(p, end) == NULL)
+		return (P_ERR_FAIL);
 
 	/*
 	 * According to RFC 2782, SRV records for which there is no service
 	 * use target ".".
 	 */
-	if (namebuf[0] == '.' && namebuf[1] == '\0')
-		return P_ERR_SKIP;
-		
-	if ((name = strdup(namebuf)) == NULL)
-		return P_ERR_FAIL;
-
-	sr->sr_name = name;
-	sr->sr_port = port;
-	sr->sr_priority = priority;
-	sr->sr_weight = weight;
+	if ((target = lsa_dname_canon(msg, eom, p - msg)) < 0)
+		return (P_ERR_FAIL);
+	if (msg[target] == 0)
+		return (P_ERR_SKIP);
 
-	return P_SUCCESS;
+	sr->sr_nameoff = p - msg;
+	return (P_SUCCESS);
 }
 
-/* 
- * Parse A record into a v4-mapped IPv6 address.
+/*
+ * Parse A or AAAA RDATA into an addr_rr_t, as a v4-mapped IPv6 address
+ * in the A case.
  */
+static int
+lsa_parse_addr(const lsa_rr_t *rr, addr_rr_t *ar)
+{
+	in6_addr_t *addr6 = &ar->ar_addr;
+
+	if (rr->rr_type == T_A && rr->rr_rdlen == NS_INADDRSZ) {
+		addr6->s6_addr32[1] = addr6->s6_addr32[0] = 0;
+		addr6->s6_addr32[2] = htonl(0xffff);
+		(void) memcpy(&addr6->s6_addr8[12], rr->rr_rdata, NS_INADDRSZ);
+		ar->ar_type = AF_INET;
+	} else if (rr->rr_type == T_AAAA && rr->rr_rdlen == NS_IN6ADDRSZ) {
+		(void) memcpy(addr6->s6_addr8, rr->rr_rdata, NS_IN6ADDRSZ);
+		ar->ar_type = AF_INET6;
+	} else {
+		return (P_ERR_SKIP);
+	}
 
+	ar->ar_name = rr->rr_name;
+	return (P_SUCCESS);
+}
+
+/*
+ * Check an EDNS0 OPT record.  Its class is the sender's UDP payload size
+ * and its TTL carries the upper bits of the rcode and the EDNS version;
+ * an answer with a non-zero extended rcode is an error, whatever the
+ * header says.
+ */
 static int
-lsa_parse_a(const uchar_t *msg, const uchar_t *eom, uchar_t **cp,
-    uchar_t *namebuf, addr_rr_t *ar)
+lsa_parse_opt(const uchar_t *msg, const lsa_rr_t *rr)
 {
+	if (msg[rr->rr_name] != 0)
+		return (P_ERR_FAIL);	/* owner must be the root */
+	if ((rr->rr_ttl >> 24) != 0)
+		return (P_ERR_FAIL);
+	return (P_SUCCESS);
+}
 
-	in6_addr_t *addr6 = NULL;
-	char *name = NULL;
-	int i;
+/*
+ * Find the glue for a target, preferring AAAA over A.  Glue owners are
+ * almost always pointers to the SRV target itself, so look for an exact
+ * match on the label offset in the sorted glue before comparing names.
+ */
+static addr_rr_t *
+lsa_glue_find(const uchar_t *msg, const uchar_t *eom, addr_rr_t *glue,
+    int nglue, int name)
+{
+	addr_rr_t *ar = NULL;
+	int lo = 0, hi = nglue, mid, i, canon;
 
-	if ((name = strdup(namebuf)) == NULL)
-		goto fail;	
+	if ((canon = lsa_dname_canon(msg, eom, name)) < 0)
+		return (NULL);
 
-	if ((addr6 = malloc(sizeof (*addr6))) == NULL) 
-		goto fail;
+	/*
+	 * Lower bound on ar_canon; AAAA sorts first within a run.
+	 */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (glue[mid].ar_canon < canon)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < nglue && glue[lo].ar_canon == canon)
+		return (&glue[lo]);
+
+	for (i = 0; i < nglue; i++) {
+		if (!lsa_dname_eq(msg, eom, canon, glue[i].ar_canon))
+			continue;
+		ar = &glue[i];
+		if (ar->ar_type == AF_INET6)
+			break;
+	}
+
+	return (ar);
+}
+
+/*
+ * Parse a DNS answer to an SRV query into the context's candidate array,
+ * replacing any candidates from a previous answer. Targets are matched
+ * against A/AAAA glue in the additional section; targets without glue
+ * are left with an unspecified address for lsa_srv_resolve() or
+ * lsa_srv_resolve_send().
+ * The message is walked once, front to back.
+ * Returns number of records on success, -1 on failure.
+ */
+int
+lsa_srv_parse(lsa_srv_ctx_t *ctx, const uchar_t *msg, int msglen)
+{
+	int	n, nq, na, ns, nr, len, nglue = 0, nsrv = 0, nnames = 0;
+	int	nopt = 0;
+	const HEADER *hp = (const HEADER *)msg;
+	const uchar_t *ap, *eom;
+	addr_rr_t *ar;
+	lsa_rr_t rr;
+	srv_rr_t *sr;
+
+	ctx->lsc_nsrv = 0;
+	ctx->lsc_next = 0;
+
+	if (msglen > NS_MAXMSG || msglen <= (HFIXEDSZ + QFIXEDSZ))
+		return (-1);
+
+	eom = msg + msglen;
 
-	addr6->s6_addr32[1] = addr6->s6_addr32[0] = 0;
-	addr6->s6_addr32[2] = 0xffff0000;
 	/*
-	addr6->s6_addr32[3] = *(uint32_t *)*cp;
-	*cp += 4;
-	*/
-	
-	for (i = 12; i < 16; i++)
-	  addr6->s6_addr8[i] = *(*cp)++;
-	
-	if (*cp > eom)
-		goto fail;
+	 * Get question and answer count.
+	 */
+	nq = ntohs(hp->qdcount);
+	na = ntohs(hp->ancount);
+	ns = ntohs(hp->nscount);
+	nr = ntohs(hp->arcount);
+	if (nq != 1 || na < 1)
+		return (-1);
+
+	if (lsa_srv_grow(LSA_ALLOC_CAND, (void **)&ctx->lsc_srv,
+	    &ctx->lsc_srvcap, na, sizeof (srv_rr_t)) != 0)
+		return (-1);
+
+	/*
+	 * Skip header and question.
+	 */
+	ap = lsa_dname_skip(msg + HFIXEDSZ, eom);
+	if (ap == NULL || ap + QFIXEDSZ > eom)
+		return (-1);
+	ap += QFIXEDSZ;
+
+	/*
+	 * Answers: keep SRV records, skip anything else (e.g. CNAMEs).
+	 */
+	for (n = 0; n < na; n++) {
+		if (lsa_parse_rr(msg, eom, &ap, &rr) != P_SUCCESS)
+			return (-1);
+		if (rr.rr_type != T_SRV || rr.rr_class != C_IN)
+			continue;
+
+		sr = &ctx->lsc_srv[nsrv];
+		memset(sr, 0, sizeof (*sr));
+		switch (lsa_parse_srv(msg, eom, &rr, sr)) {
+		case P_SUCCESS:
+			nsrv++;
+			break;
+		case P_ERR_SKIP:
+			break;
+		default:
+			return (-1);
+		}
+	}
+
+	if (nsrv == 0)
+		return (0);
+
+	qsort(ctx->lsc_srv, nsrv, sizeof (srv_rr_t), lsa_srv_cmp);
+
+	/*
+	 * Authority and additional sections: collect address glue.  A
+	 * malformed record here only costs us the remaining glue, but a
+	 * bad or repeated OPT record fails the answer.
+	 */
+	if (lsa_srv_grow(LSA_ALLOC_DNS, (void **)&ctx->lsc_glue,
+	    &ctx->lsc_gluecap, ns + nr, sizeof (addr_rr_t)) != 0)
+		return (-1);
+	for (n = 0; n < ns + nr; n++) {
+		if (lsa_parse_rr(msg, eom, &ap, &rr) != P_SUCCESS)
+			break;
+		if (rr.rr_type == ns_t_opt) {
+			if (n < ns || nopt++ > 0 ||
+			    lsa_parse_opt(msg, &rr) != P_SUCCESS)
+				return (-1);
+			continue;
+		}
+		if (rr.rr_class != C_IN)
+			continue;
+		ar = &ctx->lsc_glue[nglue];
+		if (lsa_parse_addr(&rr, ar) == P_SUCCESS &&
+		    (ar->ar_canon = lsa_dname_canon(msg, eom, ar->ar_name)) >= 0)
+			nglue++;
+	}
+	if (nglue > 1)
+		qsort(ctx->lsc_glue, nglue, sizeof (addr_rr_t), lsa_glue_cmp);
+
+	/*
+	 * Match targets to glue and expand the names we keep into the
+	 * context's name table.
+	 * Do we care about using IPv6 if its available, or
+	 * should we only use it if it's the only one available?
+	 * This currently "falls back" to v4-mapped IPv6 if pure IPv6
+	 * wasn't provided.
+	 */
+	for (n = 0; n < nsrv; n++) {
+		sr = &ctx->lsc_srv[n];
+		sr->addr.sin6_family = AF_INET6;
+		sr->addr.sin6_port = htons(LDAP_PORT);
+		ar = lsa_glue_find(msg, eom, ctx->lsc_glue, nglue,
+		    sr->sr_nameoff);
+		if (ar != NULL)
+			sr->addr.sin6_addr = ar->ar_addr;
+
+		if (lsa_srv_grow(LSA_ALLOC_CAND, (void **)&ctx->lsc_names,
+		    &ctx->lsc_namecap, nnames + NS_MAXDNAME, 1) != 0)
+			return (-1);
+		if (dn_expand(msg, eom, msg + sr->sr_nameoff,
+		    ctx->lsc_names + nnames, NS_MAXDNAME) < 0)
+			return (-1);
+		len = strlen(ctx->lsc_names + nnames) + 1;
+		sr->sr_nameoff = nnames;
+		nnames += len;
+	}
+
+	/*
+	 * The name table may have moved while growing; point at it now.
+	 */
+	for (n = 0; n < nsrv; n++) {
+		sr = &ctx->lsc_srv[n];
+		sr->sr_name = ctx->lsc_names + sr->sr_nameoff;
+	}
+
+	ctx->lsc_nsrv = nsrv;
+	return (nsrv);
+}
+
+/*
+ * DNS over TCP.  One connection per nameserver is kept open across
+ * queries and contexts, so a lookup that has to use TCP pays for the
+ * handshake once rather than per query.  Queries sent together are
+ * pipelined on one connection and their answers matched by ID.  A
+ * connection left idle for LSA_TCP_IDLE is closed the next time the
+ * pool is looked at, which every lsa_srv_fini() does, so connections do
+ * not outlive the locates that opened them by long.
+ */
+#define	LSA_TCP_MAX	8
+#define	LSA_TCP_IDLE	((hrtime_t)10 * NANOSEC)
+#define	LSA_TCP_DEPTH	32	/* queries in flight on a connection */
+#define	LSA_TCP_ADDRSZ	1024	/* answer buffer for an address query */
+
+typedef struct lsa_tcp {
+	union res_sockaddr_union lt_addr;
+	boolean_t	lt_open;
+	boolean_t	lt_busy;
+	int		lt_fd;
+	hrtime_t	lt_used;
+} lsa_tcp_t;
+
+static lsa_tcp_t lsa_tcp_pool[LSA_TCP_MAX];
+static pthread_mutex_t lsa_tcp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static socklen_t
+lsa_sa_len(const struct sockaddr *sa)
+{
+	return ((sa->sa_family == AF_INET6) ? sizeof (struct sockaddr_in6) :
+	    sizeof (struct sockaddr_in));
+}
 
-	ar->addr = addr6;
-	ar->name = name;
-	ar->type = AF_INET;
-	return P_SUCCESS;
+/*
+ * The nameservers to query.  A replay uses those the trace was taken
+ * against, so it needs none configured on the host it runs on.
+ */
+static int
+lsa_srv_servers(lsa_srv_ctx_t *ctx, union res_sockaddr_union *ns)
+{
+	struct sockaddr_in6 sin6[MAXNS];
+	int i, nns;
+
+	if (lsa_wire_mode == LSA_WIRE_REPLAY &&
+	    (nns = lsa_wire_servers(sin6, MAXNS)) > 0) {
+		for (i = 0; i < nns; i++)
+			ns[i].sin6 = sin6[i];
+		return (nns);
+	}
+	return (res_getservers(&ctx->lsc_state, ns, MAXNS));
+}
 
- fail:
-	free(addr6);
-	free(name);
-	return P_ERR_FAIL;
-} 
+static boolean_t
+lsa_sa_eq(const struct sockaddr *a, const struct sockaddr *b)
+{
+	const struct sockaddr_in *a4, *b4;
+	const struct sockaddr_in6 *a6, *b6;
+
+	if (a->sa_family != b->sa_family)
+		return (B_FALSE);
+	if (a->sa_family == AF_INET6) {
+		a6 = (const struct sockaddr_in6 *)a;
+		b6 = (const struct sockaddr_in6 *)b;
+		return (a6->sin6_port == b6->sin6_port &&
+		    IN6_ARE_ADDR_EQUAL(&a6->sin6_addr, &b6->sin6_addr));
+	}
+	a4 = (const struct sockaddr_in *)a;
+	b4 = (const struct sockaddr_in *)b;
+	return (a4->sin_port == b4->sin_port &&
+	    a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+}
 
+/*
+ * Pooled connections are blocking between uses; a non-blocking user
+ * makes them so again before putting them back.
+ */
 static int
-lsa_parse_aaaa(const uchar_t *msg, const uchar_t *eom, uchar_t **cp,
-    uchar_t *namebuf, addr_rr_t *ar)
+lsa_tcp_block(int fd, boolean_t block)
+{
+	int fl;
+
+	if ((fl = fcntl(fd, F_GETFL)) < 0)
+		return (-1);
+	fl = block ? (fl & ~O_NONBLOCK) : (fl | O_NONBLOCK);
+	return (fcntl(fd, F_SETFL, fl));
+}
+
+/*
+ * Close the connections left idle too long.  Called with the lock held.
+ */
+static void
+lsa_tcp_reap(hrtime_t now)
 {
+	lsa_tcp_t *lt;
 	int i;
-	in6_addr_t *addr6 = NULL;
-	char *name = NULL;
 
-	if ((name = strdup(namebuf)) == NULL)
-		goto fail;
-	
-	if ((addr6 = malloc(sizeof (*addr6))) == NULL)
-		goto fail;
+	for (i = 0; i < LSA_TCP_MAX; i++) {
+		lt = &lsa_tcp_pool[i];
+		if (lt->lt_open && !lt->lt_busy &&
+		    now - lt->lt_used > LSA_TCP_IDLE) {
+			(void) lsa_wire_close(lt->lt_fd);
+			lt->lt_open = B_FALSE;
+		}
+	}
+}
 
-	/*	
-	for (i = 0; i < 4; i++) {
-		addr6->s6_addr32[i] = *(uint32_t *)*cp;
-		*cp += 4;
+static void
+lsa_tcp_put(int slot, int fd, boolean_t ok)
+{
+	lsa_tcp_t *lt;
+
+	if (slot < 0) {
+		if (fd >= 0)
+			(void) lsa_wire_close(fd);
+		return;
 	}
-	*/
-	
-	for (i = 0; i < 16; i++)
-	  addr6->s6_addr8[i] = *(*cp)++;
-	
-	if (*cp > eom)
+
+	lt = &lsa_tcp_pool[slot];
+	(void) pthread_mutex_lock(&lsa_tcp_lock);
+	if (!ok && lt->lt_open) {
+		(void) lsa_wire_close(lt->lt_fd);
+		lt->lt_open = B_FALSE;
+	}
+	lt->lt_used = gethrtime();
+	lt->lt_busy = B_FALSE;
+	lsa_tcp_reap(lt->lt_used);
+	(void) pthread_mutex_unlock(&lsa_tcp_lock);
+}
+
+/*
+ * Get a connection to the nameserver at sa, reusing an idle one from the
+ * pool if there is one.  *slot is set to its pool entry, or to -1 if the
+ * pool is full and the connection is closed after use.  *reused is set
+ * if the server may have closed the connection since it was last used.
+ * If pending is not NULL the connection is made non-blocking, and
+ * *pending is set while a new one is still being made.
+ */
+static int
+lsa_tcp_get(const struct sockaddr *sa, int *slot, boolean_t *reused,
+    boolean_t *pending)
+{
+	socklen_t salen = lsa_sa_len(sa);
+	hrtime_t now = gethrtime();
+	lsa_tcp_t *lt;
+	int i, fd;
+
+	*slot = -1;
+	*reused = B_FALSE;
+	if (pending != NULL)
+		*pending = B_FALSE;
+
+	(void) pthread_mutex_lock(&lsa_tcp_lock);
+	lsa_tcp_reap(now);
+	for (i = 0; i < LSA_TCP_MAX; i++) {
+		lt = &lsa_tcp_pool[i];
+		if (lt->lt_busy)
+			continue;
+		if (lt->lt_open && !*reused &&
+		    lsa_sa_eq((struct sockaddr *)&lt->lt_addr, sa)) {
+			*slot = i;
+			*reused = B_TRUE;
+		} else if (!lt->lt_open && *slot < 0) {
+			*slot = i;
+		}
+	}
+	if (*slot >= 0)
+		lsa_tcp_pool[*slot].lt_busy = B_TRUE;
+	(void) pthread_mutex_unlock(&lsa_tcp_lock);
+
+	if (*reused) {
+		fd = lsa_tcp_pool[*slot].lt_fd;
+		if (pending != NULL)
+			(void) lsa_tcp_block(fd, B_FALSE);
+		return (fd);
+	}
+
+	if ((fd = lsa_wire_socket(sa->sa_family, SOCK_STREAM)) < 0 ||
+	    (pending != NULL && lsa_tcp_block(fd, B_FALSE) != 0))
 		goto fail;
-	
-	ar->addr = addr6;
-	ar->name = name;
-	ar->type = AF_INET6;
-	return P_SUCCESS;
-
- fail:
-	free(addr6);
-	free(name);
-	return P_ERR_FAIL;
-} 
+	if (lsa_wire_connect(fd, sa, salen) < 0) {
+		if (pending == NULL || errno != EINPROGRESS)
+			goto fail;
+		*pending = B_TRUE;
+	}
+
+	if (*slot >= 0) {
+		lt = &lsa_tcp_pool[*slot];
+		(void) memcpy(&lt->lt_addr, sa, salen);
+		lt->lt_fd = fd;
+		lt->lt_open = B_TRUE;
+	}
+	return (fd);
+
+fail:
+	if (fd >= 0)
+		(void) lsa_wire_close(fd);
+	lsa_tcp_put(*slot, -1, B_FALSE);
+	return (-1);
+}
 
+/*
+ * Read len bytes, waiting for them no later than until.
+ */
+static int
+lsa_tcp_read(int fd, uchar_t *buf, int len, hrtime_t until)
+{
+	struct pollfd pfd;
+	hrtime_t left;
+	int n, r;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (n = 0; n < len; n += r) {
+		if ((left = until - gethrtime()) <= 0 ||
+		    poll(&pfd, 1, (int)((left + (NANOSEC / MILLISEC) - 1) /
+		    (NANOSEC / MILLISEC))) <= 0)
+			return (-1);
+		if ((r = recv(fd, buf + n, len - n, 0)) <= 0)
+			return (-1);
+	}
+	return (0);
+}
+
+static int
+lsa_tcp_skip(int fd, int len, hrtime_t until)
+{
+	uchar_t junk[NS_PACKETSZ];
+
+	while (len > 0) {
+		if (lsa_tcp_read(fd, junk, MIN(len, sizeof (junk)),
+		    until) != 0)
+			return (-1);
+		len -= MIN(len, sizeof (junk));
+	}
+	return (0);
+}
+
+/*
+ * Write n queries back to back, then read the n answers in whatever
+ * order they come, giving up on them at until.  anslen[i] is set to the
+ * length of the answer to q[i], or to -1 if it did not fit in anscap
+ * bytes.
+ */
+static int
+lsa_tcp_pipeline(int fd, uchar_t **q, const int *qlen, uchar_t **ans,
+    int *anslen, int anscap, int n, hrtime_t until)
+{
+	uchar_t buf[LSA_TCP_DEPTH * (NS_PACKETSZ + NS_INT16SZ)], *cp = buf;
+	uchar_t hdr[HFIXEDSZ];
+	uint16_t len;
+	int i, got, keep, r;
+
+	for (i = 0; i < n; i++) {
+		NS_PUT16(qlen[i], cp);
+		(void) memcpy(cp, q[i], qlen[i]);
+		cp += qlen[i];
+		anslen[i] = 0;
+	}
+	for (i = 0; i < cp - buf; i += r)
+		if ((r = lsa_wire_send(fd, buf + i, (cp - buf) - i,
+		    MSG_NOSIGNAL)) <= 0)
+			return (-1);
+	for (i = 0; i < n; i++)
+		lsa_wire_note(fd, LSA_WIRE_DNS_QUERY, q[i], qlen[i]);
+
+	for (got = 0; got < n; ) {
+		if (lsa_tcp_read(fd, hdr, NS_INT16SZ, until) != 0)
+			return (-1);
+		cp = hdr;
+		NS_GET16(len, cp);
+		if (len < HFIXEDSZ ||
+		    lsa_tcp_read(fd, hdr, HFIXEDSZ, until) != 0)
+			return (-1);
+
+		for (i = 0; i < n; i++)
+			if (anslen[i] == 0 && ((HEADER *)hdr)->id ==
+			    ((HEADER *)q[i])->id)
+				break;
+		if (i == n) {
+			/* not ours; a late answer to an abandoned query */
+			if (lsa_tcp_skip(fd, len - HFIXEDSZ, until) != 0)
+				return (-1);
+			continue;
+		}
+
+		keep = MIN(len, anscap);
+		(void) memcpy(ans[i], hdr, HFIXEDSZ);
+		if (lsa_tcp_read(fd, ans[i] + HFIXEDSZ, keep - HFIXEDSZ,
+		    until) != 0 || lsa_tcp_skip(fd, len - keep, until) != 0)
+			return (-1);
+		anslen[i] = (keep == len) ? len : -1;
+		lsa_wire_note(fd, LSA_WIRE_DNS_ANSWER, ans[i], keep);
+		got++;
+	}
+
+	return (0);
+}
+
+/*
+ * When a blocking exchange gives up on its answers: the resolver's
+ * retrans from now, cut short by lsc_limit.  Returns -1 once the limit
+ * has passed.
+ */
+static int
+lsa_srv_wait(lsa_srv_ctx_t *ctx, hrtime_t *until)
+{
+	hrtime_t now = gethrtime();
+
+	if (ctx->lsc_limit != 0 && now >= ctx->lsc_limit)
+		return (-1);
+	*until = now + (hrtime_t)ctx->lsc_state.retrans * NANOSEC;
+	if (ctx->lsc_limit != 0)
+		*until = MIN(*until, ctx->lsc_limit);
+	return (0);
+}
+
+/*
+ * Exchange n queries with the first nameserver that answers them all.
+ * A pooled connection the server has since closed is retried once on a
+ * fresh one.
+ */
+static int
+lsa_tcp_exchange(lsa_srv_ctx_t *ctx, uchar_t **q, const int *qlen,
+    uchar_t **ans, int *anslen, int anscap, int n)
+{
+	union res_sockaddr_union ns[MAXNS];
+	hrtime_t until;
+	boolean_t reused;
+	int i, fd, slot, nns;
+
+	nns = lsa_srv_servers(ctx, ns);
+	for (i = 0; i < nns; i++) {
+		do {
+			if (lsa_srv_wait(ctx, &until) != 0)
+				return (-1);
+			fd = lsa_tcp_get((struct sockaddr *)&ns[i], &slot,
+			    &reused, NULL);
+			if (fd < 0)
+				break;
+			if (lsa_tcp_pipeline(fd, q, qlen, ans, anslen, anscap,
+			    n, until) == 0) {
+				lsa_tcp_put(slot, fd, B_TRUE);
+				return (0);
+			}
+			lsa_tcp_put(slot, fd, B_FALSE);
+		} while (reused);
+	}
+
+	return (-1);
+}
+
+/*
+ * Take the first A or AAAA record in the answer to an address query for
+ * name, of the given type.  An answer to some other question is refused,
+ * so one that comes late on a connection or socket can't be mistaken for
+ * the answer to a query that reused its ID.
+ */
+static int
+lsa_answer_addr(const uchar_t *msg, int msglen, const char *name,
+    uint16_t type, in6_addr_t *addr)
+{
+	const HEADER *hp = (const HEADER *)msg;
+	const uchar_t *cp, *eom = msg + msglen;
+	char qname[NS_MAXDNAME];
+	uint16_t qtype;
+	lsa_rr_t rr;
+	addr_rr_t ar;
+	int n;
+
+	if (msglen <= HFIXEDSZ || hp->rcode != NOERROR ||
+	    ntohs(hp->qdcount) != 1)
+		return (-1);
+
+	if (dn_expand(msg, eom, msg + HFIXEDSZ, qname, sizeof (qname)) < 0 ||
+	    strcasecmp(qname, name) != 0)
+		return (-1);
+	cp = lsa_dname_skip(msg + HFIXEDSZ, eom);
+	if (cp == NULL || cp + QFIXEDSZ > eom)
+		return (-1);
+	NS_GET16(qtype, cp);
+	if (qtype != type)
+		return (-1);
+	cp += QFIXEDSZ - NS_INT16SZ;
+
+	for (n = ntohs(hp->ancount); n > 0; n--) {
+		if (lsa_parse_rr(msg, eom, &cp, &rr) != P_SUCCESS)
+			return (-1);
+		if (rr.rr_class == C_IN &&
+		    lsa_parse_addr(&rr, &ar) == P_SUCCESS) {
+			*addr = ar.ar_addr;
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+/*
+ * Resolve the targets without glue over TCP: AAAA and A queries for all
+ * of them are pipelined on the pooled connection, LSA_TCP_DEPTH at a time.
+ * AAAA is preferred, as with glue.
+ */
 static int
-lsa_parse_common(const uchar_t *msg, const uchar_t *eom, uchar_t **cp,
-    void *rr)
+lsa_srv_resolve_tcp(lsa_srv_ctx_t *ctx)
 {
-	uchar_t		namebuf[NS_MAXDNAME];
-	uint16_t	type, class, size;
-	uint32_t	ttl;
-	int		len;
+	static const uint16_t types[] = { T_AAAA, T_A };
+	uchar_t *q[LSA_TCP_DEPTH], *ans[LSA_TCP_DEPTH], *buf;
+	int qlen[LSA_TCP_DEPTH], anslen[LSA_TCP_DEPTH], idx[LSA_TCP_DEPTH];
+	in6_addr_t addr;
+	srv_rr_t *sr;
+	int i, t, n, next = 0, ret = -1;
+
+	buf = lsa_malloc(LSA_ALLOC_CAND,
+	    LSA_TCP_DEPTH * (NS_PACKETSZ + LSA_TCP_ADDRSZ));
+	if (buf == NULL)
+		return (-1);
+	for (i = 0; i < LSA_TCP_DEPTH; i++) {
+		q[i] = buf + i * NS_PACKETSZ;
+		ans[i] = buf + LSA_TCP_DEPTH * NS_PACKETSZ + i * LSA_TCP_ADDRSZ;
+	}
+
+	do {
+		if (ctx->lsc_limit != 0 && gethrtime() >= ctx->lsc_limit)
+			break;
+		for (n = 0; next < ctx->lsc_nsrv && n + 2 <= LSA_TCP_DEPTH;
+		    next++) {
+			sr = &ctx->lsc_srv[next];
+			if (!IN6_IS_ADDR_UNSPECIFIED(&sr->addr.sin6_addr))
+				continue;
+			for (t = 0; t < 2; t++, n++) {
+				qlen[n] = res_nmkquery(&ctx->lsc_state, QUERY,
+				    sr->sr_name, C_IN, types[t], NULL, 0, NULL,
+				    q[n], NS_PACKETSZ);
+				if (qlen[n] <= 0)
+					goto out;
+				/* unique within the pipeline */
+				((HEADER *)q[n])->id = htons(n);
+				idx[n] = next;
+			}
+		}
+		if (n == 0)
+			break;
+
+		if (lsa_tcp_exchange(ctx, q, qlen, ans, anslen, LSA_TCP_ADDRSZ,
+		    n) != 0)
+			goto out;
+		for (i = 0; i < n; i += 2) {
+			sr = &ctx->lsc_srv[idx[i]];
+			if (lsa_answer_addr(ans[i], anslen[i], sr->sr_name,
+			    types[0], &addr) != 0 &&
+			    lsa_answer_addr(ans[i + 1], anslen[i + 1],
+			    sr->sr_name, types[1], &addr) != 0)
+				goto out;
+			sr->addr.sin6_addr = addr;
+		}
+	} while (next < ctx->lsc_nsrv);
+
+	ret = 0;
+out:
+	free(buf);
+	return (ret);
+}
+
+/*
+ * Resolve addresses for candidates that had no glue in the SRV answer.
+ * Once the context has had to use TCP, so do these lookups.  Once
+ * lsc_limit has passed, no more lookups are started and the remaining
+ * targets are left unspecified.
+ * Returns 0 on success, -1 if any target could not be resolved.
+ */
+int
+lsa_srv_resolve(lsa_srv_ctx_t *ctx)
+{
+	srv_rr_t *sr;
+	int n;
+
+	if ((ctx->lsc_state.options & RES_USEVC) != 0)
+		return (lsa_srv_resolve_tcp(ctx));
+
+	for (n = 0; n < ctx->lsc_nsrv; n++) {
+		struct addrinfo *res = NULL;
+		struct addrinfo ai = {
+			AI_ADDRCONFIG | AI_V4MAPPED, AF_INET6,
+			0, 0, 0, NULL, NULL, NULL
+		};
+		struct sockaddr_in6 sa;
+
+		sr = &ctx->lsc_srv[n];
+		if (!IN6_IS_ADDR_UNSPECIFIED(&sr->addr.sin6_addr))
+			continue;
+		if (ctx->lsc_limit != 0 && gethrtime() >= ctx->lsc_limit)
+			break;
+		if (lsa_wire_mode == LSA_WIRE_REPLAY) {
+			if (lsa_wire_getaddr(sr->sr_name,
+			    &sr->addr.sin6_addr) != 0)
+				return (-1);
+			continue;
+		}
+		lsa_alloc_note(LSA_ALLOC_CAND, 0);
+		if ((getaddrinfo(sr->sr_name, NULL, &ai, &res) != 0)
+		    || (res == NULL))
+			return (-1);
+		(void) memcpy(&sa, res->ai_addr, res->ai_addrlen);
+		sr->addr.sin6_addr = sa.sin6_addr;
+		freeaddrinfo(res);
+		lsa_wire_addr(sr->sr_name, &sr->addr.sin6_addr);
+	}
+
+	return (0);
+}
+
+/*
+ * Build the SRV query for lsc_qname, with an EDNS0 OPT record in the
+ * additional section if edns is set.
+ */
+static int
+lsa_srv_build(lsa_srv_ctx_t *ctx, boolean_t edns)
+{
+	HEADER *hp = (HEADER *)ctx->lsc_query;
+	uchar_t *cp;
+
+	ctx->lsc_qlen = res_nmkquery(&ctx->lsc_state, QUERY, ctx->lsc_qname,
+	    C_IN, T_SRV, NULL, 0, NULL, ctx->lsc_query,
+	    sizeof (ctx->lsc_query));
+	if (ctx->lsc_qlen <= 0)
+		return (-1);
+	if (!edns || ctx->lsc_edns == 0)
+		return (0);
+
+	if (ctx->lsc_qlen + 1 + NS_RRFIXEDSZ > sizeof (ctx->lsc_query))
+		return (-1);
+	cp = ctx->lsc_query + ctx->lsc_qlen;
+	*cp++ = 0;			/* root */
+	NS_PUT16(ns_t_opt, cp);
+	NS_PUT16(ctx->lsc_edns, cp);	/* class: UDP payload size */
+	NS_PUT32(0, cp);		/* extended rcode, version, flags */
+	NS_PUT16(0, cp);		/* no options */
+	hp->arcount = htons(ntohs(hp->arcount) + 1);
+	ctx->lsc_qlen = cp - ctx->lsc_query;
+	return (0);
+}
+
+static int
+lsa_srv_mkquery(lsa_srv_ctx_t *ctx, const char *svcname, const char *dname,
+    boolean_t edns)
+{
+	if (snprintf(ctx->lsc_qname, sizeof (ctx->lsc_qname), "%s.%s",
+	    svcname, dname) >= sizeof (ctx->lsc_qname))
+		return (-1);
+
+	return (lsa_srv_build(ctx, edns));
+}
+
+/*
+ * Send the SRV query for a service in a domain and wait for the answer,
+ * unless the static map has it.  Returns the answer length, or -1 on
+ * failure.
+ */
+int
+lsa_srv_query(lsa_srv_ctx_t *ctx, const char *svcname, const char *dname,
+    uchar_t *ans, int anslen)
+{
+	uchar_t *q = ctx->lsc_query;
+	int len;
 
 	/*
-	 * Skip searched RR name and attributes.
-	 */
-	len = dn_expand(msg, eom, *cp, namebuf, sizeof (namebuf));
-	if (len < 0)
-		return P_ERR_FAIL;
-	
-	*cp += len;
-
-	/* 
-	 * We started on a compressed name, so we need to adjust cp
-	 */
-	if (**cp == 0xc0) 
-		*cp += 2;
-
-	NS_GET16(type, *cp);
-	NS_GET16(class, *cp);
-	NS_GET32(ttl, *cp);
-	NS_GET16(size, *cp);
-
-	if ((*cp + size) > eom)
-		return P_ERR_FAIL;
-
-	if (type == T_SRV)
-		return lsa_parse_srv(msg, eom, cp, namebuf, sizeof(namebuf), 
-		    (srv_rr_t *) rr);
-	if (type == T_A)
-		return lsa_parse_a(msg, eom, cp, namebuf, (addr_rr_t *) rr);
-	if (type == T_AAAA)
-		return lsa_parse_aaaa(msg, eom, cp, namebuf, (addr_rr_t *) rr);
-
-	/* 
-	 * If we get here, skip parsing the record entirely;
-	 * we're not interested.
+	 * Use virtual circuits (TCP) for resolver.
 	 */
-	*cp += size;
-	return P_ERR_SKIP;
+	ctx->lsc_state.options |= RES_USEVC;
+
+	if (lsa_srv_mkquery(ctx, svcname, dname, B_FALSE) != 0)
+		return (-1);
+	if ((len = lsa_hosts_answer(ctx->lsc_qname, ans, anslen)) > 0)
+		return (len);
+	if (lsa_tcp_exchange(ctx, &q, &ctx->lsc_qlen, &ans, &len, anslen,
+	    1) != 0)
+		return (-1);
+
+	return (len);
 }
 
 /*
@@ -250,153 +1059,554 @@ lsa_parse_common(const uchar_t *msg, const uchar_t *eom, uchar_t **cp,
 int
 lsa_srv_lookup(lsa_srv_ctx_t *ctx, const char *svcname, const char *dname)
 {
-	int	ret = -1, anslen, len, n, nq, na, ns, nr, e, skip = 0;
-	union
-	{
-		HEADER h;
-		uchar_t b[NS_MAXMSG];
-	} *ansbuf;
-	uchar_t	*ap, *eom;
-	char	namebuf[NS_MAXDNAME];
-	list_t la;
-	srv_rr_t *sr;
+	int	ret = -1, anslen;
+	uchar_t	*ansbuf;
+	hrtime_t start;
 
-	list_create(&la, sizeof (addr_rr_t), offsetof(addr_rr_t, addr_node));
+	lsa_wire_lookup(svcname, dname);
 
-	ansbuf = malloc(sizeof (*ansbuf));
+	ansbuf = lsa_malloc(LSA_ALLOC_DNS, NS_MAXMSG);
 	if (ansbuf == NULL)
 		goto out;
 
-	ap = ansbuf->b;
+	start = gethrtime();
+	anslen = lsa_srv_query(ctx, svcname, dname, ansbuf, NS_MAXMSG);
+	if (anslen > 0)
+		lsa_metrics_time(LSA_METRICS_DOMAIN, dname, LSA_H_DNS,
+		    gethrtime() - start);
+
+	ret = lsa_srv_parse(ctx, ansbuf, anslen);
+	if (ret < 0)
+		lsa_metrics_count(LSA_METRICS_DOMAIN, dname,
+		    LSA_M_DNS_ERRORS, 1);
+	if (ret <= 0)
+		goto out;
 
-	/*
-	 * Use virtual circuits (TCP) for resolver.
-	 */
-	ctx->lsc_state.options |= RES_USEVC;
+	if (lsa_srv_resolve(ctx) != 0)
+		ret = -1;
 
-	/*
-	 * Traverse parent domains until an answer is found.
-	 */
+out:
+	free(ansbuf);
+	return (ret);
+}
+
+/*
+ * Non-blocking lookups.
+ *
+ * lsa_srv_send() sends the SRV query over UDP to the first nameserver and
+ * returns a descriptor to poll for the answer; lsa_srv_recv() reads and
+ * parses it.  If no answer arrives by lsa_srv_deadline(), lsa_srv_retry()
+ * resends to the next nameserver, following the resolver's retrans/retry
+ * settings.  A truncated answer is requeried over a pooled TCP connection,
+ * on a descriptor of its own, and lsa_srv_recv() returns LSA_SRV_AGAIN
+ * until that answer is in; poll it for lsc_events, which is POLLOUT while
+ * the connection is being made.  lsa_srv_resolve_send() and
+ * lsa_srv_resolve_recv() then look up the targets without glue the same
+ * way.  A query the static map answers is not sent: lsa_srv_send()
+ * returns 0, lsa_srv_ready() is true, and lsa_srv_recv() parses the map's
+ * answer.
+ */
 
-	anslen = res_nquerydomain(&ctx->lsc_state, svcname, dname, C_IN, T_SRV,
-	    ap, sizeof (*ansbuf));
+static void
+lsa_srv_close(lsa_srv_ctx_t *ctx)
+{
+	if (ctx->lsc_fd >= 0) {
+		if (ctx->lsc_phase == LSA_SRV_TCP)
+			lsa_tcp_put(ctx->lsc_slot, ctx->lsc_fd, B_FALSE);
+		else
+			(void) lsa_wire_close(ctx->lsc_fd);
+	}
+	ctx->lsc_fd = -1;
+}
 
-	if (anslen > sizeof (*ansbuf) || anslen <= (HFIXEDSZ + QFIXEDSZ))
-		goto out;
+/*
+ * Resends are spread by this many percent of retrans either way, so
+ * clients that lost their answers together do not resend together.
+ */
+#define	LSA_SRV_JITTER	20
+
+/*
+ * Open a UDP socket to the next nameserver to try, or fail once each has
+ * been tried as often as the resolver's retry says.
+ */
+static int
+lsa_srv_udp(lsa_srv_ctx_t *ctx, lsa_srv_phase_t phase)
+{
+	union res_sockaddr_union ns[MAXNS];
+	struct sockaddr *sa;
+	socklen_t salen;
+	int nns;
+
+	lsa_srv_close(ctx);
+	ctx->lsc_phase = phase;
+	ctx->lsc_events = POLLIN;
+
+	nns = lsa_srv_servers(ctx, ns);
+	if (nns <= 0 || ctx->lsc_tries >= nns * ctx->lsc_state.retry)
+		return (-1);
+
+	sa = (struct sockaddr *)&ns[ctx->lsc_tries % nns];
+	salen = lsa_sa_len(sa);
+	ctx->lsc_tries++;
+
+	if ((ctx->lsc_fd = lsa_wire_socket(sa->sa_family, SOCK_DGRAM)) < 0)
+		return (-1);
+	if (lsa_wire_connect(ctx->lsc_fd, sa, salen) < 0) {
+		lsa_srv_close(ctx);
+		return (-1);
+	}
+
+	ctx->lsc_deadline = gethrtime() + lsa_rate_jitter(
+	    (hrtime_t)ctx->lsc_state.retrans * NANOSEC, LSA_SRV_JITTER);
+	return (ctx->lsc_fd);
+}
+
+static int
+lsa_srv_transmit(lsa_srv_ctx_t *ctx)
+{
+	if (lsa_srv_udp(ctx, LSA_SRV_UDP) < 0)
+		return (-1);
+	if (lsa_wire_send(ctx->lsc_fd, ctx->lsc_query, ctx->lsc_qlen, 0) !=
+	    ctx->lsc_qlen) {
+		lsa_srv_close(ctx);
+		return (-1);
+	}
+	return (ctx->lsc_fd);
+}
+
+/*
+ * Send the query on the TCP connection, length first.
+ */
+static int
+lsa_srv_tcp_send(lsa_srv_ctx_t *ctx)
+{
+	uchar_t buf[NS_INT16SZ + sizeof (ctx->lsc_query)], *cp = buf;
+	int len = NS_INT16SZ + ctx->lsc_qlen;
+
+	NS_PUT16(ctx->lsc_qlen, cp);
+	(void) memcpy(cp, ctx->lsc_query, ctx->lsc_qlen);
+	if (lsa_wire_send(ctx->lsc_fd, buf, len, MSG_NOSIGNAL) != len)
+		return (-1);
+	lsa_wire_note(ctx->lsc_fd, LSA_WIRE_DNS_QUERY, ctx->lsc_query,
+	    ctx->lsc_qlen);
+
+	ctx->lsc_connecting = B_FALSE;
+	ctx->lsc_events = POLLIN;
+	ctx->lsc_got = 0;
+	return (ctx->lsc_fd);
+}
 
-	eom = ap + anslen;
+/*
+ * Requery over TCP, starting with nameserver lsc_tries, without waiting
+ * for the connection.  Each nameserver gets one try; a pooled connection
+ * it has since closed is retried once on a fresh one.
+ */
+static int
+lsa_srv_tcp_start(lsa_srv_ctx_t *ctx)
+{
+	union res_sockaddr_union ns[MAXNS];
+	struct sockaddr *sa;
+	int nns;
+
+	lsa_srv_close(ctx);
+	nns = lsa_srv_servers(ctx, ns);
+	for (; ctx->lsc_tries < nns; ctx->lsc_tries++) {
+		if (ctx->lsc_limit != 0 && gethrtime() >= ctx->lsc_limit)
+			return (-1);
+		sa = (struct sockaddr *)&ns[ctx->lsc_tries];
+		ctx->lsc_fd = lsa_tcp_get(sa, &ctx->lsc_slot, &ctx->lsc_reused,
+		    &ctx->lsc_connecting);
+		if (ctx->lsc_fd < 0)
+			continue;
+		ctx->lsc_phase = LSA_SRV_TCP;
+		ctx->lsc_deadline = gethrtime() +
+		    (hrtime_t)ctx->lsc_state.retrans * NANOSEC;
+		if (ctx->lsc_connecting) {
+			ctx->lsc_events = POLLOUT;
+			return (ctx->lsc_fd);
+		}
+		if (lsa_srv_tcp_send(ctx) >= 0)
+			return (ctx->lsc_fd);
+		lsa_srv_close(ctx);
+		if (ctx->lsc_reused)
+			ctx->lsc_tries--;	/* again, on a fresh one */
+	}
+
+	return (-1);
+}
+
+/*
+ * Give up on the TCP connection and try the next nameserver, or this one
+ * again on a fresh connection if the pooled one failed.
+ */
+static int
+lsa_srv_tcp_next(lsa_srv_ctx_t *ctx)
+{
+	if (!ctx->lsc_reused)
+		ctx->lsc_tries++;
+	return (lsa_srv_tcp_start(ctx));
+}
+
+/*
+ * Read what has arrived of the answer over TCP.  Returns its length once
+ * it is all in, LSA_SRV_AGAIN before then, or -1 if the connection
+ * failed.  An answer to a query abandoned on the pooled connection is
+ * read and dropped.
+ */
+static int
+lsa_srv_tcp_read(lsa_srv_ctx_t *ctx)
+{
+	const HEADER *hp = (const HEADER *)ctx->lsc_ans;
+	const uchar_t *cp;
+	socklen_t errlen = sizeof (int);
+	uint16_t len;
+	ssize_t r;
+	int err;
+
+	if (ctx->lsc_connecting) {
+		if (getsockopt(ctx->lsc_fd, SOL_SOCKET, SO_ERROR, &err,
+		    &errlen) != 0 || err != 0 || lsa_srv_tcp_send(ctx) < 0)
+			return (-1);
+		return (LSA_SRV_AGAIN);
+	}
+
+	for (;;) {
+		if (ctx->lsc_got < NS_INT16SZ) {
+			r = recv(ctx->lsc_fd, ctx->lsc_lenbuf + ctx->lsc_got,
+			    NS_INT16SZ - ctx->lsc_got, MSG_DONTWAIT);
+		} else {
+			cp = ctx->lsc_lenbuf;
+			NS_GET16(len, cp);
+			if (len < HFIXEDSZ)
+				return (-1);
+			if (ctx->lsc_got == NS_INT16SZ + len) {
+				ctx->lsc_got = 0;
+				if (hp->id !=
+				    ((const HEADER *)ctx->lsc_query)->id)
+					continue;
+				lsa_wire_note(ctx->lsc_fd,
+				    LSA_WIRE_DNS_ANSWER, ctx->lsc_ans, len);
+				return (len);
+			}
+			r = recv(ctx->lsc_fd,
+			    ctx->lsc_ans + ctx->lsc_got - NS_INT16SZ,
+			    NS_INT16SZ + len - ctx->lsc_got, MSG_DONTWAIT);
+		}
+		if (r == 0)
+			return (-1);
+		if (r < 0)
+			return ((errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR) ? LSA_SRV_AGAIN : -1);
+		ctx->lsc_got += r;
+	}
+}
+
+int
+lsa_srv_send(lsa_srv_ctx_t *ctx, const char *svcname, const char *dname)
+{
+	lsa_srv_close(ctx);
+	ctx->lsc_phase = LSA_SRV_UDP;
+	if (lsa_srv_mkquery(ctx, svcname, dname, B_TRUE) != 0)
+		return (-1);
+
+	ctx->lsc_tries = 0;
+	ctx->lsc_mapped = 0;
+	if (lsa_hosts_loaded()) {
+		if (ctx->lsc_ans == NULL && (ctx->lsc_ans =
+		    lsa_malloc(LSA_ALLOC_DNS, NS_MAXMSG)) == NULL)
+			return (-1);
+		ctx->lsc_mapped = lsa_hosts_answer(ctx->lsc_qname,
+		    ctx->lsc_ans, NS_MAXMSG);
+		if (ctx->lsc_mapped > 0)
+			return (0);
+		ctx->lsc_mapped = 0;
+	}
+	return (lsa_srv_transmit(ctx));
+}
+
+static void lsa_srv_settle(lsa_srv_ctx_t *);
+static int lsa_srv_resolve_transmit(lsa_srv_ctx_t *);
+
+/*
+ * Called once lsa_srv_deadline() has passed with no answer.  Returns the
+ * descriptor to poll from now on, or -1 once every nameserver has been
+ * tried.
+ */
+int
+lsa_srv_retry(lsa_srv_ctx_t *ctx)
+{
+	int fd;
+
+	switch (ctx->lsc_phase) {
+	case LSA_SRV_TCP:
+		return (lsa_srv_tcp_next(ctx));
+	case LSA_SRV_ADDR:
+		if ((fd = lsa_srv_resolve_transmit(ctx)) < 0)
+			lsa_srv_settle(ctx);
+		return (fd);
+	default:
+		return (lsa_srv_transmit(ctx));
+	}
+}
+
+hrtime_t
+lsa_srv_deadline(lsa_srv_ctx_t *ctx)
+{
+	return (ctx->lsc_deadline);
+}
+
+/*
+ * Is the answer already here, so lsa_srv_recv() or lsa_srv_resolve_recv()
+ * needs no waiting?
+ */
+boolean_t
+lsa_srv_ready(lsa_srv_ctx_t *ctx)
+{
+	if (ctx->lsc_phase == LSA_SRV_ADDR)
+		return (ctx->lsc_aqleft == 0);
+	return (ctx->lsc_mapped > 0);
+}
+
+/*
+ * Read the answer to a query sent with lsa_srv_send() and parse it.
+ * Targets without glue are left for lsa_srv_resolve_send().
+ * Returns number of records, -1 on failure, or LSA_SRV_AGAIN if the
+ * answer is not all here yet and we should keep waiting.
+ */
+int
+lsa_srv_recv(lsa_srv_ctx_t *ctx)
+{
+	const HEADER *hp;
+	int anslen;
+
+	if (ctx->lsc_mapped > 0) {
+		anslen = ctx->lsc_mapped;
+		ctx->lsc_mapped = 0;
+		return (lsa_srv_parse(ctx, ctx->lsc_ans, anslen));
+	}
+
+	if (ctx->lsc_ans == NULL &&
+	    (ctx->lsc_ans = lsa_malloc(LSA_ALLOC_DNS, NS_MAXMSG)) == NULL)
+		return (-1);
+	hp = (const HEADER *)ctx->lsc_ans;
+
+	if (ctx->lsc_phase == LSA_SRV_TCP) {
+		if ((anslen = lsa_srv_tcp_read(ctx)) == LSA_SRV_AGAIN)
+			return (LSA_SRV_AGAIN);
+		if (anslen < 0)
+			return ((lsa_srv_tcp_next(ctx) < 0) ? -1 :
+			    LSA_SRV_AGAIN);
+		if (lsa_tcp_block(ctx->lsc_fd, B_TRUE) == 0)
+			lsa_tcp_put(ctx->lsc_slot, ctx->lsc_fd, B_TRUE);
+		else
+			lsa_srv_close(ctx);
+		ctx->lsc_fd = -1;
+		if (hp->rcode != NOERROR)
+			return (-1);
+		return (lsa_srv_parse(ctx, ctx->lsc_ans, anslen));
+	}
+
+	anslen = lsa_wire_recv(ctx->lsc_fd, ctx->lsc_ans, NS_MAXMSG,
+	    MSG_DONTWAIT);
+	if (anslen < HFIXEDSZ)
+		return (LSA_SRV_AGAIN);
+	if (hp->id != ((const HEADER *)ctx->lsc_query)->id || !hp->qr)
+		return (LSA_SRV_AGAIN);
+	lsa_srv_close(ctx);
 
 	/*
-	 * Get question and answer count.
+	 * A server that doesn't understand EDNS0 may reject the query
+	 * outright; ask it again without.
 	 */
-	nq = ntohs(ansbuf->h.qdcount);
-	na = ntohs(ansbuf->h.ancount);
-	ns = ntohs(ansbuf->h.nscount);
-	nr = ntohs(ansbuf->h.arcount);
-	if (nq != 1 || na < 1)
-		goto  out;
+	if ((hp->rcode == FORMERR || hp->rcode == NOTIMP) &&
+	    ctx->lsc_edns != 0) {
+		ctx->lsc_edns = 0;
+		ctx->lsc_tries--;
+		if (lsa_srv_build(ctx, B_FALSE) != 0 ||
+		    lsa_srv_transmit(ctx) < 0)
+			return (-1);
+		return (LSA_SRV_AGAIN);
+	}
+
+	if (hp->rcode != NOERROR)
+		return (-1);
 
 	/*
-	 * Skip header and question.
+	 * Truncated: ask again over TCP, from the first nameserver.
 	 */
-	ap += HFIXEDSZ;
+	if (hp->tc) {
+		ctx->lsc_state.options |= RES_USEVC;
+		ctx->lsc_tries = 0;
+		return ((lsa_srv_tcp_start(ctx) < 0) ? -1 : LSA_SRV_AGAIN);
+	}
 
-	len = dn_expand(ansbuf->b, eom, ap, namebuf, sizeof (namebuf));
-	if (len < 0)
-		goto out;
+	return (lsa_srv_parse(ctx, ctx->lsc_ans, anslen));
+}
 
-	ap += len + QFIXEDSZ;
+/*
+ * Has the lookup of a target come to an end?  An AAAA record settles it
+ * at once; otherwise it waits for both answers.
+ */
+static boolean_t
+lsa_addrq_done(const lsa_addrq_t *aq)
+{
+	return (aq->aq_found[0] || (aq->aq_done[0] && aq->aq_done[1]));
+}
 
-	/*
-	 * Expand names in answer(s) and insert into RR list.
-	 */
-	for (n = 0; (n < na) && (ap < eom); n++) {
-		sr = malloc(sizeof (srv_rr_t));
-		if (sr == NULL) {
-			lsa_srvlist_destroy(&ctx->lsc_list);
-			goto out;
-		}
+/*
+ * Give the target of a lookup that has come to an end its address.
+ */
+static void
+lsa_addrq_settle(lsa_srv_ctx_t *ctx, lsa_addrq_t *aq)
+{
+	srv_rr_t *sr = &ctx->lsc_srv[aq->aq_srv];
+	int t;
 
-		memset(sr, 0, sizeof (*sr));
+	for (t = 0; t < 2; t++)
+		if (aq->aq_found[t])
+			break;
+	if (t < 2) {
+		sr->addr.sin6_addr = aq->aq_addr[t];
+		lsa_wire_addr(sr->sr_name, &sr->addr.sin6_addr);
+	} else {
+		ctx->lsc_aqfailed = B_TRUE;
+	}
+	ctx->lsc_aqleft--;
+}
 
-		e = lsa_parse_common(ansbuf->b, eom, &ap, sr);
-		if (e == P_ERR_FAIL) {
-			free(sr);
-			lsa_srvlist_destroy(&ctx->lsc_list);
-			goto out;
-		}
-		if (e == P_ERR_SKIP) {
-		  	skip++;
-			free(sr);
-			continue;
+/*
+ * Every nameserver has been tried: settle the lookups still going with
+ * what they have.
+ */
+static void
+lsa_srv_settle(lsa_srv_ctx_t *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->lsc_naq; i++)
+		if (!lsa_addrq_done(&ctx->lsc_aq[i]))
+			lsa_addrq_settle(ctx, &ctx->lsc_aq[i]);
+}
+
+static const uint16_t lsa_addrq_types[] = { T_AAAA, T_A };
+
+/*
+ * Send every address query not yet answered to the next nameserver, on
+ * one socket.  Query i of target j has ID lsc_aqid + 2 * j + i.
+ */
+static int
+lsa_srv_resolve_transmit(lsa_srv_ctx_t *ctx)
+{
+	uchar_t q[NS_PACKETSZ];
+	lsa_addrq_t *aq;
+	int i, t, len;
+
+	if (lsa_srv_udp(ctx, LSA_SRV_ADDR) < 0)
+		return (-1);
+
+	for (i = 0; i < ctx->lsc_naq; i++) {
+		aq = &ctx->lsc_aq[i];
+		for (t = 0; t < 2 && !lsa_addrq_done(aq); t++) {
+			if (aq->aq_done[t])
+				continue;
+			len = res_nmkquery(&ctx->lsc_state, QUERY,
+			    ctx->lsc_srv[aq->aq_srv].sr_name, C_IN,
+			    lsa_addrq_types[t], NULL, 0, NULL, q, sizeof (q));
+			if (len <= 0)
+				goto fail;
+			((HEADER *)q)->id = htons(ctx->lsc_aqid + 2 * i + t);
+			if (lsa_wire_send(ctx->lsc_fd, q, len, 0) != len)
+				goto fail;
 		}
-		lsa_srvlist_insert(&ctx->lsc_list, sr);
 	}
+	return (ctx->lsc_fd);
 
-	/* Return number of records found. */
-	ret = n - skip;
-	if (ret == 0)
-		goto out;
-
-	for (n = 0; (n < (ns + nr)) && (ap < eom); n++) {
-	  	addr_rr_t *ar = malloc(sizeof (addr_rr_t));
-		if (ar == NULL)
-			goto out;
+fail:
+	lsa_srv_close(ctx);
+	return (-1);
+}
 
-		memset(ar, 0, sizeof (*ar));
-		e = lsa_parse_common(ansbuf->b, eom, &ap, ar);
-		if (e == P_ERR_FAIL)
-			goto out;
-		if (e == P_ERR_SKIP) {
-			free(ar);
+/*
+ * Start looking up the targets that had no glue, without waiting: AAAA
+ * and A queries for all of them go out over UDP at once, to one
+ * nameserver at a time, and lsa_srv_resolve_recv() takes the answers.
+ * AAAA is preferred, as with glue.  Returns the descriptor to poll, or 0
+ * if no target needs looking up, when lsa_srv_ready() is true; -1 on
+ * failure.
+ */
+int
+lsa_srv_resolve_send(lsa_srv_ctx_t *ctx)
+{
+	srv_rr_t *sr;
+	int n;
+
+	lsa_srv_close(ctx);
+	ctx->lsc_phase = LSA_SRV_ADDR;
+	ctx->lsc_naq = 0;
+	ctx->lsc_aqleft = 0;
+	ctx->lsc_aqfailed = B_FALSE;
+	ctx->lsc_tries = 0;
+
+	for (n = 0; n < ctx->lsc_nsrv; n++) {
+		sr = &ctx->lsc_srv[n];
+		if (!IN6_IS_ADDR_UNSPECIFIED(&sr->addr.sin6_addr))
 			continue;
-		}
-		/* 
-		 * Do we care about using IPv6 if its available, or
-		 * should we only use it if it's the only one available?
-		 * This currently sets up the next loop to "fall back" to 
-		 * v4-mapped IPv6 if pure IPv6 wasn't provided.
-		 */
-		
-		if (ar->type == AF_INET)
-			list_insert_tail(&la, ar);
-		else
-			list_insert_head(&la, ar);
+		if (lsa_wire_mode == LSA_WIRE_REPLAY &&
+		    lsa_wire_getaddr(sr->sr_name, &sr->addr.sin6_addr) == 0)
+			continue;
+		if (lsa_srv_grow(LSA_ALLOC_CAND, (void **)&ctx->lsc_aq,
+		    &ctx->lsc_aqcap, ctx->lsc_naq + 1,
+		    sizeof (lsa_addrq_t)) != 0)
+			return (-1);
+		(void) memset(&ctx->lsc_aq[ctx->lsc_naq], 0,
+		    sizeof (lsa_addrq_t));
+		ctx->lsc_aq[ctx->lsc_naq++].aq_srv = n;
 	}
-	
-	for (sr = list_head(&ctx->lsc_list); sr != NULL;
-	     sr = list_next(&ctx->lsc_list, sr)) {
-		addr_rr_t *ar = NULL;
-		sr->addr.sin6_family = AF_INET6;
-		sr->addr.sin6_port = htons(LDAP_PORT);
-		for (ar = list_head(&la); ar != NULL; ar = list_next(&la, ar))
-			if (strcmp(sr->sr_name, ar->name) == 0) {
-				sr->addr.sin6_addr = *ar->addr;
-				break;
-			}
-		if (ar == NULL) {
-			struct addrinfo *res = NULL;
-			struct addrinfo ai = {
-				AI_ADDRCONFIG | AI_V4MAPPED, AF_INET6,
-				0, 0, 0, NULL, NULL, NULL
-			};
-			struct sockaddr_in6 sa;
-			if ((getaddrinfo(sr->sr_name, NULL, &ai, &res) != 0)
-			    || (res == NULL)) {
-				ret = -1;
-				goto out;
-			}
-			(void) memcpy(&sa, res->ai_addr, res->ai_addrlen);
-			sr->addr.sin6_addr = sa.sin6_addr;
-			freeaddrinfo(res);
-		}	    
+
+	ctx->lsc_aqleft = ctx->lsc_naq;
+	if (ctx->lsc_naq == 0)
+		return (0);
+	ctx->lsc_aqid = ntohs(((HEADER *)ctx->lsc_query)->id) + 1;
+	return (lsa_srv_resolve_transmit(ctx));
+}
+
+/*
+ * Take the address answers that have arrived.  Returns LSA_SRV_AGAIN
+ * until every target has settled, then 0, or -1 if any could not be
+ * resolved.
+ */
+int
+lsa_srv_resolve_recv(lsa_srv_ctx_t *ctx)
+{
+	uchar_t ans[NS_PACKETSZ];
+	const HEADER *hp = (const HEADER *)ans;
+	lsa_addrq_t *aq;
+	uint16_t i;
+	int len, t;
+
+	while (ctx->lsc_aqleft > 0) {
+		if ((len = lsa_wire_recv(ctx->lsc_fd, ans, sizeof (ans),
+		    MSG_DONTWAIT)) < 0)
+			return (LSA_SRV_AGAIN);
+		if (len < HFIXEDSZ || !hp->qr)
+			continue;
+		i = ntohs(hp->id) - ctx->lsc_aqid;
+		t = i % 2;
+		if ((i /= 2) >= ctx->lsc_naq)
+			continue;
+		aq = &ctx->lsc_aq[i];
+		if (aq->aq_done[t] || lsa_addrq_done(aq))
+			continue;
+		aq->aq_done[t] = B_TRUE;
+		aq->aq_found[t] = (lsa_answer_addr(ans, len,
+		    ctx->lsc_srv[aq->aq_srv].sr_name, lsa_addrq_types[t],
+		    &aq->aq_addr[t]) == 0);
+		if (lsa_addrq_done(aq))
+			lsa_addrq_settle(ctx, aq);
 	}
-		  
-out:
-	free(ansbuf);
-	lsa_addrlist_destroy(&la);
-	list_destroy(&la);
-	return (ret);
+
+	lsa_srv_close(ctx);
+	return (ctx->lsc_aqfailed ? -1 : 0);
 }
 
 lsa_srv_ctx_t *
@@ -404,19 +1614,19 @@ lsa_srv_init(void)
 {
 	lsa_srv_ctx_t *ctx;
 
-	ctx = malloc(sizeof (*ctx));
+	ctx = lsa_malloc(LSA_ALLOC_DNS, sizeof (*ctx));
 	if (ctx == NULL)
 		return (NULL);
 
-	memset(&ctx->lsc_state, 0, sizeof(ctx->lsc_state));
+	memset(ctx, 0, sizeof (*ctx));
+	ctx->lsc_fd = -1;
+	ctx->lsc_slot = -1;
+	ctx->lsc_edns = lsa_srv_edns;
 	if (res_ninit(&ctx->lsc_state) != 0) {
 		free(ctx);
 		return (NULL);
 	}
 
-	list_create(&ctx->lsc_list, sizeof (srv_rr_t),
-	    offsetof(srv_rr_t, sr_node));
-
 	return (ctx);
 }
 
@@ -425,8 +1635,15 @@ lsa_srv_fini(lsa_srv_ctx_t *ctx)
 {
   	if (ctx == NULL)
   		return;
-	lsa_srvlist_destroy(&ctx->lsc_list);
-	list_destroy(&ctx->lsc_list);
+	lsa_srv_close(ctx);
+	(void) pthread_mutex_lock(&lsa_tcp_lock);
+	lsa_tcp_reap(gethrtime());
+	(void) pthread_mutex_unlock(&lsa_tcp_lock);
+	free(ctx->lsc_ans);
+	free(ctx->lsc_srv);
+	free(ctx->lsc_glue);
+	free(ctx->lsc_names);
+	free(ctx->lsc_aq);
 	res_ndestroy(&ctx->lsc_state);
 	free(ctx);
 }
@@ -434,19 +1651,22 @@ lsa_srv_fini(lsa_srv_ctx_t *ctx)
 static void
 lsa_srv_reset(lsa_srv_ctx_t *ctx)
 {
-	list_t *l = &ctx->lsc_list;
-	srv_rr_t *sr;
+	int n;
 
-	for (sr = list_head(l); sr != NULL; sr = list_next(l, sr)) {
-		sr->sr_used = B_FALSE;
-	}
+	for (n = 0; n < ctx->lsc_nsrv; n++)
+		ctx->lsc_srv[n].sr_used = B_FALSE;
+	ctx->lsc_next = 0;
 }
 
+/*
+ * Return the next candidate to try after rr, or the first if rr is NULL.
+ * lsc_next is the lowest index that may still be unused, so a sweep
+ * through the array costs O(1) per call.
+ */
 srv_rr_t *
 lsa_srv_next(lsa_srv_ctx_t *ctx, srv_rr_t *rr)
 {
-	list_t		*l = &ctx->lsc_list;
-	srv_rr_t	*sr, *first = NULL;
+	srv_rr_t	*sr, *first = NULL, *end = ctx->lsc_srv + ctx->lsc_nsrv;
 	uint16_t	pri = 0;
 	uint32_t	sum = 0, r;
 
@@ -460,37 +1680,36 @@ lsa_srv_next(lsa_srv_ctx_t *ctx, srv_rr_t *rr)
 		pri = rr->sr_priority;
 	}
 
-	for (sr = list_head(l); sr != NULL; sr = list_next(l, sr)) {
+	while (ctx->lsc_next < ctx->lsc_nsrv &&
+	    ctx->lsc_srv[ctx->lsc_next].sr_used)
+		ctx->lsc_next++;
+
+	for (sr = ctx->lsc_srv + ctx->lsc_next; sr < end; sr++) {
 		/*
 		 * Skip used and lower-numbered priority records.
 		 */
 		if ((sr->sr_used) || (sr->sr_priority < pri))
 			continue;
 
-		if (sr->sr_priority > pri) {
-			/* 
-			 * Have we seen all of the records with the
-			 * current priority?
-			 */
-			if (first != NULL)
-				break;
-			/* Try the next priority number */
-			first = sr;
-			pri = sr->sr_priority;
-		} else {
-			/*
-			 * Remember the first unused record at this priority.
-			 */
-			if (first == NULL)
-				first = sr;
-		}
-		
 		/*
-		 * Sum the weights at this priority, for randomised selection.
+		 * The array is sorted, so this is the first unused record
+		 * at the lowest remaining priority.
 		 */
-		/*sum += sr->sr_weight;*/
+		first = sr;
+		pri = sr->sr_priority;
+		break;
 	}
 
+	/*
+	 * Sum the weights at this priority, for randomised selection.
+	 */
+	/*
+	for (sr = first; sr != NULL && sr < end && sr->sr_priority == pri;
+	    sr++)
+		if (!sr->sr_used)
+			sum += sr->sr_weight;
+	*/
+
 	/*
 	 * No more records remaining?
 	 */
@@ -514,7 +1733,7 @@ lsa_srv_next(lsa_srv_ctx_t *ctx, srv_rr_t *rr)
 	 * the next selection.
 	 */
 	sum = 0;
-	for (sr = first; sr != NULL; sr = list_next(l, sr)) {
+	for (sr = first; sr < end; sr++) {
 		if (sr->sr_used)
 			continue;
 		/*
@@ -535,5 +1754,5 @@ lsa_srv_next(lsa_srv_ctx_t *ctx, srv_rr_t *rr)
 			break;
 	}
 
-	return (sr);
+	return (sr < end ? sr : NULL);
 }
@@ -16,7 +16,8 @@
 #ifndef _LSA_SRV_H
 #define _LSA_SRV_H
 
-#include <sys/list.h>
+#include <sys/time.h>
+#include <arpa/nameser.h>
 #include <resolv.h>
 
 #define	s6_addr8	_S6_un._S6_u8
@@ -26,39 +27,141 @@
 #define P_ERR_SKIP 1 /* ignored a record - continue parsing */
 #define P_ERR_FAIL -1 /* parsing failed */
 
+#define LSA_SRV_AGAIN -2 /* no answer yet - keep polling */
+
+/*
+ * EDNS0 UDP payload size advertised in SRV queries sent over UDP; 1232
+ * avoids fragmentation on any path with an IPv6-sized MTU.  New contexts
+ * take the value of lsa_srv_edns, and 0 turns EDNS0 off.
+ */
+#define LSA_EDNS_PAYLOAD 1232
+
+extern uint16_t lsa_srv_edns;
+
+/*
+ * A resource record as walked in place; names are offsets into the message.
+ */
+typedef struct lsa_rr
+{
+	int		rr_name;
+	uint16_t	rr_type;
+	uint16_t	rr_class;
+	uint32_t	rr_ttl;
+	uint16_t	rr_rdlen;
+	const uchar_t	*rr_rdata;
+} lsa_rr_t;
+
 typedef struct addr_rr
 {
-	list_node_t	addr_node;
-	char		*name;
-	in6_addr_t	*addr;
-	int		type;
+	int		ar_name;	/* owner name offset in message */
+	int		ar_canon;	/* offset of its first label */
+	int		ar_type;
+	in6_addr_t	ar_addr;
 } addr_rr_t;
 
+/*
+ * One SRV candidate.  Candidates live in a single array in the context,
+ * sorted by priority then weight; sr_name points into the context's
+ * name table and is valid until the next parse.
+ */
 typedef struct srv_rr
 {
-	list_node_t	sr_node;
-	boolean_t	sr_used;
-	char		*sr_name;
-	uint16_t	sr_port;
 	uint16_t	sr_priority;
 	uint16_t	sr_weight;
+	uint16_t	sr_port;
+	boolean_t	sr_used;
+	hrtime_t	sr_pinged;	/* when the locator pinged it */
+	boolean_t	sr_replied;	/* and it answered */
+	boolean_t	sr_failed;	/* the caller gave up on it */
+	int		sr_nameoff;	/* offset into lsc_names */
+	const char	*sr_name;
 	struct sockaddr_in6 addr;
 } srv_rr_t;
 
+/*
+ * What a context's descriptor is waiting on, between lsa_srv_send() and
+ * the last of its answers.
+ */
+typedef enum lsa_srv_phase
+{
+	LSA_SRV_UDP = 0,	/* the SRV answer */
+	LSA_SRV_TCP,		/* the SRV answer, requeried over TCP */
+	LSA_SRV_ADDR		/* addresses of targets without glue */
+} lsa_srv_phase_t;
+
+/*
+ * The AAAA and A queries for one target without glue; [0] is AAAA.
+ */
+typedef struct lsa_addrq
+{
+	int		aq_srv;		/* index of the candidate */
+	boolean_t	aq_done[2];	/* answered */
+	boolean_t	aq_found[2];	/* with an address */
+	in6_addr_t	aq_addr[2];
+} lsa_addrq_t;
+
 typedef struct lsa_srv_ctx
 {
 	struct __res_state	lsc_state;
-	list_t			lsc_list;
+	srv_rr_t		*lsc_srv;	/* candidates, sorted */
+	int			lsc_nsrv;
+	int			lsc_srvcap;
+	int			lsc_next;	/* lowest maybe-unused index */
+	addr_rr_t		*lsc_glue;	/* scratch for parsing */
+	int			lsc_gluecap;
+	char			*lsc_names;	/* expanded target names */
+	int			lsc_namecap;
+	uint16_t		lsc_edns;	/* EDNS0 payload, 0 for none */
+	int			lsc_fd;		/* non-blocking query */
+	short			lsc_events;	/* to poll lsc_fd for */
+	lsa_srv_phase_t		lsc_phase;
+	int			lsc_tries;
+	hrtime_t		lsc_deadline;
+	hrtime_t		lsc_limit;	/* give up then, 0 for never */
+	int			lsc_mapped;	/* static map answer, unread */
+	int			lsc_qlen;
+	uchar_t			lsc_query[NS_PACKETSZ];
+	char			lsc_qname[NS_MAXDNAME];
+	uchar_t			*lsc_ans;
+	int			lsc_slot;	/* TCP: pool entry, or -1 */
+	boolean_t		lsc_reused;	/* TCP: pooled connection */
+	boolean_t		lsc_connecting;	/* TCP: not connected yet */
+	int			lsc_got;	/* TCP: bytes of answer read */
+	uchar_t			lsc_lenbuf[NS_INT16SZ];
+	lsa_addrq_t		*lsc_aq;	/* ADDR: targets to resolve */
+	int			lsc_naq;
+	int			lsc_aqcap;
+	int			lsc_aqleft;	/* ADDR: not settled yet */
+	boolean_t		lsc_aqfailed;	/* ADDR: one did not resolve */
+	uint16_t		lsc_aqid;	/* ADDR: first query's ID */
 } lsa_srv_ctx_t;
 
-void lsa_srvlist_sort(lsa_srv_ctx_t *ctx);
-
 lsa_srv_ctx_t *lsa_srv_init(void);
 
 void lsa_srv_fini(lsa_srv_ctx_t *);
 
 int lsa_srv_lookup(lsa_srv_ctx_t *, const char *, const char *);
 
+int lsa_srv_query(lsa_srv_ctx_t *, const char *, const char *, uchar_t *, int);
+
+int lsa_srv_parse(lsa_srv_ctx_t *, const uchar_t *, int);
+
+int lsa_srv_resolve(lsa_srv_ctx_t *);
+
+int lsa_srv_send(lsa_srv_ctx_t *, const char *, const char *);
+
+int lsa_srv_recv(lsa_srv_ctx_t *);
+
+int lsa_srv_resolve_send(lsa_srv_ctx_t *);
+
+int lsa_srv_resolve_recv(lsa_srv_ctx_t *);
+
+int lsa_srv_retry(lsa_srv_ctx_t *);
+
+hrtime_t lsa_srv_deadline(lsa_srv_ctx_t *);
+
+boolean_t lsa_srv_ready(lsa_srv_ctx_t *);
+
 srv_rr_t *lsa_srv_next(lsa_srv_ctx_t *, srv_rr_t *);
 
 #endif /* _LSA_SRV_H */
@@ -0,0 +1,368 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Survey of the DCs of a domain or forest.
+ *
+ * For every name given and every prefix (-p, repeatable; by default
+ * _ldap._tcp.dc._msdcs and _ldap._tcp.gc._msdcs), a DCL_F_SURVEY locate
+ * pings all the SRV targets at once.  The locates all run together from
+ * one poll() loop, so the survey takes an SRV round trip and a ping round
+ * trip, or -t milliseconds (1000 by default) if a DC stays silent.  The
+ * GC records of a forest's root domain list the global catalogs of every
+ * domain in the forest; name the other domains as well to reach their DCs
+ * that are not GCs.  -h loads a static SRV map.
+ *
+ * The report has one JSON object per line for each DC, listed once
+ * however many SRV names it appeared under, giving its SRV data, whether
+ * it answered and in what time, and everything its NetLogon reply said:
+ * names, site, Flags and the roles they stand for, DomainGuid and so on.
+ * A summary goes to stderr.  The exit status is 0 if any DC answered.
+ *
+ *	./lsa_survey [-t msec] [-h hosts] [-p prefix]... name...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dc_locate.h"
+#include "lsa_hosts.h"
+
+#define	SURVEY_MSEC	((double)NANOSEC / MILLISEC)
+#define	SURVEY_MAX	64	/* locates, one bit each in sr_srv */
+
+/*
+ * One DC of the report, and the SRV names it was found under.
+ */
+typedef struct survey_row {
+	dc_survey_t	sr_ds;
+	uint64_t	sr_srv;
+} survey_row_t;
+
+typedef struct survey_locate {
+	const char		*sl_prefix;
+	const char		*sl_name;
+	dc_locate_handle_t	*sl_dh;
+	int			sl_status;	/* DCL_STEP_* */
+	int			sl_pfd;		/* its first pollfd */
+	int			sl_npfd;
+} survey_locate_t;
+
+static const struct {
+	unsigned long	sf_flag;
+	const char	*sf_role;
+} survey_flags[] = {
+	{ DS_PDC_FLAG,			"pdc" },
+	{ DS_GC_FLAG,			"gc" },
+	{ DS_LDAP_FLAG,			"ldap" },
+	{ DS_DS_FLAG,			"ds" },
+	{ DS_KDC_FLAG,			"kdc" },
+	{ DS_TIMESERV_FLAG,		"timeserv" },
+	{ DS_CLOSEST_FLAG,		"closest" },
+	{ DS_WRITABLE_FLAG,		"writable" },
+	{ DS_GOOD_TIMESERV_FLAG,	"good_timeserv" },
+	{ DS_NDNC_FLAG,			"ndnc" },
+	{ DS_SELECT_SECRET_DOMAIN_6_FLAG, "rodc" },
+	{ DS_FULL_SECRET_DOMAIN_6_FLAG,	"full_secret" }
+};
+
+static survey_row_t *survey_rows;
+static int survey_nrows;
+static int survey_cap;
+
+/*
+ * Add what one locate found to the report.  The rows take over the
+ * entries' replies.
+ */
+static int
+survey_merge(dc_survey_t *all, int n, int bit)
+{
+	survey_row_t *row;
+	dc_survey_t *ds;
+	boolean_t byname;
+	int i, r;
+
+	for (i = 0; i < n; i++) {
+		ds = &all[i];
+		byname = IN6_IS_ADDR_UNSPECIFIED(&ds->ds_addr.sin6_addr);
+		for (r = 0; r < survey_nrows; r++) {
+			row = &survey_rows[r];
+			if (IN6_ARE_ADDR_EQUAL(&row->sr_ds.ds_addr.sin6_addr,
+			    &ds->ds_addr.sin6_addr) && (!byname ||
+			    strcasecmp(row->sr_ds.ds_name, ds->ds_name) == 0))
+				break;
+		}
+
+		if (r == survey_nrows) {
+			if (survey_nrows == survey_cap) {
+				survey_cap = (survey_cap == 0) ? 64 :
+				    survey_cap * 2;
+				if ((row = realloc(survey_rows, survey_cap *
+				    sizeof (*row))) == NULL)
+					return (-1);
+				survey_rows = row;
+			}
+			row = &survey_rows[survey_nrows++];
+			row->sr_ds = *ds;
+			row->sr_srv = 0;
+			ds->ds_dci = NULL;
+		} else if (row->sr_ds.ds_dci == NULL && ds->ds_dci != NULL) {
+			row->sr_ds.ds_dci = ds->ds_dci;
+			row->sr_ds.ds_rtt = ds->ds_rtt;
+			row->sr_ds.ds_ex = ds->ds_ex;
+			row->sr_ds.ds_pinged = B_TRUE;
+			ds->ds_dci = NULL;
+		}
+		if (row->sr_ds.ds_name[0] == '\0')
+			(void) strlcpy(row->sr_ds.ds_name, ds->ds_name,
+			    sizeof (row->sr_ds.ds_name));
+		if (ds->ds_name[0] != '\0')
+			row->sr_srv |= 1ULL << bit;
+	}
+
+	return (0);
+}
+
+/*
+ * Print a JSON string, or null.
+ */
+static void
+survey_str(const char *key, const char *s)
+{
+	printf(",\"%s\":", key);
+	if (s == NULL) {
+		printf("null");
+		return;
+	}
+
+	(void) putchar('"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", (unsigned char)*s);
+		else
+			(void) putchar(*s);
+	}
+	(void) putchar('"');
+}
+
+static void
+survey_addr(const char *key, const struct sockaddr_in6 *sin6)
+{
+	char buf[INET6_ADDRSTRLEN];
+	struct in_addr in;
+
+	if (sin6->sin6_family != AF_INET6 ||
+	    IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr)) {
+		survey_str(key, NULL);
+		return;
+	}
+	if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+		IN6_V4MAPPED_TO_INADDR(&sin6->sin6_addr, &in);
+		(void) inet_ntop(AF_INET, &in, buf, sizeof (buf));
+	} else {
+		(void) inet_ntop(AF_INET6, &sin6->sin6_addr, buf, sizeof (buf));
+	}
+	survey_str(key, buf);
+}
+
+static void
+survey_print(const survey_row_t *row, const survey_locate_t *sl, int nsl)
+{
+	const dc_survey_t *ds = &row->sr_ds;
+	const DOMAIN_CONTROLLER_INFO *dci = ds->ds_dci;
+	const uint8_t *g;
+	char guid[40];
+	const char *sep = "";
+	int i;
+
+	printf("{\"answered\":%s", (dci != NULL) ? "true" : "false");
+	survey_str("target", (ds->ds_name[0] != '\0') ? ds->ds_name : NULL);
+	survey_addr("addr", &ds->ds_addr);
+	printf(",\"port\":%u,\"priority\":%u,\"weight\":%u,\"pinged\":%s",
+	    ds->ds_port, ds->ds_priority, ds->ds_weight,
+	    ds->ds_pinged ? "true" : "false");
+	printf(",\"srv\":[");
+	for (i = 0; i < nsl; i++) {
+		if ((row->sr_srv & (1ULL << i)) == 0)
+			continue;
+		printf("%s\"%s.%s\"", sep, sl[i].sl_prefix, sl[i].sl_name);
+		sep = ",";
+	}
+	printf("]");
+
+	if (dci == NULL) {
+		printf("}\n");
+		return;
+	}
+
+	if (ds->ds_rtt != 0)
+		printf(",\"rtt_ms\":%.3f", ds->ds_rtt / SURVEY_MSEC);
+	survey_str("dc", (dci->DomainControllerName != NULL) ?
+	    dci->DomainControllerName + 2 : NULL);
+	survey_str("netbios_name", ds->ds_ex.lce_nbname);
+	survey_addr("dc_addr", &ds->ds_ex.lce_addr);
+	survey_str("domain", dci->DomainName);
+	survey_str("netbios_domain", ds->ds_ex.lce_nbdomain);
+	survey_str("forest", dci->DnsForestName);
+	g = dci->DomainGuid;
+	(void) snprintf(guid, sizeof (guid), "%08x-%04x-%04x-%02x%02x-"
+	    "%02x%02x%02x%02x%02x%02x",
+	    g[0] | g[1] << 8 | g[2] << 16 | (uint32_t)g[3] << 24,
+	    g[4] | g[5] << 8, g[6] | g[7] << 8, g[8], g[9], g[10], g[11],
+	    g[12], g[13], g[14], g[15]);
+	survey_str("domain_guid", guid);
+	survey_str("dc_site", dci->DcSiteName);
+	survey_str("client_site", dci->ClientSiteName);
+	survey_str("next_closest_site", (ds->ds_ex.lce_nextsite[0] != '\0') ?
+	    ds->ds_ex.lce_nextsite : NULL);
+	printf(",\"flags\":%lu,\"roles\":[", dci->Flags);
+	for (i = 0, sep = ""; i < sizeof (survey_flags) /
+	    sizeof (survey_flags[0]); i++) {
+		if ((dci->Flags & survey_flags[i].sf_flag) == 0)
+			continue;
+		printf("%s\"%s\"", sep, survey_flags[i].sf_role);
+		sep = ",";
+	}
+	printf("],\"opcode\":%u,\"nt_version\":%" PRIu32 "}\n",
+	    ds->ds_ex.lce_opcode, ds->ds_ex.lce_dcver);
+}
+
+static void
+survey_usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t msec] [-h hosts] [-p prefix]... "
+	    "name...\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *prefix[SURVEY_MAX];
+	survey_locate_t sl[SURVEY_MAX];
+	struct pollfd pfd[SURVEY_MAX * DCL_MAXFDS];
+	dc_survey_t *all;
+	hrtime_t start, deadline;
+	int c, i, j, n, npfd, nprefix = 0, nsl = 0, timeout, t, running;
+	int answered = 0;
+	double msec = 1000;
+
+	while ((c = getopt(argc, argv, "h:p:t:")) != -1) {
+		switch (c) {
+		case 'h':
+			if (lsa_hosts_load(optarg) != 0) {
+				perror(optarg);
+				return (2);
+			}
+			break;
+		case 'p':
+			if (nprefix == SURVEY_MAX) {
+				survey_usage(argv[0]);
+				return (2);
+			}
+			prefix[nprefix++] = optarg;
+			break;
+		case 't':
+			msec = atof(optarg);
+			break;
+		default:
+			survey_usage(argv[0]);
+			return (2);
+		}
+	}
+	if (nprefix == 0) {
+		prefix[nprefix++] = "_ldap._tcp.dc._msdcs";
+		prefix[nprefix++] = "_ldap._tcp.gc._msdcs";
+	}
+	if (optind == argc || msec <= 0 ||
+	    nprefix * (argc - optind) > SURVEY_MAX) {
+		survey_usage(argv[0]);
+		return (2);
+	}
+
+	start = gethrtime();
+	deadline = start + (hrtime_t)(msec * SURVEY_MSEC);
+	for (i = optind; i < argc; i++) {
+		for (j = 0; j < nprefix; j++, nsl++) {
+			sl[nsl].sl_prefix = prefix[j];
+			sl[nsl].sl_name = argv[i];
+			sl[nsl].sl_dh = dc_locate_start(prefix[j], argv[i],
+			    NULL, DCL_F_SURVEY, deadline);
+			sl[nsl].sl_status = (sl[nsl].sl_dh != NULL) ?
+			    DCL_STEP_AGAIN : DCL_STEP_FAIL;
+		}
+	}
+
+	for (;;) {
+		npfd = running = 0;
+		timeout = -1;
+		for (i = 0; i < nsl; i++) {
+			sl[i].sl_npfd = 0;
+			if (sl[i].sl_status != DCL_STEP_AGAIN)
+				continue;
+			sl[i].sl_pfd = npfd;
+			sl[i].sl_npfd = dc_locate_pollfds(sl[i].sl_dh,
+			    &pfd[npfd], DCL_MAXFDS, &t);
+			npfd += sl[i].sl_npfd;
+			if (timeout < 0 || t < timeout)
+				timeout = t;
+			running++;
+		}
+		if (running == 0)
+			break;
+
+		if (poll(pfd, npfd, timeout) < 0)
+			for (i = 0; i < nsl; i++)
+				sl[i].sl_npfd = 0;
+		for (i = 0; i < nsl; i++)
+			if (sl[i].sl_status == DCL_STEP_AGAIN)
+				sl[i].sl_status = dc_locate_step(sl[i].sl_dh,
+				    &pfd[sl[i].sl_pfd], sl[i].sl_npfd);
+	}
+
+	for (i = 0; i < nsl; i++) {
+		if (sl[i].sl_dh == NULL)
+			continue;
+		all = dc_locate_survey(sl[i].sl_dh, &n);
+		if (survey_merge(all, n, i) != 0) {
+			fprintf(stderr, "lsa_survey: out of memory\n");
+			return (2);
+		}
+		dc_locate_freesurvey(all, n);
+		dc_locate_cancel(sl[i].sl_dh);
+	}
+
+	for (i = 0; i < survey_nrows; i++) {
+		survey_print(&survey_rows[i], sl, nsl);
+		if (survey_rows[i].sr_ds.ds_dci != NULL)
+			answered++;
+	}
+	fprintf(stderr, "%d DCs, %d answered, %d silent, %.1f ms\n",
+	    survey_nrows, answered, survey_nrows - answered,
+	    (gethrtime() - start) / SURVEY_MSEC);
+
+	for (i = 0; i < survey_nrows; i++)
+		freedci(survey_rows[i].sr_ds.ds_dci);
+	free(survey_rows);
+	return ((answered > 0) ? 0 : 1);
+}
@@ -0,0 +1,974 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Capture and replay of DNS and CLDAP traffic; see lsa_wire.h.
+ *
+ * A replay gives each socket the locator opens one end of a socketpair
+ * and keeps the other.  Sends are matched against the trace instead of
+ * going out, and the recorded answers are written to the trace's end,
+ * where poll() sees them like any other answer.  Datagrams carry the
+ * address they came from in front of the data, since an AF_UNIX socket
+ * can't report it.  With the original timing, a thread writes each
+ * answer when its recorded delay has passed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include "lsa_wire.h"
+
+lsa_wire_mode_t lsa_wire_mode = LSA_WIRE_OFF;
+
+static pthread_mutex_t lsa_wire_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lsa_wire_cv = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Capture.
+ */
+static FILE *lsa_wire_fp;
+static hrtime_t lsa_wire_start;
+
+/*
+ * Replay: the loaded trace, with each query or ping linked to its answer.
+ */
+typedef struct lsa_wire_ent {
+	lsa_wire_rec_t	lwe_rec;
+	uchar_t		*lwe_data;
+	int		lwe_answer;	/* index of the answer, or -1 */
+	boolean_t	lwe_used;
+} lsa_wire_ent_t;
+
+static lsa_wire_ent_t *lsa_wire_ents;
+static int lsa_wire_nents;
+static boolean_t lsa_wire_realtime;
+
+/*
+ * Replay: the sockets handed out, and the trace's end of each.
+ */
+#define	LSA_WIRE_MAXFD	64
+
+typedef struct lsa_wire_fd {
+	int			lwf_fd;		/* -1 if free */
+	int			lwf_peer;
+	int			lwf_type;
+	struct sockaddr_in6	lwf_addr;	/* connected to */
+} lsa_wire_fd_t;
+
+static lsa_wire_fd_t lsa_wire_fds[LSA_WIRE_MAXFD];
+
+/*
+ * Replay: answers waiting for their time, soonest first.
+ */
+typedef struct lsa_wire_due {
+	struct lsa_wire_due	*lwd_next;
+	hrtime_t		lwd_when;
+	int			lwd_fd;
+	size_t			lwd_len;
+	uchar_t			lwd_buf[1];
+} lsa_wire_due_t;
+
+static lsa_wire_due_t *lsa_wire_queue;
+static pthread_t lsa_wire_thread;
+static boolean_t lsa_wire_running;
+
+static void
+lsa_wire_sa6(const struct sockaddr *sa, struct sockaddr_in6 *sin6)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+	uint32_t *a6 = (uint32_t *)&sin6->sin6_addr;
+
+	(void) memset(sin6, 0, sizeof (*sin6));
+	if (sa == NULL)
+		return;
+	if (sa->sa_family == AF_INET6) {
+		(void) memcpy(sin6, sa, sizeof (*sin6));
+	} else if (sa->sa_family == AF_INET) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = sin->sin_port;
+		a6[2] = htonl(0xffff);
+		a6[3] = sin->sin_addr.s_addr;
+	}
+}
+
+static void
+lsa_wire_put(lsa_wire_kind_t kind, uint32_t flags,
+    const struct sockaddr_in6 *peer, const void *data, size_t len)
+{
+	lsa_wire_rec_t rec;
+
+	(void) memset(&rec, 0, sizeof (rec));
+	rec.ltr_kind = kind;
+	rec.ltr_len = MIN(len, UINT16_MAX);
+	rec.ltr_flags = flags;
+	if (peer != NULL)
+		rec.ltr_peer = *peer;
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	if (lsa_wire_fp != NULL) {
+		rec.ltr_time = gethrtime() - lsa_wire_start;
+		(void) fwrite(&rec, sizeof (rec), 1, lsa_wire_fp);
+		(void) fwrite(data, 1, rec.ltr_len, lsa_wire_fp);
+	}
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+}
+
+/*
+ * Capture a message on a socket, with the address it is connected to.
+ * What goes through a stream is only captured when noted as a whole.
+ */
+static void
+lsa_wire_put_fd(int fd, lsa_wire_kind_t kind, const void *data, size_t len,
+    boolean_t noted)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in6 peer;
+	socklen_t sslen = sizeof (ss);
+	int type = SOCK_DGRAM;
+
+	(void) memset(&ss, 0, sizeof (ss));
+	(void) getpeername(fd, (struct sockaddr *)&ss, &sslen);
+	lsa_wire_sa6((struct sockaddr *)&ss, &peer);
+	sslen = sizeof (type);
+	(void) getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &sslen);
+	if (type == SOCK_STREAM && !noted)
+		return;
+
+	lsa_wire_put(kind, (type == SOCK_STREAM) ? LSA_WIRE_TCP : 0, &peer,
+	    data, len);
+}
+
+static lsa_wire_fd_t *
+lsa_wire_fd(int fd)
+{
+	int i;
+
+	for (i = 0; i < LSA_WIRE_MAXFD; i++)
+		if (lsa_wire_fds[i].lwf_fd == fd)
+			return (&lsa_wire_fds[i]);
+	return (NULL);
+}
+
+/*
+ * Write an answer to the trace's end of a socket.  Called with the lock
+ * held, so the socket can't be closed under us.
+ */
+static void
+lsa_wire_push(int fd, const uchar_t *buf, size_t len)
+{
+	lsa_wire_fd_t *lwf;
+
+	if (fd < 0 || (lwf = lsa_wire_fd(fd)) == NULL)
+		return;
+	(void) send(lwf->lwf_peer, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+ * Send the answer to fd, prefixed by hdr, after delay.
+ */
+static void
+lsa_wire_answer(int fd, hrtime_t delay, const void *hdr, size_t hlen,
+    const void *data, size_t len)
+{
+	lsa_wire_due_t *lwd, **pp;
+
+	if ((lwd = malloc(sizeof (*lwd) + hlen + len)) == NULL)
+		return;
+	lwd->lwd_when = gethrtime() + delay;
+	lwd->lwd_fd = fd;
+	lwd->lwd_len = hlen + len;
+	(void) memcpy(lwd->lwd_buf, hdr, hlen);
+	(void) memcpy(lwd->lwd_buf + hlen, data, len);
+
+	if (delay <= 0 || !lsa_wire_running) {
+		lsa_wire_push(fd, lwd->lwd_buf, lwd->lwd_len);
+		free(lwd);
+		return;
+	}
+
+	for (pp = &lsa_wire_queue; *pp != NULL; pp = &(*pp)->lwd_next)
+		if ((*pp)->lwd_when > lwd->lwd_when)
+			break;
+	lwd->lwd_next = *pp;
+	*pp = lwd;
+	(void) pthread_cond_signal(&lsa_wire_cv);
+}
+
+static void *
+lsa_wire_run(void *arg)
+{
+	lsa_wire_due_t *lwd;
+	struct timespec ts;
+	hrtime_t wait;
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	while (lsa_wire_running) {
+		if ((lwd = lsa_wire_queue) == NULL) {
+			(void) pthread_cond_wait(&lsa_wire_cv, &lsa_wire_lock);
+			continue;
+		}
+		if ((wait = lwd->lwd_when - gethrtime()) > 0) {
+			(void) clock_gettime(CLOCK_REALTIME, &ts);
+			wait += ts.tv_nsec;
+			ts.tv_sec += wait / NANOSEC;
+			ts.tv_nsec = wait % NANOSEC;
+			(void) pthread_cond_timedwait(&lsa_wire_cv,
+			    &lsa_wire_lock, &ts);
+			continue;
+		}
+		lsa_wire_queue = lwd->lwd_next;
+		lsa_wire_push(lwd->lwd_fd, lwd->lwd_buf, lwd->lwd_len);
+		free(lwd);
+	}
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+
+	return (arg);
+}
+
+/*
+ * Find the question of a DNS message: the name and the type and class
+ * after it.  Queries are never compressed.
+ */
+static const uchar_t *
+lsa_wire_question(const uchar_t *msg, size_t len, size_t *qlen)
+{
+	const uchar_t *cp = msg + HFIXEDSZ, *eom = msg + len;
+
+	if (len < HFIXEDSZ)
+		return (NULL);
+	while (cp < eom && *cp != 0) {
+		if ((*cp & NS_CMPRSFLGS) != 0)
+			return (NULL);
+		cp += *cp + 1;
+	}
+	if (cp + 1 + QFIXEDSZ > eom)
+		return (NULL);
+	*qlen = cp + 1 + QFIXEDSZ - (msg + HFIXEDSZ);
+	return (msg + HFIXEDSZ);
+}
+
+static boolean_t
+lsa_wire_same_question(const uchar_t *a, size_t alen, const uchar_t *b,
+    size_t blen)
+{
+	size_t i;
+
+	if (alen != blen)
+		return (B_FALSE);
+	for (i = 0; i < alen - QFIXEDSZ; i++)
+		if (tolower(a[i]) != tolower(b[i]))
+			return (B_FALSE);
+	return (memcmp(a + i, b + i, QFIXEDSZ) == 0);
+}
+
+/*
+ * Answer a DNS query sent on fd the way the trace says it was.
+ */
+static void
+lsa_wire_dns(lsa_wire_fd_t *lwf, const uchar_t *msg, size_t len)
+{
+	uint32_t flags = (lwf->lwf_type == SOCK_STREAM) ? LSA_WIRE_TCP : 0;
+	const uchar_t *q, *rq;
+	lsa_wire_ent_t *ent, *ans;
+	size_t qlen, rqlen;
+	uchar_t hdr[sizeof (struct sockaddr_in6)], *cp;
+	uchar_t *copy;
+	int i;
+
+	if ((q = lsa_wire_question(msg, len, &qlen)) == NULL)
+		return;
+
+	for (i = 0; i < lsa_wire_nents; i++) {
+		ent = &lsa_wire_ents[i];
+		if (ent->lwe_used || ent->lwe_rec.ltr_kind !=
+		    LSA_WIRE_DNS_QUERY || ent->lwe_rec.ltr_flags != flags)
+			continue;
+		rq = lsa_wire_question(ent->lwe_data, ent->lwe_rec.ltr_len,
+		    &rqlen);
+		if (rq != NULL && lsa_wire_same_question(q, qlen, rq, rqlen))
+			break;
+	}
+	if (i == lsa_wire_nents)
+		return;
+	ent->lwe_used = B_TRUE;
+	if (ent->lwe_answer < 0)
+		return;
+	ans = &lsa_wire_ents[ent->lwe_answer];
+	if (ans->lwe_rec.ltr_len < HFIXEDSZ ||
+	    (copy = malloc(ans->lwe_rec.ltr_len)) == NULL)
+		return;
+
+	/*
+	 * The answer has to carry the ID of this query, not the recorded one.
+	 */
+	(void) memcpy(copy, ans->lwe_data, ans->lwe_rec.ltr_len);
+	(void) memcpy(copy, msg, NS_INT16SZ);
+	if (flags & LSA_WIRE_TCP) {
+		cp = hdr;
+		NS_PUT16(ans->lwe_rec.ltr_len, cp);
+	} else {
+		(void) memcpy(hdr, &lwf->lwf_addr, sizeof (lwf->lwf_addr));
+		cp = hdr + sizeof (lwf->lwf_addr);
+	}
+	lsa_wire_answer(lwf->lwf_fd, lsa_wire_realtime ?
+	    ans->lwe_rec.ltr_time - ent->lwe_rec.ltr_time : 0, hdr, cp - hdr,
+	    copy, ans->lwe_rec.ltr_len);
+	free(copy);
+}
+
+/*
+ * Answer a ping to a DC the way the trace says it was.
+ */
+static void
+lsa_wire_ping(lsa_wire_fd_t *lwf, const struct sockaddr_in6 *dst)
+{
+	lsa_wire_ent_t *ent, *ans;
+	int i;
+
+	for (i = 0; i < lsa_wire_nents; i++) {
+		ent = &lsa_wire_ents[i];
+		if (!ent->lwe_used && ent->lwe_rec.ltr_kind == LSA_WIRE_PING &&
+		    IN6_ARE_ADDR_EQUAL(&ent->lwe_rec.ltr_peer.sin6_addr,
+		    &dst->sin6_addr))
+			break;
+	}
+	if (i == lsa_wire_nents)
+		return;
+	ent->lwe_used = B_TRUE;
+	if (ent->lwe_answer < 0)
+		return;
+	ans = &lsa_wire_ents[ent->lwe_answer];
+	lsa_wire_answer(lwf->lwf_fd, lsa_wire_realtime ?
+	    ans->lwe_rec.ltr_time - ent->lwe_rec.ltr_time : 0,
+	    &ans->lwe_rec.ltr_peer, sizeof (ans->lwe_rec.ltr_peer),
+	    ans->lwe_data, ans->lwe_rec.ltr_len);
+}
+
+/*
+ * Whether a DNS answer in the trace is the one to a query: it has the
+ * same ID and question and came over the same transport from the same
+ * server.  IDs alone are not enough, since every pipeline on a TCP
+ * connection numbers its queries from 0.
+ */
+static boolean_t
+lsa_wire_answers(const lsa_wire_ent_t *q, const lsa_wire_ent_t *a)
+{
+	const uchar_t *qq, *aq;
+	size_t qqlen, aqlen;
+
+	if (a->lwe_rec.ltr_flags != q->lwe_rec.ltr_flags ||
+	    a->lwe_rec.ltr_peer.sin6_port != q->lwe_rec.ltr_peer.sin6_port ||
+	    !IN6_ARE_ADDR_EQUAL(&a->lwe_rec.ltr_peer.sin6_addr,
+	    &q->lwe_rec.ltr_peer.sin6_addr))
+		return (B_FALSE);
+	if (a->lwe_rec.ltr_len < NS_INT16SZ ||
+	    q->lwe_rec.ltr_len < NS_INT16SZ ||
+	    memcmp(a->lwe_data, q->lwe_data, NS_INT16SZ) != 0)
+		return (B_FALSE);
+	qq = lsa_wire_question(q->lwe_data, q->lwe_rec.ltr_len, &qqlen);
+	aq = lsa_wire_question(a->lwe_data, a->lwe_rec.ltr_len, &aqlen);
+	return (qq != NULL && aq != NULL &&
+	    lsa_wire_same_question(qq, qqlen, aq, aqlen));
+}
+
+/*
+ * Link every query and ping in the trace to the first answer after it
+ * that is not already taken: a DNS answer as lsa_wire_answers() has it,
+ * or a reply from the same address.
+ */
+static void
+lsa_wire_link(void)
+{
+	lsa_wire_ent_t *q, *a;
+	boolean_t *taken;
+	int i, j;
+
+	if ((taken = calloc(lsa_wire_nents + 1, sizeof (boolean_t))) == NULL)
+		return;
+
+	for (i = 0; i < lsa_wire_nents; i++) {
+		q = &lsa_wire_ents[i];
+		q->lwe_answer = -1;
+		if (q->lwe_rec.ltr_kind != LSA_WIRE_DNS_QUERY &&
+		    q->lwe_rec.ltr_kind != LSA_WIRE_PING)
+			continue;
+		for (j = i + 1; j < lsa_wire_nents; j++) {
+			a = &lsa_wire_ents[j];
+			if (taken[j])
+				continue;
+			if (q->lwe_rec.ltr_kind == LSA_WIRE_DNS_QUERY &&
+			    a->lwe_rec.ltr_kind == LSA_WIRE_DNS_ANSWER &&
+			    lsa_wire_answers(q, a))
+				break;
+			if (q->lwe_rec.ltr_kind == LSA_WIRE_PING &&
+			    a->lwe_rec.ltr_kind == LSA_WIRE_REPLY &&
+			    IN6_ARE_ADDR_EQUAL(&a->lwe_rec.ltr_peer.sin6_addr,
+			    &q->lwe_rec.ltr_peer.sin6_addr))
+				break;
+		}
+		if (j < lsa_wire_nents) {
+			taken[j] = B_TRUE;
+			q->lwe_answer = j;
+		}
+	}
+
+	free(taken);
+}
+
+static void
+lsa_wire_unload(void)
+{
+	int i;
+
+	for (i = 0; i < lsa_wire_nents; i++)
+		free(lsa_wire_ents[i].lwe_data);
+	free(lsa_wire_ents);
+	lsa_wire_ents = NULL;
+	lsa_wire_nents = 0;
+}
+
+static void
+lsa_wire_reset(void)
+{
+	lsa_wire_due_t *lwd;
+	int i;
+
+	for (i = 0; i < LSA_WIRE_MAXFD; i++) {
+		if (lsa_wire_fds[i].lwf_fd >= 0)
+			(void) close(lsa_wire_fds[i].lwf_peer);
+		lsa_wire_fds[i].lwf_fd = -1;
+	}
+	while ((lwd = lsa_wire_queue) != NULL) {
+		lsa_wire_queue = lwd->lwd_next;
+		free(lwd);
+	}
+	lsa_wire_unload();
+}
+
+/*
+ * Open a trace file for reading and check its header.
+ */
+FILE *
+lsa_wire_open(const char *path)
+{
+	char magic[LSA_WIRE_MAGICSZ];
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (NULL);
+	if (fread(magic, 1, sizeof (magic), fp) != sizeof (magic) ||
+	    memcmp(magic, LSA_WIRE_MAGIC, sizeof (magic)) != 0) {
+		(void) fclose(fp);
+		return (NULL);
+	}
+	return (fp);
+}
+
+/*
+ * Read the next record and its data, which must fit in len bytes.
+ * Returns 1, 0 at the end of the trace, or -1 if it is damaged.
+ */
+int
+lsa_wire_read(FILE *fp, lsa_wire_rec_t *rec, uchar_t *data, size_t len)
+{
+	if (fread(rec, sizeof (*rec), 1, fp) != 1)
+		return (feof(fp) ? 0 : -1);
+	if (rec->ltr_len > len ||
+	    fread(data, 1, rec->ltr_len, fp) != rec->ltr_len)
+		return (-1);
+	return (1);
+}
+
+/*
+ * Start capturing to a new trace file.
+ */
+int
+lsa_wire_capture(const char *path)
+{
+	FILE *fp;
+
+	if (lsa_wire_mode != LSA_WIRE_OFF)
+		return (-1);
+	if ((fp = fopen(path, "w")) == NULL)
+		return (-1);
+	if (fwrite(LSA_WIRE_MAGIC, 1, LSA_WIRE_MAGICSZ, fp) !=
+	    LSA_WIRE_MAGICSZ) {
+		(void) fclose(fp);
+		return (-1);
+	}
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	lsa_wire_fp = fp;
+	lsa_wire_start = gethrtime();
+	lsa_wire_mode = LSA_WIRE_CAPTURE;
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+	return (0);
+}
+
+/*
+ * Load a trace and answer from it from now on, with the recorded delays
+ * if realtime is set and at once otherwise.
+ */
+int
+lsa_wire_replay(const char *path, boolean_t realtime)
+{
+	lsa_wire_ent_t *ents = NULL, *ent;
+	lsa_wire_rec_t rec;
+	uchar_t *buf;
+	FILE *fp;
+	int i, n = 0, cap = 0, r;
+
+	if (lsa_wire_mode != LSA_WIRE_OFF)
+		return (-1);
+	if ((fp = lsa_wire_open(path)) == NULL)
+		return (-1);
+	if ((buf = malloc(UINT16_MAX)) == NULL) {
+		(void) fclose(fp);
+		return (-1);
+	}
+
+	while ((r = lsa_wire_read(fp, &rec, buf, UINT16_MAX)) > 0) {
+		if (n == cap) {
+			cap = (cap == 0) ? 256 : cap * 2;
+			if ((ent = realloc(ents, cap * sizeof (*ent))) == NULL)
+				break;
+			ents = ent;
+		}
+		ent = &ents[n];
+		ent->lwe_rec = rec;
+		ent->lwe_used = B_FALSE;
+		if ((ent->lwe_data = malloc(rec.ltr_len + 1)) == NULL)
+			break;
+		(void) memcpy(ent->lwe_data, buf, rec.ltr_len);
+		ent->lwe_data[rec.ltr_len] = '\0';
+		n++;
+	}
+	free(buf);
+	(void) fclose(fp);
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	lsa_wire_ents = ents;
+	lsa_wire_nents = n;
+	if (r != 0) {
+		lsa_wire_unload();
+		(void) pthread_mutex_unlock(&lsa_wire_lock);
+		return (-1);
+	}
+	lsa_wire_link();
+	for (i = 0; i < LSA_WIRE_MAXFD; i++)
+		lsa_wire_fds[i].lwf_fd = -1;
+	lsa_wire_realtime = realtime;
+	lsa_wire_running = realtime && pthread_create(&lsa_wire_thread, NULL,
+	    lsa_wire_run, NULL) == 0;
+	lsa_wire_mode = LSA_WIRE_REPLAY;
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+	return (0);
+}
+
+/*
+ * Make every query and ping in the trace available to be matched again.
+ */
+void
+lsa_wire_rewind(void)
+{
+	int i;
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	for (i = 0; i < lsa_wire_nents; i++)
+		lsa_wire_ents[i].lwe_used = B_FALSE;
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+}
+
+/*
+ * End a capture or replay.  Sockets opened during a replay read EOF
+ * from then on.
+ */
+void
+lsa_wire_stop(void)
+{
+	boolean_t running;
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	if (lsa_wire_fp != NULL) {
+		(void) fclose(lsa_wire_fp);
+		lsa_wire_fp = NULL;
+	}
+	running = lsa_wire_running;
+	lsa_wire_running = B_FALSE;
+	(void) pthread_cond_broadcast(&lsa_wire_cv);
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+
+	if (running)
+		(void) pthread_join(lsa_wire_thread, NULL);
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	if (lsa_wire_mode == LSA_WIRE_REPLAY)
+		lsa_wire_reset();
+	lsa_wire_mode = LSA_WIRE_OFF;
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+}
+
+int
+lsa_wire_socket(int family, int type)
+{
+	lsa_wire_fd_t *lwf;
+	int sv[2];
+
+	if (lsa_wire_mode != LSA_WIRE_REPLAY)
+		return (socket(family, type, 0));
+
+	if (socketpair(AF_UNIX, type, 0, sv) != 0)
+		return (-1);
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	if ((lwf = lsa_wire_fd(-1)) != NULL) {
+		lwf->lwf_fd = sv[0];
+		lwf->lwf_peer = sv[1];
+		lwf->lwf_type = type;
+		(void) memset(&lwf->lwf_addr, 0, sizeof (lwf->lwf_addr));
+	}
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+
+	if (lwf == NULL) {
+		(void) close(sv[0]);
+		(void) close(sv[1]);
+		errno = EMFILE;
+		return (-1);
+	}
+	return (sv[0]);
+}
+
+int
+lsa_wire_connect(int fd, const struct sockaddr *sa, socklen_t salen)
+{
+	lsa_wire_fd_t *lwf;
+
+	if (lsa_wire_mode != LSA_WIRE_REPLAY)
+		return (connect(fd, sa, salen));
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	if ((lwf = lsa_wire_fd(fd)) != NULL)
+		lsa_wire_sa6(sa, &lwf->lwf_addr);
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+	return (0);
+}
+
+int
+lsa_wire_bind(int fd, const struct sockaddr *sa, socklen_t salen)
+{
+	if (lsa_wire_mode != LSA_WIRE_REPLAY)
+		return (bind(fd, sa, salen));
+	return (0);
+}
+
+int
+lsa_wire_close(int fd)
+{
+	lsa_wire_due_t *lwd, **pp;
+	lsa_wire_fd_t *lwf;
+
+	if (lsa_wire_mode == LSA_WIRE_REPLAY) {
+		(void) pthread_mutex_lock(&lsa_wire_lock);
+		if ((lwf = lsa_wire_fd(fd)) != NULL) {
+			(void) close(lwf->lwf_peer);
+			lwf->lwf_fd = -1;
+		}
+		for (pp = &lsa_wire_queue; (lwd = *pp) != NULL; ) {
+			if (lwd->lwd_fd == fd) {
+				*pp = lwd->lwd_next;
+				free(lwd);
+			} else {
+				pp = &lwd->lwd_next;
+			}
+		}
+		(void) pthread_mutex_unlock(&lsa_wire_lock);
+	}
+	return (close(fd));
+}
+
+/*
+ * Send a DNS query: one datagram, or one or more length-prefixed
+ * messages on a stream.
+ */
+ssize_t
+lsa_wire_send(int fd, const void *buf, size_t len, int flags)
+{
+	const uchar_t *cp = buf, *eom = cp + len;
+	lsa_wire_fd_t *lwf;
+	uint16_t mlen;
+	ssize_t r;
+
+	if (lsa_wire_mode != LSA_WIRE_REPLAY) {
+		r = send(fd, buf, len, flags);
+		if (r > 0 && lsa_wire_mode == LSA_WIRE_CAPTURE)
+			lsa_wire_put_fd(fd, LSA_WIRE_DNS_QUERY, buf, r,
+			    B_FALSE);
+		return (r);
+	}
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	if ((lwf = lsa_wire_fd(fd)) == NULL) {
+		/* opened before the replay started */
+		(void) pthread_mutex_unlock(&lsa_wire_lock);
+		errno = EPIPE;
+		return (-1);
+	}
+	if (lwf->lwf_type != SOCK_STREAM) {
+		lsa_wire_dns(lwf, cp, len);
+	} else {
+		while (eom - cp >= NS_INT16SZ) {
+			NS_GET16(mlen, cp);
+			if (mlen > eom - cp)
+				break;
+			lsa_wire_dns(lwf, cp, mlen);
+			cp += mlen;
+		}
+	}
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+	return (len);
+}
+
+/*
+ * Receive a DNS answer datagram.
+ */
+ssize_t
+lsa_wire_recv(int fd, void *buf, size_t len, int flags)
+{
+	struct sockaddr_in6 from;
+	struct msghdr msg;
+	struct iovec iov[2];
+	ssize_t r;
+
+	if (lsa_wire_mode != LSA_WIRE_REPLAY) {
+		r = recv(fd, buf, len, flags);
+		if (r > 0 && lsa_wire_mode == LSA_WIRE_CAPTURE)
+			lsa_wire_put_fd(fd, LSA_WIRE_DNS_ANSWER, buf, r,
+			    B_FALSE);
+		return (r);
+	}
+
+	(void) memset(&msg, 0, sizeof (msg));
+	iov[0].iov_base = &from;
+	iov[0].iov_len = sizeof (from);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if ((r = recvmsg(fd, &msg, flags)) < 0)
+		return (r);
+	return (MAX(r - (ssize_t)sizeof (from), 0));
+}
+
+/*
+ * Send pings; each message has one buffer.
+ */
+int
+lsa_wire_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags)
+{
+	struct msghdr *mh;
+	lsa_wire_fd_t *lwf;
+	int i, r;
+
+	if (lsa_wire_mode != LSA_WIRE_REPLAY) {
+		r = sendmmsg(fd, msgs, n, flags);
+		for (i = 0; i < r && lsa_wire_mode == LSA_WIRE_CAPTURE; i++) {
+			mh = &msgs[i].msg_hdr;
+			lsa_wire_put(LSA_WIRE_PING, 0, mh->msg_name,
+			    mh->msg_iov[0].iov_base, mh->msg_iov[0].iov_len);
+		}
+		return (r);
+	}
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	if ((lwf = lsa_wire_fd(fd)) != NULL)
+		for (i = 0; i < n; i++)
+			lsa_wire_ping(lwf, msgs[i].msg_hdr.msg_name);
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+	return (n);
+}
+
+/*
+ * Receive ping replies; each message has one buffer.
+ */
+int
+lsa_wire_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags)
+{
+	struct sockaddr_in6 from;
+	struct msghdr msg, *mh;
+	struct iovec iov[2];
+	ssize_t r;
+	int i;
+
+	if (lsa_wire_mode != LSA_WIRE_REPLAY) {
+		r = recvmmsg(fd, msgs, n, flags, NULL);
+		for (i = 0; i < r && lsa_wire_mode == LSA_WIRE_CAPTURE; i++) {
+			mh = &msgs[i].msg_hdr;
+			lsa_wire_put(LSA_WIRE_REPLY, 0, mh->msg_name,
+			    mh->msg_iov[0].iov_base, msgs[i].msg_len);
+		}
+		return (r);
+	}
+
+	for (i = 0; i < n; i++) {
+		mh = &msgs[i].msg_hdr;
+		(void) memset(&msg, 0, sizeof (msg));
+		iov[0].iov_base = &from;
+		iov[0].iov_len = sizeof (from);
+		iov[1] = mh->msg_iov[0];
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		if ((r = recvmsg(fd, &msg, (i == 0) ? flags :
+		    flags | MSG_DONTWAIT)) < (ssize_t)sizeof (from))
+			break;
+		mh->msg_namelen = MIN(mh->msg_namelen, sizeof (from));
+		(void) memcpy(mh->msg_name, &from, mh->msg_namelen);
+		msgs[i].msg_len = r - sizeof (from);
+	}
+
+	return ((i > 0) ? i : -1);
+}
+
+/*
+ * Capture a whole DNS message sent or read on a stream.
+ */
+void
+lsa_wire_note(int fd, lsa_wire_kind_t kind, const void *buf, size_t len)
+{
+	if (lsa_wire_mode == LSA_WIRE_CAPTURE)
+		lsa_wire_put_fd(fd, kind, buf, len, B_TRUE);
+}
+
+/*
+ * Fill ns with up to n of the nameservers queried in the trace, in the
+ * order they were first queried, and return how many there were.
+ */
+int
+lsa_wire_servers(struct sockaddr_in6 *ns, int n)
+{
+	const struct sockaddr_in6 *peer;
+	int i, j, nns = 0;
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	for (i = 0; i < lsa_wire_nents && nns < n; i++) {
+		if (lsa_wire_ents[i].lwe_rec.ltr_kind != LSA_WIRE_DNS_QUERY)
+			continue;
+		peer = &lsa_wire_ents[i].lwe_rec.ltr_peer;
+		for (j = 0; j < nns; j++)
+			if (ns[j].sin6_port == peer->sin6_port &&
+			    IN6_ARE_ADDR_EQUAL(&ns[j].sin6_addr,
+			    &peer->sin6_addr))
+				break;
+		if (j == nns)
+			ns[nns++] = *peer;
+	}
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+
+	return (nns);
+}
+
+/*
+ * Find the address a target was resolved to when the trace was taken.
+ */
+int
+lsa_wire_getaddr(const char *name, in6_addr_t *addr)
+{
+	lsa_wire_ent_t *ent;
+	int i, rc = -1;
+
+	(void) pthread_mutex_lock(&lsa_wire_lock);
+	for (i = 0; i < lsa_wire_nents; i++) {
+		ent = &lsa_wire_ents[i];
+		if (ent->lwe_rec.ltr_kind == LSA_WIRE_ADDR &&
+		    strcasecmp((char *)ent->lwe_data, name) == 0) {
+			*addr = ent->lwe_rec.ltr_peer.sin6_addr;
+			rc = 0;
+			break;
+		}
+	}
+	(void) pthread_mutex_unlock(&lsa_wire_lock);
+
+	return (rc);
+}
+
+void
+lsa_wire_addr(const char *name, const in6_addr_t *addr)
+{
+	struct sockaddr_in6 sin6;
+
+	if (lsa_wire_mode != LSA_WIRE_CAPTURE)
+		return;
+	(void) memset(&sin6, 0, sizeof (sin6));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_addr = *addr;
+	lsa_wire_put(LSA_WIRE_ADDR, 0, &sin6, name, strlen(name) + 1);
+}
+
+/*
+ * Capture the arguments of a locate as NUL-terminated strings, with the
+ * DomainGuid after them if there is one.
+ */
+void
+lsa_wire_locate(const char *prefix, const char *dname, const char *site,
+    const char *forest, const uint8_t *guid, uint32_t flags)
+{
+	const char *args[4];
+	char buf[4 * (NS_MAXDNAME + 1) + 16];
+	size_t len = 0, n;
+	int i;
+
+	if (lsa_wire_mode != LSA_WIRE_CAPTURE)
+		return;
+
+	args[0] = prefix;
+	args[1] = dname;
+	args[2] = site;
+	args[3] = forest;
+	for (i = 0; i < 4; i++) {
+		if (args[i] != NULL) {
+			n = strnlen(args[i], NS_MAXDNAME);
+			(void) memcpy(buf + len, args[i], n);
+			len += n;
+		}
+		buf[len++] = '\0';
+	}
+	if (guid != NULL) {
+		(void) memcpy(buf + len, guid, 16);
+		len += 16;
+	}
+	lsa_wire_put(LSA_WIRE_LOCATE, flags, NULL, buf, len);
+}
+
+void
+lsa_wire_lookup(const char *svcname, const char *dname)
+{
+	char buf[2 * (NS_MAXDNAME + 1)];
+	int len;
+
+	if (lsa_wire_mode != LSA_WIRE_CAPTURE)
+		return;
+
+	len = snprintf(buf, sizeof (buf), "%.*s%c%.*s", NS_MAXDNAME, svcname,
+	    '\0', NS_MAXDNAME, dname);
+	lsa_wire_put(LSA_WIRE_LOOKUP, 0, NULL, buf, len + 1);
+}
@@ -0,0 +1,117 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+#ifndef _LSA_WIRE_H
+#define _LSA_WIRE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+ * Capture and replay of the locator's traffic.
+ *
+ * While a capture runs, every DNS query and answer, CLDAP ping and reply,
+ * target address looked up by name, and locate or lookup started is
+ * appended to a trace file with the time it happened.  While a replay
+ * runs, the same calls talk to a loaded trace instead of the network:
+ * each query or ping is matched to a recorded one, and the recorded answer
+ * comes back after the recorded delay, or at once.  What went unanswered
+ * when the trace was taken goes unanswered again.
+ *
+ * The file is a header followed by records, each an lsa_wire_rec_t and
+ * ltr_len bytes of data, in host byte order.
+ */
+#define	LSA_WIRE_MAGIC		"LSAWIRE1"
+#define	LSA_WIRE_MAGICSZ	8
+
+typedef enum lsa_wire_kind {
+	LSA_WIRE_LOCATE = 1,	/* prefix, dname, site, forest, [guid] */
+	LSA_WIRE_LOOKUP,	/* lsa_srv_lookup(): svcname, dname */
+	LSA_WIRE_DNS_QUERY,
+	LSA_WIRE_DNS_ANSWER,
+	LSA_WIRE_PING,
+	LSA_WIRE_REPLY,
+	LSA_WIRE_ADDR		/* target resolved by name; data is the name */
+} lsa_wire_kind_t;
+
+#define	LSA_WIRE_TCP	0x1	/* ltr_flags of DNS records: over TCP */
+
+typedef struct lsa_wire_rec {
+	hrtime_t		ltr_time;	/* since the capture started */
+	uint16_t		ltr_kind;	/* LSA_WIRE_* */
+	uint16_t		ltr_len;	/* bytes of data that follow */
+	uint32_t		ltr_flags;	/* LSA_WIRE_TCP, or DCL_F_* */
+	struct sockaddr_in6	ltr_peer;	/* nameserver or DC */
+} lsa_wire_rec_t;
+
+typedef enum lsa_wire_mode {
+	LSA_WIRE_OFF = 0,
+	LSA_WIRE_CAPTURE,
+	LSA_WIRE_REPLAY
+} lsa_wire_mode_t;
+
+extern lsa_wire_mode_t lsa_wire_mode;
+
+int lsa_wire_capture(const char *);
+
+int lsa_wire_replay(const char *, boolean_t);
+
+void lsa_wire_rewind(void);
+
+void lsa_wire_stop(void);
+
+FILE *lsa_wire_open(const char *);
+
+int lsa_wire_read(FILE *, lsa_wire_rec_t *, uchar_t *, size_t);
+
+/*
+ * Socket calls for the locator's DNS and CLDAP traffic.  Without a capture
+ * or replay running they are the plain system calls.  Messages sent or
+ * read over TCP are not captured by these; note each one whole with
+ * lsa_wire_note() instead.
+ */
+int lsa_wire_socket(int, int);
+
+int lsa_wire_connect(int, const struct sockaddr *, socklen_t);
+
+int lsa_wire_bind(int, const struct sockaddr *, socklen_t);
+
+int lsa_wire_close(int);
+
+ssize_t lsa_wire_send(int, const void *, size_t, int);
+
+ssize_t lsa_wire_recv(int, void *, size_t, int);
+
+int lsa_wire_sendmmsg(int, struct mmsghdr *, unsigned int, int);
+
+int lsa_wire_recvmmsg(int, struct mmsghdr *, unsigned int, int);
+
+void lsa_wire_note(int, lsa_wire_kind_t, const void *, size_t);
+
+int lsa_wire_servers(struct sockaddr_in6 *, int);
+
+int lsa_wire_getaddr(const char *, in6_addr_t *);
+
+void lsa_wire_addr(const char *, const in6_addr_t *);
+
+void lsa_wire_locate(const char *, const char *, const char *, const char *,
+    const uint8_t *, uint32_t);
+
+void lsa_wire_lookup(const char *, const char *);
+
+#endif /* _LSA_WIRE_H */
@@ -0,0 +1,59 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Allocation counting by interposing on malloc/calloc/realloc.
+ */
+
+#include <stdlib.h>
+#include <dlfcn.h>
+#include "test_alloc.h"
+
+uint64_t test_nallocs;
+
+void *
+malloc(size_t size)
+{
+	static void *(*real_malloc)(size_t);
+
+	if (real_malloc == NULL)
+		real_malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+	test_nallocs++;
+	return (real_malloc(size));
+}
+
+void *
+calloc(size_t nelem, size_t size)
+{
+	static void *(*real_calloc)(size_t, size_t);
+
+	if (real_calloc == NULL)
+		real_calloc = (void *(*)(size_t, size_t))
+		    dlsym(RTLD_NEXT, "calloc");
+	test_nallocs++;
+	return (real_calloc(nelem, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	static void *(*real_realloc)(void *, size_t);
+
+	if (real_realloc == NULL)
+		real_realloc = (void *(*)(void *, size_t))
+		    dlsym(RTLD_NEXT, "realloc");
+	test_nallocs++;
+	return (real_realloc(ptr, size));
+}
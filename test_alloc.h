@@ -0,0 +1,27 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+#ifndef _TEST_ALLOC_H
+#define _TEST_ALLOC_H
+
+#include <inttypes.h>
+
+/*
+ * A program linked with test_alloc.c has its malloc/calloc/realloc calls
+ * counted here, for lsa_bench and dc_alloc_test.
+ */
+extern uint64_t test_nallocs;
+
+#endif /* _TEST_ALLOC_H */
@@ -0,0 +1,42 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+/*
+ * Pass/fail reporting for the make check programs.
+ */
+
+#include <stdio.h>
+#include "test_check.h"
+
+int test_failed;
+
+void
+test_check(int ok, const char *what)
+{
+	printf("%-50s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok)
+		test_failed++;
+}
+
+int
+test_done(void)
+{
+	if (test_failed != 0) {
+		printf("%d checks failed\n", test_failed);
+		return (1);
+	}
+	printf("all checks passed\n");
+	return (0);
+}
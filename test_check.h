@@ -0,0 +1,30 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * Copyright 2013 Nexenta Systems, Inc.  All rights reserved.
+ */
+
+#ifndef _TEST_CHECK_H
+#define _TEST_CHECK_H
+
+/*
+ * Checks for the make check programs, dc_alloc_test and dc_survey_test,
+ * linked with test_check.c.  Each check prints one line; test_done()
+ * prints the verdict and returns the program's exit status.
+ */
+extern int test_failed;
+
+void test_check(int, const char *);
+
+int test_done(void);
+
+#endif /* _TEST_CHECK_H */
@@ -1,10 +1,17 @@
 #include "dc_locate.h"
 #include "lsa_srv.h"
+#include "lsa_wire.h"
+#include "lsa_alloc.h"
+#include "lsa_metrics.h"
+#include "lsa_hosts.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <inttypes.h>
 
 void 
@@ -25,19 +32,82 @@ lsa_srv_output(lsa_srv_ctx_t *ctx)
 	printf("\n");
 }
 
+void
+dc_locate_trace(const dc_locate_stats_t *st)
+{
+	static const char *names[DCL_PHASE_MAX] = {
+		"start", "dns", "srv parse", "addr", "socket", "ping", "parse"
+	};
+	hrtime_t prev = st->dls_time[DCL_PHASE_START];
+	char buf[INET6_ADDRSTRLEN];
+	int i;
+
+	printf("locate %s.%s: status %d, %d candidates, %d pinged, "
+	    "%d timeouts\n", st->dls_prefix, st->dls_dname, st->dls_status,
+	    st->dls_candidates, st->dls_pinged, st->dls_timeouts);
+	for (i = DCL_PHASE_START + 1; i < DCL_PHASE_MAX; i++) {
+		if (st->dls_time[i] == 0)
+			continue;
+		printf("  %-10s %8.3f ms\n", names[i],
+		    (double)(st->dls_time[i] - prev) / (NANOSEC / MILLISEC));
+		prev = st->dls_time[i];
+	}
+	if (st->dls_status == 0) {
+		inet_ntop(AF_INET6, &st->dls_dcaddr.sin6_addr, buf,
+		    INET6_ADDRSTRLEN);
+		printf("  answered by %s (%s)\n", st->dls_dcname, buf);
+	}
+	printf("\n");
+}
+
 int 
 main(int argc, char *argv[])
 {
   	DOMAIN_CONTROLLER_INFO *dci;
-	int i;
+	lsa_alloc_stats_t las;
+	hrtime_t deadline = 0;
+	int i, metrics = 0, msec = 0;
 	
+	for (;;) {
+		if (argc > 2 && strcmp(argv[1], "-w") == 0) {
+			if (lsa_wire_capture(argv[2]) != 0) {
+				perror(argv[2]);
+				return 1;
+			}
+			argc -= 2;
+			argv += 2;
+		} else if (argc > 2 && strcmp(argv[1], "-h") == 0) {
+			if (lsa_hosts_load(argv[2]) != 0) {
+				perror(argv[2]);
+				return 1;
+			}
+			argc -= 2;
+			argv += 2;
+		} else if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+			msec = atoi(argv[2]);
+			argc -= 2;
+			argv += 2;
+		} else if (argc > 1 && strcmp(argv[1], "-m") == 0) {
+			metrics = 1;
+			argc--;
+			argv++;
+		} else {
+			break;
+		}
+	}
 	if (argc < 3) {
-		printf("usage: ./a.out prefix dname\n");
+		printf("usage: ./a.out [-m] [-h hosts] [-t msec] [-w trace] "
+		    "prefix dname [site]\n");
 		return 0;
 	}
 	
-	dci = dc_locate(argv[1], argv[2]);
+	if (msec > 0)
+		deadline = gethrtime() + (hrtime_t)msec * (NANOSEC / MILLISEC);
+	dci = dc_locate_ex(argv[1], argv[2], (argc > 3) ? argv[3] : NULL, 0,
+	    deadline);
 	
+	if (dci == NULL && errno == ETIMEDOUT)
+		printf("no DC answered in time\n");
 	if (dci != NULL) {
 		printf("DomainControllerName: %s\n", dci->DomainControllerName);
 		printf("DomainControllerAddress: %s\n", dci->DomainControllerAddress);
@@ -63,6 +133,17 @@ main(int argc, char *argv[])
 		printf("ClientSiteName: %s\n", dci->ClientSiteName);
 	}
 	freedci(dci);
+
+	lsa_alloc_stats(&las);
+	printf("\nallocations:\n");
+	for (i = 0; i < LSA_ALLOC_MAX; i++)
+		printf("  %-10s %6" PRIu64 " calls %8" PRIu64 " bytes\n",
+		    lsa_alloc_name(i), las.las_count[i], las.las_bytes[i]);
+	if (metrics) {
+		printf("\n");
+		(void) lsa_metrics_dump(stdout);
+	}
+	lsa_wire_stop();
 	return 0;
 }
  